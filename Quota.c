@@ -13,6 +13,7 @@
 #define std_fclose fclose
 #endif
 
+#include "include/tracker.h"
 #ifdef AFSQUOTA
 #include "include/afsquota.h"
 #endif
@@ -21,6 +22,16 @@
 #include "include/vxquotactl.h"
 #endif
 
+#ifdef MOUNTINFO
+#include "include/mountinfo.h"
+#endif
+
+#include "include/mntfilter.h"
+#include "include/devcache.h"
+#include "include/singleflight.h"
+#include "include/quotastat.h"
+#include "include/quotatrace.h"
+
 #ifndef AIX
 #ifndef NO_MNTENT
 FILE *mtab = NULL;
@@ -37,6 +48,16 @@ static struct vmount *mtab = NULL;
 static aix_mtab_idx, aix_mtab_count;
 #endif
 
+/* set by quota_setmntent_filter */
+static struct mntfilter *mntfilter = NULL;
+
+#ifdef MOUNTINFO
+/* replaces mtab while open */
+static struct mountinfo *mountinfo = NULL;
+static char *mountinfo_opts = NULL;
+static size_t mountinfo_optsize = 0;
+#endif
+
 #ifndef NO_RPC
 static struct
 {
@@ -52,7 +73,8 @@ static struct
   char hostname[MAX_MACHINE_NAME + 1];
 } quota_rpc_auth = { -1, -1, { 0 } };
 
-static const char *quota_rpc_strerror = NULL;
+/* per thread, like errno */
+static __thread const char *quota_rpc_strerror = NULL;
 
 struct quota_xs_nfs_rslt
 {
@@ -75,26 +97,34 @@ callaurpc (char *host, int prognum, int versnum, int procnum, xdrproc_t inproc,
            char *in, xdrproc_t outproc, char *out)
 {
   struct sockaddr_in remaddr;
-  struct hostent *hp;
+  struct addrinfo hints, *ai;
   enum clnt_stat clnt_stat;
   struct timeval rep_time, timeout;
   CLIENT *client;
   int socket = RPC_ANYSOCK;
+  uint64_t start = quotastat_start ();
 
   /*
    *  Get IP address; by default the port is determined via remote
    *  portmap daemon; different ports and protocols can be configured
    */
-  hp = gethostbyname (host);
-  if (hp == NULL)
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_family = AF_INET;
+  if (QUOTA_TRACE (hostlookup, PHP_QUOTA_TRACE_HOSTLOOKUP, host, -1L, 0L,
+                   getaddrinfo (host, NULL, &hints, &ai))
+      != 0)
     {
       quota_rpc_strerror = clnt_sperrno (RPC_UNKNOWNHOST);
+      errno = 0; /* RPC errors have no errno of their own */
+      quotastat_end (PHP_QUOTA_OP_RPC, start, 0, RPC_UNKNOWNHOST);
       return -1;
     }
 
   rep_time.tv_sec = quota_rpc_cfg.timeout / 1000;
   rep_time.tv_usec = (quota_rpc_cfg.timeout % 1000) * 1000;
-  memcpy ((char *)&remaddr.sin_addr, (char *)hp->h_addr, hp->h_length);
+  memcpy (&remaddr.sin_addr, &((struct sockaddr_in *)ai->ai_addr)->sin_addr,
+          sizeof (remaddr.sin_addr));
+  freeaddrinfo (ai);
   remaddr.sin_family = AF_INET;
   remaddr.sin_port = htons (quota_rpc_cfg.port);
 
@@ -120,6 +150,8 @@ callaurpc (char *host, int prognum, int versnum, int procnum, xdrproc_t inproc,
       else /* should never happen (may be due to inconsistent symbol resolution
             */
         quota_rpc_strerror = "RPC creation failed for unknown reasons";
+      errno = 0;
+      quotastat_end (PHP_QUOTA_OP_RPC, start, 0, rpc_createerr.cf_stat);
       return -1;
     }
 
@@ -142,7 +174,9 @@ callaurpc (char *host, int prognum, int versnum, int procnum, xdrproc_t inproc,
    */
   timeout.tv_sec = quota_rpc_cfg.timeout / 1000;
   timeout.tv_usec = (quota_rpc_cfg.timeout % 1000) * 1000;
-  clnt_stat = clnt_call (client, procnum, inproc, in, outproc, out, timeout);
+  clnt_stat = QUOTA_TRACE (
+      clnt_call, PHP_QUOTA_TRACE_CLNT_CALL, host, (long)procnum, (long)prognum,
+      clnt_call (client, procnum, inproc, in, outproc, out, timeout));
 
   if (client->cl_auth)
     {
@@ -154,10 +188,12 @@ callaurpc (char *host, int prognum, int versnum, int procnum, xdrproc_t inproc,
   if (clnt_stat != RPC_SUCCESS)
     {
       quota_rpc_strerror = clnt_sperrno (clnt_stat);
+      errno = 0;
+      quotastat_end (PHP_QUOTA_OP_RPC, start, 0, clnt_stat);
       return -1;
     }
-  else
-    return 0;
+  quotastat_end (PHP_QUOTA_OP_RPC, start, -1, -1);
+  return 0;
 }
 
 int
@@ -166,6 +202,13 @@ getnfsquota (char *hostp, char *fsnamep, int uid, int kind,
 {
   struct getquota_args gq_args;
   struct getquota_rslt gq_rslt;
+
+  if (kind == PHP_QUOTA_TYPE_PROJECT)
+    {
+      quota_rpc_strerror = "RPC: project quota not supported by RPC";
+      errno = ENOTSUP;
+      return -1;
+    }
 #ifdef USE_EXT_RQUOTA
   ext_getquota_args ext_gq_args;
 
@@ -357,8 +400,103 @@ ext_getquota_args *objp;
 
 #endif /* !NO_RPC */
 
-query_ret
-quota_query (char *dev, int uid, quota_type kind)
+/*
+ * probe whether quotas of the given kind are turned on for dev.
+ * Returns 0 if they are, the errno the backend reports for a disabled
+ * device if they are not, or -1 if it cannot be determined cheaply.
+ */
+static int
+quota_probe_state (char *dev, int kind)
+{
+  int saved_errno = errno;
+  int ret = -1;
+#if defined(SGI_XFS) && defined(linux)
+  if (!strncmp (dev, "(XFS)", 5))
+    {
+      fs_quota_stat_t fsq_stat;
+      int acct = ((kind == 2) ? FS_QUOTA_PDQ_ACCT
+                              : ((kind == 1) ? FS_QUOTA_GDQ_ACCT
+                                             : FS_QUOTA_UDQ_ACCT));
+
+      if (quotactl (QCMD (Q_XGETQSTAT, XQM_USRQUOTA), dev + 5, 0,
+                    CADR & fsq_stat)
+          == 0)
+        ret = ((fsq_stat.qs_flags & acct) ? 0 : ENOSYS);
+    }
+  else
+#endif
+    {
+#if defined(Q_CTL_V3) && !defined(USE_IOCTL) /* Linux */
+      if (*dev == '/')
+        {
+          if (linuxquota_probe (dev, kind) == 0)
+            ret = 0;
+          else if (errno == ESRCH)
+            ret = ESRCH;
+        }
+#endif
+    }
+  errno = saved_errno;
+  return ret;
+}
+
+/*
+ * fail early for devices on which quotas are known to be off.
+ * The state is cached per device, see devcache.c
+ */
+static int
+quota_check_state (char *dev, int kind)
+{
+  int err;
+
+  if (devcache_get_state (dev, kind, &err) != 0)
+    {
+      /* an undecided probe is cached too, so it runs once per TTL */
+      err = quota_probe_state (dev, kind);
+      devcache_set_state (dev, kind, err);
+    }
+  if (err > 0)
+    {
+      errno = err;
+      return -1;
+    }
+  return 0;
+}
+
+int
+quota_enabled (char *dev, quota_type kind)
+{
+  int err;
+#ifndef NO_RPC
+  quota_rpc_strerror = NULL;
+#endif
+  if (devcache_get_state (dev, kind, &err) != 0)
+    {
+      err = quota_probe_state (dev, kind);
+      devcache_set_state (dev, kind, err);
+    }
+  if (err < 0)
+    return -1;
+  return (err == 0);
+}
+
+int
+quota_kernel_stats (kernel_stats_ret *st)
+{
+#ifndef NO_RPC
+  quota_rpc_strerror = NULL;
+#endif
+#if defined(Q_CTL_V3) && !defined(USE_IOCTL)
+  return linuxquota_kernel_stats (st);
+#else
+  memset (st, 0, sizeof (*st));
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+static query_ret
+quota_query_dev (char *dev, int uid, quota_type kind)
 {
   query_ret ret;
   char *p = NULL;
@@ -366,6 +504,15 @@ quota_query (char *dev, int uid, quota_type kind)
 #ifndef NO_RPC
   quota_rpc_strerror = NULL;
 #endif
+  /* zero on failure; the result may be shared with other threads */
+  memset (&ret, 0, sizeof (ret));
+  if (!strncmp (dev, "(TRACK)", 7))
+    {
+      tracker_query (dev + 7, uid, kind, &ret);
+      return ret;
+    }
+  if (quota_check_state (dev, kind) != 0)
+    return ret;
 #ifdef SGI_XFS
   if (!strncmp (dev, "(XFS)", 5))
     {
@@ -525,7 +672,7 @@ quota_query (char *dev, int uid, quota_type kind)
           }
 #else           /* not USE_IOCTL */
 #ifdef Q_CTL_V3 /* Linux */
-        err = linuxquota_query (dev, uid, (kind != 0), &dqblk);
+        err = linuxquota_query (dev, uid, kind, &dqblk);
 #else           /* not Q_CTL_V3 */
 #ifdef Q_CTL_V2
 #ifdef AIX
@@ -588,9 +735,132 @@ quota_query (char *dev, int uid, quota_type kind)
   return ret;
 }
 
+/*
+ * Concurrent queries of the same entry are answered by a single call, see
+ * singleflight.c. errno is only touched if the query fails.
+ */
+query_ret
+quota_query (char *dev, int uid, quota_type kind)
+{
+  struct sf_call *call;
+  const char *rpcerr = NULL;
+  uint64_t start = quotastat_start ();
+  query_ret ret;
+  int saved = errno;
+  int err;
+
+  if (singleflight_enter (dev, uid, kind, &call, &ret, &err, &rpcerr) == 0)
+    {
+#ifndef NO_RPC
+      quota_rpc_strerror = rpcerr;
+#endif
+      quotastat_end (PHP_QUOTA_OP_QUERY, start,
+                     ((err != 0) || (rpcerr != NULL)) ? err : -1, -1);
+      if (err != 0)
+        errno = err;
+      return ret;
+    }
+
+  errno = 0;
+  ret = quota_query_dev (dev, uid, kind);
+  err = errno;
+#ifndef NO_RPC
+  rpcerr = quota_rpc_strerror;
+#endif
+  singleflight_leave (call, &ret, err, rpcerr);
+  quotastat_end (PHP_QUOTA_OP_QUERY, start,
+                 ((err != 0) || (rpcerr != NULL)) ? err : -1, -1);
+  if (err == 0)
+    errno = saved;
+  return ret;
+}
+
+unsigned int
+quota_block_size (char *dev)
+{
+  return strncmp (dev, "(XFS)", 5) ? 1024 : 512;
+}
+
 int
-quota_setqlim (char *dev, int uid, double bs, double bh, double fs, double fh,
-               int timelimflag, quota_type kind)
+quota_query_next (char *dev, unsigned int *id, quota_type kind,
+                  query_ret *ret)
+{
+  int err;
+#ifndef NO_RPC
+  quota_rpc_strerror = NULL;
+#endif
+  if (!strncmp (dev, "(TRACK)", 7))
+    return tracker_query_next (dev + 7, id, kind, ret);
+  if (quota_check_state (dev, kind) != 0)
+    return -1;
+#if defined(SGI_XFS) && defined(linux)
+  if (!strncmp (dev, "(XFS)", 5))
+    {
+      fs_disk_quota_t xfs_dqblk;
+
+      err = quotactl (
+          QCMD (Q_XGETNEXTQUOTA,
+                ((kind == 2) ? XQM_PRJQUOTA
+                             : ((kind == 1) ? XQM_GRPQUOTA : XQM_USRQUOTA))),
+          dev + 5, *id, CADR & xfs_dqblk);
+      if (!err)
+        {
+          *id = xfs_dqblk.d_id;
+          ret->bc = xfs_dqblk.d_bcount;
+          ret->bs = xfs_dqblk.d_blk_softlimit;
+          ret->bh = xfs_dqblk.d_blk_hardlimit;
+          ret->bt = xfs_dqblk.d_btimer;
+          ret->fc = xfs_dqblk.d_icount;
+          ret->fs = xfs_dqblk.d_ino_softlimit;
+          ret->fh = xfs_dqblk.d_ino_hardlimit;
+          ret->ft = xfs_dqblk.d_itimer;
+        }
+    }
+  else
+#endif
+    {
+#if defined(Q_CTL_V3) && !defined(USE_IOCTL) /* Linux */
+      struct dqblk dqblk;
+
+      if (*dev != '/')
+        {
+          /* there is no way to enumerate remote or AFS quotas */
+          errno = ENOTSUP;
+          err = -1;
+        }
+      else
+        {
+          err = linuxquota_query_next (dev, id, kind, &dqblk);
+          if (!err)
+            {
+              ret->bc = dqblk.QS_BCUR;
+              ret->bs = dqblk.QS_BSOFT;
+              ret->bh = dqblk.QS_BHARD;
+              ret->bt = dqblk.QS_BTIME;
+              ret->fc = dqblk.QS_FCUR;
+              ret->fs = dqblk.QS_FSOFT;
+              ret->fh = dqblk.QS_FHARD;
+              ret->ft = dqblk.QS_FTIME;
+            }
+        }
+#else
+      errno = ENOTSUP;
+      err = -1;
+#endif
+    }
+  /* ENOENT either marks the end of the table or a missing device */
+  if (err && (errno == ENOENT)
+      && (access ((*dev == '(') ? strchr (dev, ')') + 1 : dev, F_OK) == 0))
+    {
+      errno = 0;
+      err = 1;
+    }
+  return err;
+}
+
+static int
+quota_setqlim_dev (char *dev, int uid, double bs, double bh, double fs,
+                   double fh, int timelimflag, quota_type kind)
 {
   int ret;
   if (timelimflag != 0)
@@ -786,7 +1056,7 @@ quota_setqlim (char *dev, int uid, double bs, double bh, double fs, double fh,
           ret = -1;
 #else           /* not USE_IOCTL */
 #ifdef Q_CTL_V3 /* Linux */
-        ret = linuxquota_setqlim (dev, uid, (kind != 0), &dqblk);
+        ret = linuxquota_setqlim (dev, uid, kind, &dqblk);
 #else           /* not Q_CTL_V3 */
 #ifdef Q_CTL_V2
         ret = quotactl (dev,
@@ -804,12 +1074,183 @@ quota_setqlim (char *dev, int uid, double bs, double bh, double fs, double fh,
 }
 
 int
-quota_sync (char *dev)
+quota_setqlim (char *dev, int uid, double bs, double bh, double fs, double fh,
+               int timelimflag, quota_type kind)
+{
+  uint64_t start = quotastat_start ();
+  int ret;
+
+  ret = quota_setqlim_dev (dev, uid, bs, bh, fs, fh, timelimflag, kind);
+  quotastat_end (PHP_QUOTA_OP_SETQLIM, start, (ret != 0) ? errno : -1, -1);
+  return ret;
+}
+
+int
+quota_setqlim_many (char *dev, setqlim_entry *entries, int n, quota_type kind,
+                    int *status)
+{
+  int failed = 0;
+  int i;
+
+  for (i = 0; i < n; i++)
+    {
+      errno = 0;
+      if (quota_setqlim (dev, entries[i].uid, entries[i].bs, entries[i].bh,
+                         entries[i].fs, entries[i].fh, entries[i].timelimflag,
+                         kind)
+          == 0)
+        {
+          status[i] = 0;
+        }
+      else
+        {
+          status[i] = (errno != 0) ? errno : EIO;
+          failed++;
+        }
+    }
+  /* per-entry errors are reported through status[] only */
+#ifndef NO_RPC
+  quota_rpc_strerror = NULL;
+#endif
+  errno = 0;
+  return failed;
+}
+
+static int
+quota_setqlim_fields_dev (char *dev, int uid, query_ret *vals, int mask,
+                          quota_type kind)
 {
   int ret;
 #ifndef NO_RPC
   quota_rpc_strerror = NULL;
 #endif
+  if (quota_check_state (dev, kind) != 0)
+    return -1;
+#ifdef SGI_XFS
+  if (!strncmp (dev, "(XFS)", 5))
+    {
+      fs_disk_quota_t xfs_dqblk;
+
+      memset (&xfs_dqblk, 0, sizeof (xfs_dqblk));
+      xfs_dqblk.d_version = FS_DQUOT_VERSION;
+      xfs_dqblk.d_flags
+          = ((kind == 2) ? XFS_PROJ_QUOTA
+                         : ((kind == 1) ? XFS_GROUP_QUOTA : XFS_USER_QUOTA));
+      xfs_dqblk.d_id = uid;
+      /* basic blocks, as quota_query returns them */
+      xfs_dqblk.d_bcount = vals->bc;
+      xfs_dqblk.d_blk_softlimit = vals->bs;
+      xfs_dqblk.d_blk_hardlimit = vals->bh;
+      xfs_dqblk.d_btimer = vals->bt;
+      xfs_dqblk.d_icount = vals->fc;
+      xfs_dqblk.d_ino_softlimit = vals->fs;
+      xfs_dqblk.d_ino_hardlimit = vals->fh;
+      xfs_dqblk.d_itimer = vals->ft;
+      xfs_dqblk.d_fieldmask
+          = (((mask & PHP_QUOTA_FIELD_BC) ? FS_DQ_BCOUNT : 0)
+             | ((mask & PHP_QUOTA_FIELD_BS) ? FS_DQ_BSOFT : 0)
+             | ((mask & PHP_QUOTA_FIELD_BH) ? FS_DQ_BHARD : 0)
+             | ((mask & PHP_QUOTA_FIELD_BT) ? FS_DQ_BTIMER : 0)
+             | ((mask & PHP_QUOTA_FIELD_FC) ? FS_DQ_ICOUNT : 0)
+             | ((mask & PHP_QUOTA_FIELD_FS) ? FS_DQ_ISOFT : 0)
+             | ((mask & PHP_QUOTA_FIELD_FH) ? FS_DQ_IHARD : 0)
+             | ((mask & PHP_QUOTA_FIELD_FT) ? FS_DQ_ITIMER : 0));
+#ifndef linux
+      ret = quotactl (Q_XSETQLIM, dev + 5, uid, CADR & xfs_dqblk);
+#else
+      ret = quotactl (
+          QCMD (Q_XSETQLIM,
+                ((kind == 2) ? XQM_PRJQUOTA
+                             : ((kind == 1) ? XQM_GRPQUOTA : XQM_USRQUOTA))),
+          dev + 5, uid, CADR & xfs_dqblk);
+#endif
+    }
+  else
+#endif
+#if defined(Q_CTL_V3) && !defined(USE_IOCTL) /* Linux */
+      if (*dev != '(')
+    {
+      struct dqblk dqblk;
+
+      dqblk.QS_BCUR = vals->bc;
+      dqblk.QS_BSOFT = vals->bs;
+      dqblk.QS_BHARD = vals->bh;
+      dqblk.QS_BTIME = vals->bt;
+      dqblk.QS_FCUR = vals->fc;
+      dqblk.QS_FSOFT = vals->fs;
+      dqblk.QS_FHARD = vals->fh;
+      dqblk.QS_FTIME = vals->ft;
+      ret = linuxquota_setqlim_fields (dev, uid, kind, &dqblk, mask);
+    }
+  else
+#endif
+    {
+      /* no field mask on this platform: read, merge and write back */
+      query_ret cur;
+
+      if (mask
+          & (PHP_QUOTA_FIELD_BC | PHP_QUOTA_FIELD_BT | PHP_QUOTA_FIELD_FC
+             | PHP_QUOTA_FIELD_FT))
+        {
+          errno = ENOTSUP;
+          ret = -1;
+        }
+      else
+        {
+          errno = 0;
+          cur = quota_query (dev, uid, kind);
+#ifndef NO_RPC
+          if ((errno != 0) || (quota_rpc_strerror != NULL))
+#else
+          if (errno != 0)
+#endif
+            ret = -1;
+          else
+            ret = quota_setqlim_dev (
+                dev, uid, (mask & PHP_QUOTA_FIELD_BS) ? vals->bs : cur.bs,
+                (mask & PHP_QUOTA_FIELD_BH) ? vals->bh : cur.bh,
+                (mask & PHP_QUOTA_FIELD_FS) ? vals->fs : cur.fs,
+                (mask & PHP_QUOTA_FIELD_FH) ? vals->fh : cur.fh, 0, kind);
+        }
+    }
+  return ret;
+}
+
+int
+quota_setqlim_fields (char *dev, int uid, query_ret *vals, int mask,
+                      quota_type kind)
+{
+  uint64_t start = quotastat_start ();
+  int ret;
+
+  ret = quota_setqlim_fields_dev (dev, uid, vals, mask, kind);
+  quotastat_end (PHP_QUOTA_OP_SETQLIM, start, (ret != 0) ? errno : -1, -1);
+  return ret;
+}
+
+static int
+quota_sync_dev (char *dev)
+{
+  int ret, kind, err = 0;
+#ifndef NO_RPC
+  quota_rpc_strerror = NULL;
+#endif
+  if ((dev != NULL) && (*dev != 0))
+    {
+      /* the sync covers all kinds; fail early only if none of them is on */
+      for (kind = 0; kind < 3; kind++)
+        {
+          if (quota_check_state (dev, kind) == 0)
+            break;
+          if (kind == 0)
+            err = errno;
+        }
+      if (kind == 3)
+        {
+          errno = err;
+          return -1;
+        }
+    }
 #ifdef SOLARIS_VXFS
   if ((dev != NULL) && !strncmp (dev, "(VXFS)", 6))
     {
@@ -915,13 +1356,171 @@ quota_sync (char *dev)
 #endif /* NETBSD_LIBQUOTA */
 }
 
+int
+quota_sync (char *dev)
+{
+  uint64_t start = quotastat_start ();
+  int ret;
+
+  ret = quota_sync_dev (dev);
+  quotastat_end (PHP_QUOTA_OP_SYNC, start, (ret != 0) ? errno : -1, -1);
+  return ret;
+}
+
+int
+quota_getinfo (char *dev, quota_type kind, info_ret *info)
+{
+  int ret;
+#ifndef NO_RPC
+  quota_rpc_strerror = NULL;
+#endif
+  if (devcache_get_info (dev, kind, info) == 0)
+    return 0;
+
+#ifdef SGI_XFS
+  if (!strncmp (dev, "(XFS)", 5))
+    {
+#ifdef linux
+      int xqm_type = ((kind == 2) ? XQM_PRJQUOTA
+                                  : ((kind == 1) ? XQM_GRPQUOTA : XQM_USRQUOTA));
+      struct fs_quota_statv fsq_statv;
+
+      memset (&fsq_statv, 0, sizeof (fsq_statv));
+      fsq_statv.qs_version = FS_QSTATV_VERSION1;
+      ret = quotactl (QCMD (Q_XGETQSTATV, xqm_type), dev + 5, 0,
+                      CADR & fsq_statv);
+      if (ret == 0)
+        {
+          info->bgrace = fsq_statv.qs_btimelimit;
+          info->igrace = fsq_statv.qs_itimelimit;
+          info->flags = fsq_statv.qs_flags;
+          info->format = PHP_QUOTA_FORMAT_XFS;
+        }
+      else if (errno == EINVAL)
+#endif
+        {
+          /* kernel predates the versioned status call */
+          fs_quota_stat_t fsq_stat;
+
+#ifdef linux
+          ret = quotactl (QCMD (Q_XGETQSTAT, xqm_type), dev + 5, 0,
+                          CADR & fsq_stat);
+#else
+          ret = quotactl (Q_GETQSTAT, dev + 5, 0, CADR & fsq_stat);
+#endif
+          if (ret == 0)
+            {
+              info->bgrace = fsq_stat.qs_btimelimit;
+              info->igrace = fsq_stat.qs_itimelimit;
+              info->flags = fsq_stat.qs_flags;
+              info->format = PHP_QUOTA_FORMAT_XFS;
+            }
+        }
+    }
+  else
+#endif
+#if defined(Q_CTL_V3) && !defined(USE_IOCTL) /* Linux */
+      if (*dev != '(')
+    {
+      ret = linuxquota_getinfo (dev, kind, info);
+    }
+  else
+#endif
+    {
+      errno = ENOTSUP;
+      ret = -1;
+    }
+
+  if (ret == 0)
+    devcache_set_info (dev, kind, info);
+  return ret;
+}
+
+int
+quota_setinfo (char *dev, quota_type kind, info_ret *info, int mask)
+{
+  int ret;
+#ifndef NO_RPC
+  quota_rpc_strerror = NULL;
+#endif
+#ifdef SGI_XFS
+  if (!strncmp (dev, "(XFS)", 5))
+    {
+      /* XFS keeps the grace times in the timers of the id 0 dquot */
+      fs_disk_quota_t xfs_dqblk;
+
+      if (mask & PHP_QUOTA_INFO_FLAGS)
+        {
+          errno = ENOTSUP;
+          ret = -1;
+        }
+      else
+        {
+          memset (&xfs_dqblk, 0, sizeof (xfs_dqblk));
+          xfs_dqblk.d_version = FS_DQUOT_VERSION;
+          xfs_dqblk.d_flags
+              = ((kind == 2) ? XFS_PROJ_QUOTA
+                             : ((kind == 1) ? XFS_GROUP_QUOTA : XFS_USER_QUOTA));
+          xfs_dqblk.d_btimer = info->bgrace;
+          xfs_dqblk.d_itimer = info->igrace;
+          xfs_dqblk.d_fieldmask
+              = (((mask & PHP_QUOTA_INFO_BGRACE) ? FS_DQ_BTIMER : 0)
+                 | ((mask & PHP_QUOTA_INFO_IGRACE) ? FS_DQ_ITIMER : 0));
+#ifndef linux
+          ret = quotactl (Q_XSETQLIM, dev + 5, 0, CADR & xfs_dqblk);
+#else
+          ret = quotactl (
+              QCMD (Q_XSETQLIM,
+                    ((kind == 2)
+                         ? XQM_PRJQUOTA
+                         : ((kind == 1) ? XQM_GRPQUOTA : XQM_USRQUOTA))),
+              dev + 5, 0, CADR & xfs_dqblk);
+#endif
+        }
+    }
+  else
+#endif
+#if defined(Q_CTL_V3) && !defined(USE_IOCTL) /* Linux */
+      if (*dev != '(')
+    {
+      ret = linuxquota_setinfo (dev, kind, info, mask);
+    }
+  else
+#endif
+    {
+      errno = ENOTSUP;
+      ret = -1;
+    }
+
+  devcache_drop_info (dev, kind);
+  return ret;
+}
+
 query_ret
 quota_rpcquery (char *host, char *path, int uid, quota_type kind)
 {
   query_ret ret;
 #ifndef NO_RPC
   struct quota_xs_nfs_rslt rslt;
+  struct sf_call *call = NULL;
+  char key[MAX_MACHINE_NAME + MAXPATHLEN + 2];
+  int saved = errno;
+  int err;
+
+  /* shares in-flight calls with quota_query on "host:path" */
   quota_rpc_strerror = NULL;
+  memset (&ret, 0, sizeof (ret));
+  if ((snprintf (key, sizeof (key), "%s:%s", host, path) < sizeof (key))
+      && (singleflight_enter (key, uid, kind, &call, &ret, &err,
+                              &quota_rpc_strerror)
+          == 0))
+    {
+      if (err != 0)
+        errno = err;
+      return ret;
+    }
+
+  errno = 0;
   if (getnfsquota (host, path, uid, kind, &rslt) == 0)
     {
       ret.bc = rslt.bcur;
@@ -933,6 +1532,10 @@ quota_rpcquery (char *host, char *path, int uid, quota_type kind)
       ret.fh = rslt.fhard;
       ret.ft = rslt.ftime;
     }
+  err = errno;
+  singleflight_leave (call, &ret, err, quota_rpc_strerror);
+  if (err == 0)
+    errno = saved;
 #else
   errno = ENOTSUP;
 #endif
@@ -995,19 +1598,75 @@ quota_rpcauth (int uid, int gid, char *hostname)
   return ret;
 }
 
+#ifdef MOUNTINFO
+/*
+ * options as in /proc/mounts: the per mount ones followed by those of the
+ * super block, where the usrquota etc. options are; rw/ro is in both
+ */
+static char *
+mountinfo_join (const char *opts, const char *super)
+{
+  size_t len;
+
+  if (!strncmp (super, "rw", 2) || !strncmp (super, "ro", 2))
+    {
+      if (super[2] == '\0')
+        super += 2;
+      else if (super[2] == ',')
+        super += 3;
+    }
+  len = strlen (opts) + strlen (super) + 2;
+  if (len > mountinfo_optsize)
+    {
+      char *p = realloc (mountinfo_opts, len);
+
+      if (p == NULL)
+        return (char *)opts;
+      mountinfo_opts = p;
+      mountinfo_optsize = len;
+    }
+  if (*super != '\0')
+    snprintf (mountinfo_opts, len, "%s,%s", opts, super);
+  else
+    snprintf (mountinfo_opts, len, "%s", opts);
+  return mountinfo_opts;
+}
+#endif
+
 int
 quota_setmntent ()
 {
+  uint64_t start = quotastat_start ();
   int ret;
 #ifndef NO_RPC
   quota_rpc_strerror = NULL;
+#endif
+  mntfilter_free (mntfilter);
+  mntfilter = NULL;
+#ifdef MOUNTINFO
+  mountinfo_close (mountinfo);
+  mountinfo = QUOTA_TRACE (mnttab, PHP_QUOTA_TRACE_MNTTAB, MOUNTINFO, -1L, 0L,
+                           mountinfo_open (MOUNTINFO));
+  if (mountinfo != NULL)
+    {
+      if (mtab != NULL)
+        {
+          endmntent (mtab);
+          mtab = NULL;
+        }
+      quotastat_end (PHP_QUOTA_OP_MNTENT, start, -1, -1);
+      return 0;
+    }
+  /* no procfs; read MOUNTED instead */
 #endif
 #ifndef AIX
 #ifndef NO_MNTENT
 #ifndef NO_OPEN_MNTTAB
   if (mtab != NULL)
     endmntent (mtab);
-  if ((mtab = setmntent (MOUNTED, "r")) == NULL)
+  if ((mtab = QUOTA_TRACE (mnttab, PHP_QUOTA_TRACE_MNTTAB, MOUNTED, -1L, 0L,
+                           setmntent (MOUNTED, "r")))
+      == NULL)
 #else
   if (mtab != NULL)
     fclose (mtab);
@@ -1060,24 +1719,67 @@ quota_setmntent ()
       ret = -1;
     }
 #endif
+  quotastat_end (PHP_QUOTA_OP_MNTENT, start, (ret != 0) ? errno : -1, -1);
   return ret;
 }
 
-getmntent_ret
-quota_getmntent ()
+int
+quota_setmntent_filter (mntent_filter *filter)
 {
+  struct mntfilter *f = NULL;
+
+  if ((filter != NULL) && ((f = mntfilter_new (filter)) == NULL))
+    return -1;
+  if (quota_setmntent () != 0)
+    {
+      mntfilter_free (f);
+      return -1;
+    }
+  mntfilter = f;
+  return 0;
+}
+
+static getmntent_ret
+quota_getmntent_next ()
+{
+  uint64_t start = quotastat_start ();
   getmntent_ret ret;
+  ret.dev = ret.path = ret.type = ret.opts = NULL;
   ret.freemask = 0;
+  ret.mnt_id = ret.parent_id = ret.dev_major = ret.dev_minor = 0;
 #ifndef NO_RPC
   quota_rpc_strerror = NULL;
 #endif
+#ifdef MOUNTINFO
+  if (mountinfo != NULL)
+    {
+      struct mountinfo_entry ent;
+
+      if (QUOTA_TRACE (mnttab, PHP_QUOTA_TRACE_MNTTAB, MOUNTINFO, -1L, 1L,
+                       mountinfo_next (mountinfo, &ent))
+          == 0)
+        {
+          ret.dev = ent.source;
+          ret.path = ent.path;
+          ret.type = ent.type;
+          ret.opts = mountinfo_join (ent.opts, ent.super);
+          ret.mnt_id = ent.id;
+          ret.parent_id = ent.parent;
+          ret.dev_major = ent.major;
+          ret.dev_minor = ent.minor;
+        }
+      quotastat_end (PHP_QUOTA_OP_MNTENT, start, -1, -1);
+      return ret;
+    }
+#endif
 #ifndef AIX
 #ifndef NO_MNTENT
 #ifndef NO_OPEN_MNTTAB
   struct mntent *mntp;
   if (mtab != NULL)
     {
-      mntp = getmntent (mtab);
+      mntp = QUOTA_TRACE (mnttab, PHP_QUOTA_TRACE_MNTTAB, MOUNTED, -1L, 1L,
+                          getmntent (mtab));
       if (mntp != NULL)
         {
           ret.dev = mntp->mnt_fsname;
@@ -1221,9 +1923,25 @@ quota_getmntent ()
     }
 #endif
 
+  quotastat_end (PHP_QUOTA_OP_MNTENT, start, -1, -1);
   return ret;
 }
 
+getmntent_ret
+quota_getmntent ()
+{
+  getmntent_ret ret;
+
+  for (;;)
+    {
+      ret = quota_getmntent_next ();
+      if ((ret.dev == NULL) || (mntfilter == NULL)
+          || mntfilter_match (mntfilter, &ret))
+        return ret;
+      quota_getmntent_free (ret);
+    }
+}
+
 void
 quota_getmntent_free (getmntent_ret ret)
 {
@@ -1250,6 +1968,12 @@ quota_endmntent ()
 {
 #ifndef NO_RPC
   quota_rpc_strerror = NULL;
+#endif
+  mntfilter_free (mntfilter);
+  mntfilter = NULL;
+#ifdef MOUNTINFO
+  mountinfo_close (mountinfo);
+  mountinfo = NULL;
 #endif
   if (mtab != NULL)
     {
@@ -1304,6 +2028,19 @@ quota_getqcargtype ()
   return ret;
 }
 
+/*
+ * report an RPC error that happened elsewhere, i.e. in quota-cached
+ */
+void
+quota_rpc_seterror (const char *msg)
+{
+#ifndef NO_RPC
+  quota_rpc_strerror = msg;
+#else
+  errno = EIO;
+#endif
+}
+
 const char *
 quota_strerr ()
 {
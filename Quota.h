@@ -6,6 +6,7 @@
 typedef enum quota_type {
     PHP_QUOTA_TYPE_USER = 0,
     PHP_QUOTA_TYPE_GROUP = 1,
+    PHP_QUOTA_TYPE_PROJECT = 2, // Linux only
 } quota_type;
 
 typedef struct query_ret
@@ -13,6 +14,184 @@ typedef struct query_ret
   uint64_t bc, bs, bh, bt, fc, fs, fh, ft;
 } query_ret;
 
+// Selects members of query_ret for quota_setqlim_fields.
+typedef enum quota_field {
+    PHP_QUOTA_FIELD_BC = 1,
+    PHP_QUOTA_FIELD_BS = 2,
+    PHP_QUOTA_FIELD_BH = 4,
+    PHP_QUOTA_FIELD_BT = 8,
+    PHP_QUOTA_FIELD_FC = 16,
+    PHP_QUOTA_FIELD_FS = 32,
+    PHP_QUOTA_FIELD_FH = 64,
+    PHP_QUOTA_FIELD_FT = 128,
+} quota_field;
+
+// Per-filesystem quota information. Grace times are in seconds, flags are
+// passed through from the kernel (dqi_flags, or qs_flags for XFS).
+typedef struct info_ret
+{
+  uint64_t bgrace, igrace;
+  uint32_t flags;
+  uint32_t format;
+} info_ret;
+
+typedef enum quota_info_field {
+    PHP_QUOTA_INFO_BGRACE = 1,
+    PHP_QUOTA_INFO_IGRACE = 2,
+    PHP_QUOTA_INFO_FLAGS = 4,
+} quota_info_field;
+
+// Values of info_ret.format; the Linux ones match the kernel's QFMT_* ids.
+typedef enum quota_format {
+    PHP_QUOTA_FORMAT_UNKNOWN = 0,
+    PHP_QUOTA_FORMAT_VFS_OLD = 1,
+    PHP_QUOTA_FORMAT_VFS_V0 = 2,
+    PHP_QUOTA_FORMAT_OCFS2 = 3,
+    PHP_QUOTA_FORMAT_VFS_V1 = 4,
+    PHP_QUOTA_FORMAT_XFS = 16,
+} quota_format;
+
+typedef enum quota_dump_format {
+    PHP_QUOTA_DUMP_CSV = 0,
+    PHP_QUOTA_DUMP_JSONL = 1,
+    PHP_QUOTA_DUMP_BINARY = 2,
+} quota_dump_format;
+
+// Record of PHP_QUOTA_DUMP_BINARY output, in host byte order (72 bytes).
+typedef struct dump_record
+{
+  uint32_t id;
+  uint32_t kind;
+  query_ret q;
+} dump_record;
+
+// Memory-mapped columnar copy of a quota table, see snapshot.c
+typedef struct quota_snapshot quota_snapshot;
+
+typedef enum quota_diff_change {
+    PHP_QUOTA_DIFF_ADDED = 1,
+    PHP_QUOTA_DIFF_REMOVED = 2,
+    PHP_QUOTA_DIFF_CHANGED = 3,
+} quota_diff_change;
+
+// One row of quota_diff output. fields holds the quota_field bits that
+// differ for PHP_QUOTA_DIFF_CHANGED; old_q is unset for added ids and new_q
+// for removed ones.
+typedef struct diff_entry
+{
+  uint32_t id;
+  uint16_t change;
+  uint16_t fields;
+  query_ret old_q;
+  query_ret new_q;
+} diff_entry;
+
+// Per-id usage history of one device and kind, see history.c
+typedef struct quota_history quota_history;
+
+// Shared reservation ledger for write admission, see ledger.c
+typedef struct quota_ledger quota_ledger;
+
+typedef struct history_sample
+{
+  uint64_t when;
+  uint64_t bc, fc;
+} history_sample;
+
+// Usage trend of one id. brate and frate are the least squares growth of
+// bc and fc per second; the *_eta members hold the time at which usage
+// reaches the limit, 0 if it already has and -1 if it never will.
+typedef struct forecast_ret
+{
+  uint64_t samples;
+  uint64_t when;
+  uint64_t bc, fc;
+  double brate, frate;
+  int64_t bs_eta, bh_eta, fs_eta, fh_eta;
+} forecast_ret;
+
+// Operations counted by quota_stats
+typedef enum quota_op {
+    PHP_QUOTA_OP_QUERY = 0,
+    PHP_QUOTA_OP_SETQLIM = 1,
+    PHP_QUOTA_OP_SYNC = 2,
+    PHP_QUOTA_OP_RPC = 3, // one rquota call, part of an NFS query
+    PHP_QUOTA_OP_MNTENT = 4, // quota_setmntent and quota_getmntent
+    PHP_QUOTA_OP_COUNT = 5
+} quota_op;
+
+// Array sizes in quota_op_stats
+typedef enum quota_stat_size {
+    PHP_QUOTA_STAT_BUCKETS = 24,
+    PHP_QUOTA_STAT_ERRNOS = 128,
+    PHP_QUOTA_STAT_RPCSTATS = 32
+} quota_stat_size;
+
+// Counters of one operation. latency[i] counts calls that took less than
+// 2^i microseconds (the last bucket takes all slower ones). errnos[] counts
+// failures by errno; errnos[0] those without one, i.e. RPC errors, whose
+// clnt_stat is counted in rpc_status[] of PHP_QUOTA_OP_RPC.
+typedef struct quota_op_stats
+{
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t total_us;
+  uint64_t latency[24];
+  uint64_t errnos[128];
+  uint64_t rpc_status[32];
+} quota_op_stats;
+
+// Backend calls reported to quota_trace_set callbacks
+typedef enum quota_trace_point {
+    PHP_QUOTA_TRACE_QUOTACTL = 0,
+    PHP_QUOTA_TRACE_CLNT_CALL = 1,
+    PHP_QUOTA_TRACE_HOSTLOOKUP = 2,
+    PHP_QUOTA_TRACE_MNTTAB = 3
+} quota_trace_point;
+
+typedef enum quota_trace_phase {
+    PHP_QUOTA_TRACE_ENTRY = 0,
+    PHP_QUOTA_TRACE_EXIT = 1
+} quota_trace_phase;
+
+// target is the device, host or mount table file; id the quota id (the
+// procedure number for clnt_call) and cmd the quotactl command (the
+// program number for clnt_call). ret, err and duration_ns are only set on
+// exit.
+typedef struct trace_event
+{
+  uint32_t point;
+  uint32_t phase;
+  const char *target;
+  int64_t id;
+  int64_t cmd;
+  int64_t ret;
+  int32_t err;
+  uint32_t reserved;
+  uint64_t duration_ns;
+} trace_event;
+
+typedef void (*quota_trace_fn) (trace_event *ev, void *arg);
+
+// Kernel dquot cache statistics. version is the quota format version for
+// kernels before the generic interface, 0 otherwise.
+typedef struct kernel_stats_ret
+{
+  uint64_t lookups;
+  uint64_t drops;
+  uint64_t reads;
+  uint64_t writes;
+  uint64_t cache_hits;
+  uint64_t allocated_dquots;
+  uint64_t free_dquots;
+  uint64_t syncs;
+  uint32_t version;
+  uint32_t reserved;
+} kernel_stats_ret;
+
+// Connection to quota-cached, see client.c
+typedef struct quota_client quota_client;
+
 typedef struct getmntent_ret
 {
   char *dev;
@@ -27,14 +206,337 @@ typedef struct getmntent_ret
   // (freemask & (1 << 2)): type
   // (freemask & (1 << 3)): opts
   char freemask;
+  // Only known when the table is read from /proc/self/mountinfo (Linux),
+  // 0 otherwise.
+  uint32_t mnt_id;
+  uint32_t parent_id;
+  uint32_t dev_major;
+  uint32_t dev_minor;
 } getmntent_ret;
 
+// One device of quota_query_all_mounts. msg is set if the query failed,
+// with err its errno (0 for RPC errors). dev and path are freed by
+// quota_query_all_free.
+typedef struct mount_query_ret
+{
+  char *dev;
+  char *path;
+  query_ret q;
+  int32_t err;
+  uint32_t reserved;
+  const char *msg;
+} mount_query_ret;
+
+// Asynchronous requests, see async.c
+typedef struct quota_async quota_async;
+
+typedef enum quota_async_op {
+    PHP_QUOTA_ASYNC_QUERY = 0,
+    PHP_QUOTA_ASYNC_SETQLIM = 1,
+    PHP_QUOTA_ASYNC_RPCQUERY = 2
+} quota_async_op;
+
+// What limits the headroom found by quota_headroom: a quota of the kind
+// with the same number, the free space or inodes of the file system, or
+// nothing.
+typedef enum quota_headroom_limit {
+    PHP_QUOTA_HEADROOM_USER = 0,
+    PHP_QUOTA_HEADROOM_GROUP = 1,
+    PHP_QUOTA_HEADROOM_PROJECT = 2,
+    PHP_QUOTA_HEADROOM_FS = 3,
+    PHP_QUOTA_HEADROOM_NONE = 4
+} quota_headroom_limit;
+
+// bytes and files can still be written (UINT64_MAX: no limit, with
+// PHP_QUOTA_HEADROOM_NONE in bytes_by or files_by); bytes_by
+// and files_by are the quota_headroom_limit that binds, the first of user,
+// group, project and file system if several leave the same. quotas has
+// bit 1 << kind set for each kind of quota that applies.
+typedef struct headroom_ret
+{
+  uint64_t bytes;
+  uint64_t files;
+  uint32_t bytes_by;
+  uint32_t files_by;
+  uint32_t quotas;
+  uint32_t projid;
+  uint32_t dev_major;
+  uint32_t dev_minor;
+} headroom_ret;
+
+// Flags of quota_scan
+typedef enum quota_scan_flag {
+    PHP_QUOTA_SCAN_XDEV = 1, // stay on the file system of the path
+    PHP_QUOTA_SCAN_PROJECT = 2 // read project ids, one open per file
+} quota_scan_flag;
+
+// Result of quota_scan. snaps[kind] holds the usage of each id in the units
+// of quota_query, with all limits 0; snaps[PHP_QUOTA_TYPE_PROJECT] is only
+// set with PHP_QUOTA_SCAN_PROJECT. errors counts entries that could not be
+// read and are missing from the totals.
+typedef struct scan_ret
+{
+  uint64_t inodes;
+  uint64_t dirs;
+  uint64_t errors;
+  quota_snapshot *snaps[3];
+} scan_ret;
+
+// Usage tracker, see tracker.c
+typedef struct quota_tracker quota_tracker;
+
+// Progress and result of quota_project_assign: inodes given the project
+// id, directories done, subdirectories left out because an earlier call
+// had done them, and entries that could not be read or changed.
+typedef struct project_ret
+{
+  uint64_t inodes;
+  uint64_t dirs;
+  uint64_t skipped;
+  uint64_t errors;
+} project_ret;
+
+typedef void (*quota_project_fn) (project_ret *progress, void *arg);
+
+// Request for quota_submit; tag is passed through to its completion. dev
+// is the device, or the host for PHP_QUOTA_ASYNC_RPCQUERY with path the
+// exported directory; both are copied. The limits and timelimflag are only
+// used by PHP_QUOTA_ASYNC_SETQLIM.
+typedef struct quota_request
+{
+  uint64_t tag;
+  uint32_t op;
+  int32_t kind;
+  int32_t id;
+  int32_t timelimflag;
+  char *dev;
+  char *path;
+  double bs, bh, fs, fh;
+} quota_request;
+
+// Result of a request. msg is set if it failed, with err its errno (0 for
+// RPC errors); q holds the result of the query operations.
+typedef struct quota_completion
+{
+  uint64_t tag;
+  uint32_t op;
+  int32_t err;
+  query_ret q;
+  const char *msg;
+} quota_completion;
+
+// Selects the entries quota_getmntent returns after quota_setmntent_filter.
+// All members are comma separated lists, NULL or "" for no restriction:
+// types and skip_types of file system types ("nfs*" matches all types
+// starting with nfs), opts of options that must all be present, any_opts
+// of options of which one must be (options match regardless of a value:
+// "usrjquota" matches "usrjquota=aquota.user"). prefix is a directory
+// whose mount points are selected, including itself.
+typedef struct mntent_filter
+{
+  char *types;
+  char *skip_types;
+  char *opts;
+  char *any_opts;
+  char *prefix;
+} mntent_filter;
+
+typedef struct setqlim_entry
+{
+  int uid;
+  double bs, bh, fs, fh;
+  int timelimflag;
+} setqlim_entry;
+
 // TODO: enum or bool for kind
 query_ret quota_query (char *dev, int uid, quota_type kind);
+// Fetches the first entry with an id >= *id and stores its id in *id.
+// Returns 0 for an entry, 1 after the last entry and -1 on error.
+int quota_query_next (char *dev, unsigned int *id, quota_type kind,
+                      query_ret *ret);
+// Bytes per block of the space values (bc, bs, bh) that quota_query and
+// quota_query_next report for dev: 512 for "(XFS)" devices, which report
+// basic blocks, 1024 for all others. quota_setqlim always takes 1 KiB.
+unsigned int quota_block_size (char *dev);
+// Queries id on every mounted file system with quotas, in parallel. Fills
+// out in mount table order and returns the number of devices. If the
+// mount table lists more than n candidates, nothing is queried and their
+// number is returned instead. total sums the usage and limits of the
+// successful queries, with space in 1 KiB blocks whatever the devices
+// report, and holds the earliest grace expiry.
+long quota_query_all_mounts (int id, quota_type kind, mount_query_ret *out,
+                             long n, query_ret *total);
+void quota_query_all_free (mount_query_ret *out, long n);
 int quota_setqlim (char *dev, int uid, double bs, double bh, double fs,
                    double fh, int timelimflag, quota_type kind);
+// Applies each entry in turn; status[i] receives 0 or the errno of entry i.
+// Returns the number of failed entries, the batch is never aborted.
+int quota_setqlim_many (char *dev, setqlim_entry *entries, int n,
+                        quota_type kind, int *status);
+// Sets only the members of vals selected by mask (quota_field bits), in the
+// units reported by quota_query (see quota_block_size). Unselected fields
+// keep their current value.
+int quota_setqlim_fields (char *dev, int uid, query_ret *vals, int mask,
+                          quota_type kind);
 int quota_sync (char *dev);
 
+// Returns 1 if quotas of the given kind are turned on for dev, 0 if not and
+// -1 if that cannot be told without a query. The state is cached per device
+// until the mount table changes; quota_query and quota_sync fail right away
+// on devices known to have quotas off.
+int quota_enabled (char *dev, quota_type kind);
+
+// Grace times and format are cached per device and kind; quota_setinfo
+// updates the fields selected by mask (quota_info_field bits).
+int quota_getinfo (char *dev, quota_type kind, info_ret *info);
+int quota_setinfo (char *dev, quota_type kind, info_ret *info, int mask);
+
+// Writes every quota entry of dev to fd in the given quota_dump_format,
+// through a fixed-size buffer. Returns the number of entries written.
+long quota_dump (char *dev, quota_type kind, int fd, quota_dump_format format);
+
+// Snapshots: quota_snapshot_write enumerates dev into a new snapshot file
+// (replaced atomically) and returns the number of entries. Lookups return
+// 0 if the id was found and 1 if not.
+long quota_snapshot_write (char *dev, quota_type kind, char *path);
+quota_snapshot *quota_snapshot_open (char *path);
+long quota_snapshot_count (quota_snapshot *snap);
+int quota_snapshot_entry (quota_snapshot *snap, long idx, unsigned int *id,
+                          query_ret *ret);
+int quota_snapshot_lookup (quota_snapshot *snap, unsigned int id,
+                           query_ret *ret);
+void quota_snapshot_close (quota_snapshot *snap);
+// Builds an in-memory snapshot from n rows (ids need not be sorted, but
+// must be unique); release it with quota_snapshot_close.
+quota_snapshot *quota_snapshot_from_rows (unsigned int *ids, query_ret *rows,
+                                          long n);
+
+// Compares two snapshots and stores the added, removed and changed ids in
+// a newly allocated array, ordered by id. Returns the number of entries.
+long quota_diff (quota_snapshot *a, quota_snapshot *b, diff_entry **entries);
+void quota_diff_free (diff_entry *entries);
+
+// Usage history: quota_history_open creates path with room for slots ids
+// and depth samples per id, or opens an existing file as it is. Each call
+// of quota_history_sample appends the current usage of every id on dev.
+// Once slots ids are kept, a new id replaces the one sampled least recently.
+// Forecasts return 0, or 1 if id has no samples.
+quota_history *quota_history_open (char *path, unsigned int slots,
+                                   unsigned int depth);
+void quota_history_close (quota_history *h);
+int quota_history_append (quota_history *h, unsigned int id, uint64_t when,
+                          query_ret *q);
+long quota_history_sample (quota_history *h, char *dev, quota_type kind);
+// Copies up to n samples of id, oldest first. Returns the number copied.
+int quota_history_samples (quota_history *h, unsigned int id,
+                           history_sample *out, int n);
+int quota_history_forecast (quota_history *h, unsigned int id,
+                            forecast_ret *out);
+
+// Write admission: quota_ledger_open creates path with room for slots
+// devices, ids and kinds, or maps an existing file as it is; processes
+// opening the same file share its reservations. quota_reserve returns 0 if
+// bytes and inodes fit into what the quota of id leaves after the other
+// reservations, 1 if not. The quota is queried when it was last queried
+// more than ttl milliseconds ago. Once written, a reservation is passed to
+// quota_commit, which keeps it charged until the quota counts it; unused
+// parts are given back with quota_release, and those of processes that
+// died with the next query. Up to 16 processes can hold reservations for
+// one id at a time (EAGAIN beyond). A full table reuses the slots of ids
+// without reservations. The file is created with mode 0666 less the umask.
+quota_ledger *quota_ledger_open (char *path, unsigned int slots,
+                                 unsigned int ttl);
+void quota_ledger_close (quota_ledger *l);
+int quota_reserve (quota_ledger *l, char *dev, int id, quota_type kind,
+                   uint64_t bytes, uint64_t inodes);
+int quota_commit (quota_ledger *l, char *dev, int id, quota_type kind,
+                  uint64_t bytes, uint64_t inodes);
+int quota_release (quota_ledger *l, char *dev, int id, quota_type kind,
+                   uint64_t bytes, uint64_t inodes);
+
+// Client of the quota-cached daemon listening on path. Queries behave like
+// quota_query, but are answered from the daemon's cache when possible; with
+// fresh set the cache is bypassed. timeout is in milliseconds, 0 waits
+// forever. quota_client_invalidate drops cached results of uid (or of all
+// ids if uid is -1), e.g. after quota_setqlim. The daemon refuses both
+// with EACCES for ids that are not the caller's, unless it is root or in
+// the daemon's -g group.
+quota_client *quota_client_open (char *path, int timeout);
+void quota_client_close (quota_client *c);
+query_ret quota_client_query (quota_client *c, char *dev, int uid,
+                              quota_type kind, int fresh);
+int quota_client_invalidate (quota_client *c, char *dev, int uid,
+                             quota_type kind);
+
+// Requests run on internal worker threads. Each completion increments the
+// eventfd returned by quota_async_fd; quota_reap clears it and returns up
+// to n completions, waiting up to timeout milliseconds (-1: until there is
+// one) if there are none. Requests still running on close are finished,
+// but their results are dropped.
+quota_async *quota_async_open (void);
+int quota_async_fd (quota_async *a);
+int quota_submit (quota_async *a, quota_request *req);
+int quota_reap (quota_async *a, quota_completion *out, int n, int timeout);
+void quota_async_close (quota_async *a);
+
+// How much uid and gid can write at path, considering the user, group and
+// project quotas and the free space of its file system (Linux only).
+int quota_headroom (char *path, int uid, int gid, headroom_ret *ret);
+
+// Adds up the usage below path per uid, gid and project id, with threads
+// threads (0: one per CPU), for file systems without quotas (Linux only).
+// The snapshots in ret are released with quota_snapshot_close.
+int quota_scan (char *path, int threads, int flags, scan_ret *ret);
+
+// Keeps the usage below path current from fanotify events, after a walk
+// like quota_scan (flags: PHP_QUOTA_SCAN_PROJECT) or from the saved state
+// of an earlier tracker of the same tree (Linux only, needs CAP_SYS_ADMIN).
+// The totals go to the state file, with room for slots ids; quota_query
+// and quota_query_next read them for the device "(TRACK)" followed by the
+// state file name. quota_tracker_run waits up to timeout milliseconds (-1:
+// until there is one) for events and applies them, and returns the number
+// of directories read again. quota_tracker_fd is readable when there are
+// events.
+quota_tracker *quota_tracker_open (char *path, char *state,
+                                   unsigned int slots, int threads,
+                                   int flags);
+int quota_tracker_fd (quota_tracker *t);
+int quota_tracker_run (quota_tracker *t, int timeout);
+int quota_tracker_save (quota_tracker *t);
+void quota_tracker_close (quota_tracker *t);
+
+// Gives every file and directory below the directory path, on its file
+// system, the project id projid and directories the inherit flag, with up
+// to threads threads (0: one per CPU; Linux only). A directory is changed
+// once all below it is, so a call that was interrupted can be repeated and
+// leaves out the subdirectories that are done. fn, if not NULL, gets the
+// progress about once a second and at the end, from the calling thread.
+// With limits, its bs, bh, fs and fh are then set as the limits of the
+// project, as by quota_setqlim. Returns 0 even if ret->errors is not 0.
+int quota_project_assign (char *path, uint32_t projid, int threads,
+                          query_ret *limits, quota_project_fn fn, void *arg,
+                          project_ret *ret);
+
+// Fills st with the kernel's dquot cache statistics (Linux only).
+int quota_kernel_stats (kernel_stats_ret *st);
+
+// Copies the counters of up to n operations (indexed by quota_op) to out
+// and returns PHP_QUOTA_OP_COUNT. Counters are kept per thread and summed.
+int quota_stats (quota_op_stats *out, int n);
+void quota_stats_reset (void);
+
+// Registers fn to be called at entry and exit of every backend call (NULL
+// to remove it). quota_slowlog_set writes a line to fd for every backend
+// call taking threshold_us or longer (0 turns the log off). Without either,
+// tracing costs one flag test per call.
+// fn only runs on the thread that called quota_trace_set; events of other
+// threads wait for its next event, the return of the call that started
+// them (quota_query_all_mounts, quota_reap, quota_scan and the like) or
+// quota_trace_poll. Up to 1024 wait, further ones are dropped.
+int quota_trace_set (quota_trace_fn fn, void *arg);
+void quota_trace_poll (void);
+int quota_slowlog_set (uint64_t threshold_us, int fd);
+
 query_ret quota_rpcquery (char *host, char *path, int uid, quota_type kind);
 void quota_rpcpeer (unsigned int port, unsigned int use_tcp,
                     unsigned int timeout);
@@ -42,6 +544,7 @@ void quota_rpcpeer (unsigned int port, unsigned int use_tcp,
 int quota_rpcauth (int uid, int gid, char *hostname);
 
 int quota_setmntent ();
+int quota_setmntent_filter (mntent_filter *filter);
 getmntent_ret quota_getmntent ();
 void quota_getmntent_free (getmntent_ret ret);
 void quota_endmntent ();
@@ -0,0 +1,378 @@
+/*
+**  Query one id on all mounted file systems
+**
+**  The mount table is read by the calling thread; the query of each
+**  device (quotactl, or rquota for NFS mounts) then runs on the internal
+**  worker threads of qpool.c, so that the whole call takes about as long
+**  as the slowest device rather than the sum of all of them.
+**
+**  The mount table is read through a reader of its own, not the one of
+**  quota_setmntent, so that a getmntent loop of the caller (and its filter)
+**  is left alone and other threads may read the table at the same time.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Quota.h"
+#include "myconfig.h"
+
+#include "include/qpool.h"
+#include "include/quotatrace.h"
+#ifdef MOUNTINFO
+#include "include/mountinfo.h"
+#endif
+
+/* readers the call can own; elsewhere the one of quota_setmntent is used */
+#if !defined(AIX) && !defined(NO_MNTENT) && !defined(NO_OPEN_MNTTAB)
+#define MOUNT_MNTENT
+#endif
+
+struct mount_reader
+{
+#ifdef MOUNTINFO
+  struct mountinfo *mi;
+#endif
+#ifdef MOUNT_MNTENT
+  FILE *mtab;
+#endif
+  int global; /* quota_setmntent was called */
+};
+
+struct mount_batch
+{
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  long pending;
+};
+
+struct mount_job
+{
+  struct qpool_job job;
+  struct mount_batch *batch;
+  mount_query_ret *out;
+  int id;
+  quota_type kind;
+  int skip; /* quotas are off on the device */
+};
+
+/*
+ * argument for quota_query for a mount table entry, or NULL if the entry
+ * cannot have quotas
+ */
+static char *
+mount_dev (const getmntent_ret *ent)
+{
+  char *dev;
+
+  if (!strcmp (ent->type, "xfs"))
+    {
+      dev = malloc (strlen (ent->dev) + 6);
+      if (dev != NULL)
+        sprintf (dev, "(XFS)%s", ent->dev);
+      return dev;
+    }
+  if (!strncmp (ent->type, "nfs", 3))
+    {
+      /* host:path, as quota_query expects it */
+      if ((*ent->dev == '/') || (strchr (ent->dev, ':') == NULL))
+        return NULL;
+      return strdup (ent->dev);
+    }
+  if (*ent->dev != '/')
+    return NULL;
+  return strdup (ent->dev);
+}
+
+static void
+mount_run (struct qpool_job *job)
+{
+  struct mount_job *mj = (struct mount_job *)job;
+  mount_query_ret *out = mj->out;
+  struct mount_batch *batch = mj->batch;
+  const char *str;
+
+  if (quota_enabled (out->dev, mj->kind) == 0)
+    mj->skip = 1;
+  else
+    {
+      errno = 0;
+      out->q = quota_query (out->dev, mj->id, mj->kind);
+      out->err = errno;
+      str = quota_strerr ();
+      /* RPC errors leave errno alone; only the message tells */
+      if ((out->err != 0) || strcmp (str, strerror (0)))
+        out->msg = str;
+    }
+
+  pthread_mutex_lock (&batch->lock);
+  if (--batch->pending == 0)
+    pthread_cond_signal (&batch->done);
+  pthread_mutex_unlock (&batch->lock);
+}
+
+static int
+mount_open (struct mount_reader *r)
+{
+  memset (r, 0, sizeof (*r));
+#ifdef MOUNTINFO
+  r->mi = QUOTA_TRACE (mnttab, PHP_QUOTA_TRACE_MNTTAB, MOUNTINFO, -1L, 0L,
+                       mountinfo_open (MOUNTINFO));
+  if (r->mi != NULL)
+    return 0;
+  /* no procfs; read MOUNTED instead */
+#endif
+#ifdef MOUNT_MNTENT
+  r->mtab = QUOTA_TRACE (mnttab, PHP_QUOTA_TRACE_MNTTAB, MOUNTED, -1L, 0L,
+                         setmntent (MOUNTED, "r"));
+  return (r->mtab != NULL) ? 0 : -1;
+#else
+  if (quota_setmntent () != 0)
+    return -1;
+  r->global = 1;
+  return 0;
+#endif
+}
+
+/*
+ * the next entry of the mount table, with dev NULL at the end; only dev,
+ * path and type are set, and only valid until the next call
+ */
+static getmntent_ret
+mount_next (struct mount_reader *r, getmntent_ret *prev)
+{
+  getmntent_ret ret;
+
+  if (r->global)
+    {
+      if (prev->dev != NULL)
+        quota_getmntent_free (*prev);
+      return quota_getmntent ();
+    }
+  memset (&ret, 0, sizeof (ret));
+#ifdef MOUNTINFO
+  if (r->mi != NULL)
+    {
+      struct mountinfo_entry ent;
+
+      if (QUOTA_TRACE (mnttab, PHP_QUOTA_TRACE_MNTTAB, MOUNTINFO, -1L, 1L,
+                       mountinfo_next (r->mi, &ent))
+          == 0)
+        {
+          ret.dev = ent.source;
+          ret.path = ent.path;
+          ret.type = ent.type;
+        }
+      return ret;
+    }
+#endif
+#ifdef MOUNT_MNTENT
+  {
+    struct mntent *mntp;
+
+    mntp = QUOTA_TRACE (mnttab, PHP_QUOTA_TRACE_MNTTAB, MOUNTED, -1L, 1L,
+                        getmntent (r->mtab));
+    if (mntp != NULL)
+      {
+        ret.dev = mntp->mnt_fsname;
+        ret.path = mntp->mnt_dir;
+        ret.type = mntp->mnt_type;
+      }
+  }
+#endif
+  return ret;
+}
+
+static void
+mount_close (struct mount_reader *r, getmntent_ret *last)
+{
+  if (r->global)
+    {
+      if (last->dev != NULL)
+        quota_getmntent_free (*last);
+      quota_endmntent ();
+      return;
+    }
+#ifdef MOUNTINFO
+  if (r->mi != NULL)
+    mountinfo_close (r->mi);
+#endif
+#ifdef MOUNT_MNTENT
+  if (r->mtab != NULL)
+    endmntent (r->mtab);
+#endif
+}
+
+/*
+ * read the candidate devices into out and return their number; if there
+ * are more than n, out is left empty
+ */
+static long
+mount_list (mount_query_ret *out, long n)
+{
+  struct mount_reader reader;
+  mount_query_ret *list = NULL;
+  getmntent_ret ent;
+  long count = 0;
+  long size = 0;
+  long i;
+  int err = 0;
+
+  if (mount_open (&reader) != 0)
+    return -1;
+  ent.dev = NULL;
+  while (ent = mount_next (&reader, &ent), ent.dev != NULL)
+    {
+      char *dev = (err == 0) ? mount_dev (&ent) : NULL;
+
+      /* bind mounts share the quota table of the first mount point */
+      for (i = 0; (dev != NULL) && (i < count); i++)
+        {
+          if (!strcmp (list[i].dev, dev))
+            {
+              free (dev);
+              dev = NULL;
+            }
+        }
+      if (dev != NULL)
+        {
+          if (count == size)
+            {
+              mount_query_ret *p;
+
+              size = (size != 0) ? (size * 2) : 16;
+              p = realloc (list, size * sizeof (*list));
+              if (p == NULL)
+                err = ENOMEM;
+              else
+                list = p;
+            }
+          if (err == 0)
+            {
+              memset (&list[count], 0, sizeof (list[count]));
+              list[count].dev = dev;
+              list[count].path = strdup (ent.path);
+              count++;
+              if (list[count - 1].path == NULL)
+                err = ENOMEM;
+            }
+          else
+            free (dev);
+        }
+    }
+  mount_close (&reader, &ent);
+
+  if ((err != 0) || (count > n))
+    quota_query_all_free (list, count);
+  else if (count > 0)
+    memcpy (out, list, count * sizeof (*list));
+  free (list);
+  if (err != 0)
+    {
+      errno = err;
+      return -1;
+    }
+  return count;
+}
+
+long
+quota_query_all_mounts (int id, quota_type kind, mount_query_ret *out, long n,
+                        query_ret *total)
+{
+  struct mount_batch batch;
+  struct mount_job *jobs;
+  uint64_t bc = 0, bs = 0, bh = 0; /* bytes */
+  unsigned int size;
+  long count;
+  long i, j;
+
+  if (total != NULL)
+    memset (total, 0, sizeof (*total));
+  count = mount_list (out, n);
+  if ((count < 0) || (count > n))
+    return count;
+  if (count == 0)
+    {
+      errno = 0;
+      return 0;
+    }
+
+  jobs = calloc (count, sizeof (*jobs));
+  if (jobs == NULL)
+    {
+      quota_query_all_free (out, count);
+      return -1;
+    }
+  pthread_mutex_init (&batch.lock, NULL);
+  pthread_cond_init (&batch.done, NULL);
+  batch.pending = count;
+  for (i = 0; i < count; i++)
+    {
+      jobs[i].job.run = mount_run;
+      jobs[i].batch = &batch;
+      jobs[i].out = &out[i];
+      jobs[i].id = id;
+      jobs[i].kind = kind;
+      qpool_submit (&jobs[i].job);
+    }
+  pthread_mutex_lock (&batch.lock);
+  while (batch.pending > 0)
+    pthread_cond_wait (&batch.done, &batch.lock);
+  pthread_mutex_unlock (&batch.lock);
+  pthread_cond_destroy (&batch.done);
+  pthread_mutex_destroy (&batch.lock);
+  /* trace events of the pool threads */
+  quota_trace_poll ();
+
+  /* drop the devices without quotas, keeping the mount table order */
+  for (i = j = 0; i < count; i++)
+    {
+      if (jobs[i].skip)
+        {
+          free (out[i].dev);
+          free (out[i].path);
+          continue;
+        }
+      out[j++] = out[i];
+      if ((total == NULL) || (out[i].msg != NULL))
+        continue;
+      /* XFS devices count 512-byte blocks, the others 1 KiB ones */
+      size = quota_block_size (out[i].dev);
+      bc += out[i].q.bc * size;
+      bs += out[i].q.bs * size;
+      bh += out[i].q.bh * size;
+      total->fc += out[i].q.fc;
+      total->fs += out[i].q.fs;
+      total->fh += out[i].q.fh;
+      if ((out[i].q.bt != 0) && ((total->bt == 0) || (out[i].q.bt < total->bt)))
+        total->bt = out[i].q.bt;
+      if ((out[i].q.ft != 0) && ((total->ft == 0) || (out[i].q.ft < total->ft)))
+        total->ft = out[i].q.ft;
+    }
+  if (total != NULL)
+    {
+      /* usage rounded up, limits down */
+      total->bc = (bc + 1023) / 1024;
+      total->bs = bs / 1024;
+      total->bh = bh / 1024;
+    }
+  free (jobs);
+  errno = 0;
+  return j;
+}
+
+void
+quota_query_all_free (mount_query_ret *out, long n)
+{
+  long i;
+
+  for (i = 0; i < n; i++)
+    {
+      free (out[i].dev);
+      free (out[i].path);
+      out[i].dev = out[i].path = NULL;
+    }
+}
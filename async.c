@@ -0,0 +1,241 @@
+/*
+**  Asynchronous requests
+**
+**  quota_submit hands a request to the worker threads of qpool.c and
+**  returns at once; when it is done, the worker pushes the completion onto
+**  a lock-free list and increments an eventfd, which the caller can watch
+**  in its own poll loop and then collect the results with quota_reap.
+**  Completions are returned in the order they finished, not in the order
+**  the requests were submitted.
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "Quota.h"
+#include "include/qpool.h"
+
+struct async_job
+{
+  struct qpool_job job;
+  struct async_job *next;
+  quota_async *a;
+  quota_request req;
+  quota_completion c;
+  char strings[];
+};
+
+struct quota_async
+{
+  int fd;
+  int refs;                   /* owner plus requests in flight */
+  struct async_job *done;     /* pushed by the workers, newest first */
+  pthread_mutex_t reap_lock;  /* guards ready */
+  struct async_job *ready;    /* taken from done, oldest first */
+};
+
+static void
+async_signal (quota_async *a)
+{
+  uint64_t one = 1;
+
+  /* fails only if the counter would overflow, and it is readable then */
+  if (write (a->fd, &one, sizeof (one)) < 0)
+    return;
+}
+
+static void
+async_clear (quota_async *a)
+{
+  uint64_t count;
+
+  if (read (a->fd, &count, sizeof (count)) < 0)
+    return;
+}
+
+static void
+async_unref (quota_async *a)
+{
+  struct async_job *job;
+
+  if (__atomic_sub_fetch (&a->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  /* completions nobody reaped */
+  while ((job = a->ready) != NULL)
+    {
+      a->ready = job->next;
+      free (job);
+    }
+  while ((job = a->done) != NULL)
+    {
+      a->done = job->next;
+      free (job);
+    }
+  close (a->fd);
+  pthread_mutex_destroy (&a->reap_lock);
+  free (a);
+}
+
+static void
+async_run (struct qpool_job *qjob)
+{
+  struct async_job *job = (struct async_job *)qjob;
+  quota_request *req = &job->req;
+  quota_async *a = job->a;
+  const char *str;
+  int ret = 0;
+
+  errno = 0;
+  switch (req->op)
+    {
+    case PHP_QUOTA_ASYNC_QUERY:
+      job->c.q = quota_query (req->dev, req->id, req->kind);
+      break;
+    case PHP_QUOTA_ASYNC_SETQLIM:
+      ret = quota_setqlim (req->dev, req->id, req->bs, req->bh, req->fs,
+                           req->fh, req->timelimflag, req->kind);
+      break;
+    case PHP_QUOTA_ASYNC_RPCQUERY:
+      job->c.q = quota_rpcquery (req->dev, req->path, req->id, req->kind);
+      break;
+    }
+  job->c.err = errno;
+  str = quota_strerr ();
+  /* RPC errors leave errno alone; only the message tells */
+  if ((ret != 0) || (job->c.err != 0) || strcmp (str, strerror (0)))
+    job->c.msg = str;
+
+  job->next = __atomic_load_n (&a->done, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&a->done, &job->next, job, 1,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  async_signal (a);
+  async_unref (a);
+}
+
+quota_async *
+quota_async_open (void)
+{
+  quota_async *a = malloc (sizeof (*a));
+
+  if (a == NULL)
+    return NULL;
+  a->fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (a->fd == -1)
+    {
+      free (a);
+      return NULL;
+    }
+  a->refs = 1;
+  a->done = a->ready = NULL;
+  pthread_mutex_init (&a->reap_lock, NULL);
+  errno = 0;
+  return a;
+}
+
+int
+quota_async_fd (quota_async *a)
+{
+  return a->fd;
+}
+
+int
+quota_submit (quota_async *a, quota_request *req)
+{
+  size_t devlen, pathlen;
+  struct async_job *job;
+
+  if ((req->op > PHP_QUOTA_ASYNC_RPCQUERY) || (req->dev == NULL)
+      || ((req->op == PHP_QUOTA_ASYNC_RPCQUERY) && (req->path == NULL)))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  devlen = strlen (req->dev) + 1;
+  pathlen = (req->path != NULL) ? (strlen (req->path) + 1) : 0;
+  job = malloc (sizeof (*job) + devlen + pathlen);
+  if (job == NULL)
+    return -1;
+
+  /* the caller's strings may be gone by the time a worker gets to it */
+  job->req = *req;
+  job->req.dev = memcpy (job->strings, req->dev, devlen);
+  if (req->path != NULL)
+    job->req.path = memcpy (job->strings + devlen, req->path, pathlen);
+  memset (&job->c, 0, sizeof (job->c));
+  job->c.tag = req->tag;
+  job->c.op = req->op;
+  job->a = a;
+  job->job.run = async_run;
+
+  __atomic_add_fetch (&a->refs, 1, __ATOMIC_RELAXED);
+  qpool_submit (&job->job);
+  errno = 0;
+  return 0;
+}
+
+int
+quota_reap (quota_async *a, quota_completion *out, int n, int timeout)
+{
+  struct async_job *job, *list, **tail;
+  struct pollfd pfd;
+  int i = 0;
+
+  pthread_mutex_lock (&a->reap_lock);
+  for (;;)
+    {
+      /* clear the eventfd before looking, so no completion goes unnoticed */
+      async_clear (a);
+      list = __atomic_exchange_n (&a->done, NULL, __ATOMIC_ACQUIRE);
+      if (list != NULL)
+        {
+          /* append in completion order */
+          for (tail = &a->ready; *tail != NULL; tail = &(*tail)->next)
+            ;
+          while (list != NULL)
+            {
+              job = list;
+              list = job->next;
+              job->next = *tail;
+              *tail = job;
+            }
+        }
+      if ((a->ready != NULL) || (timeout == 0))
+        break;
+
+      pthread_mutex_unlock (&a->reap_lock);
+      pfd.fd = a->fd;
+      pfd.events = POLLIN;
+      /* wait once, or until there is something if timeout is -1 */
+      if ((poll (&pfd, 1, timeout) <= 0) || (timeout > 0))
+        timeout = 0;
+      pthread_mutex_lock (&a->reap_lock);
+    }
+
+  while ((i < n) && ((job = a->ready) != NULL))
+    {
+      a->ready = job->next;
+      out[i++] = job->c;
+      free (job);
+    }
+  /* keep the eventfd readable while completions are left */
+  if (a->ready != NULL)
+    async_signal (a);
+  pthread_mutex_unlock (&a->reap_lock);
+  /* trace events of the pool threads */
+  quota_trace_poll ();
+  errno = 0;
+  return i;
+}
+
+void
+quota_async_close (quota_async *a)
+{
+  if (a != NULL)
+    async_unref (a);
+}
@@ -0,0 +1,256 @@
+/*
+**  Client side of the quota-cached protocol (see include/cached.h)
+**
+**  A client handle owns one connection to the daemon. Requests are sent
+**  synchronously; if the daemon was restarted since the last request, the
+**  connection is re-established once before giving up.
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Quota.h"
+#include "include/cached.h"
+
+struct quota_client
+{
+  int fd;
+  int timeout; /* milliseconds */
+  struct sockaddr_un addr;
+};
+
+/* RPC error message of the last failed request */
+static __thread char client_msg[CACHED_MAXMSG + 1];
+
+static int
+client_connect (quota_client *c)
+{
+  if (c->fd != -1)
+    close (c->fd);
+  c->fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (c->fd == -1)
+    return -1;
+  if (connect (c->fd, (struct sockaddr *)&c->addr, sizeof (c->addr)) != 0)
+    {
+      int err = errno;
+
+      close (c->fd);
+      c->fd = -1;
+      errno = err;
+      return -1;
+    }
+  return 0;
+}
+
+/*
+ * read exactly len bytes, waiting at most the client timeout for each part
+ */
+static int
+client_read (quota_client *c, void *data, size_t len)
+{
+  struct pollfd pfd;
+  ssize_t n;
+
+  pfd.fd = c->fd;
+  pfd.events = POLLIN;
+  while (len > 0)
+    {
+      n = poll (&pfd, 1, c->timeout);
+      if (n == 0)
+        {
+          errno = ETIMEDOUT;
+          return -1;
+        }
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      n = recv (c->fd, data, len, 0);
+      if (n == 0)
+        {
+          errno = ECONNRESET;
+          return -1;
+        }
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      data = (char *)data + n;
+      len -= n;
+    }
+  return 0;
+}
+
+static int
+client_write (quota_client *c, const void *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = send (c->fd, data, len, MSG_NOSIGNAL);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      data = (const char *)data + n;
+      len -= n;
+    }
+  return 0;
+}
+
+static int
+client_call (quota_client *c, int op, const char *dev, int id,
+             quota_type kind, int flags, struct cached_rsp *rsp)
+{
+  char buf[sizeof (struct cached_req) + CACHED_MAXDEV];
+  struct cached_req *req = (struct cached_req *)buf;
+  size_t devlen = strlen (dev);
+  int retry;
+  int err;
+
+  if (devlen > CACHED_MAXDEV)
+    {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+  req->magic = CACHED_MAGIC;
+  req->op = op;
+  req->kind = kind;
+  req->id = id;
+  req->devlen = devlen;
+  req->flags = flags;
+  memcpy (buf + sizeof (*req), dev, devlen);
+
+  for (retry = 0; retry < 2; retry++)
+    {
+      if ((c->fd == -1) && (client_connect (c) != 0))
+        return -1;
+      if (client_write (c, buf, sizeof (*req) + devlen) == 0)
+        {
+          if (client_read (c, rsp, sizeof (*rsp)) == 0)
+            break;
+        }
+      /*
+       * the connection is unusable either way, e.g. a late reply after a
+       * timeout would be taken for the answer to the next request
+       */
+      err = errno;
+      close (c->fd);
+      c->fd = -1;
+      errno = err;
+      if ((err != EPIPE) && (err != ECONNRESET))
+        return -1;
+    }
+  if (retry == 2)
+    return -1;
+
+  if ((rsp->magic != CACHED_MAGIC) || (rsp->msglen > CACHED_MAXMSG))
+    {
+      close (c->fd);
+      c->fd = -1;
+      errno = EPROTO;
+      return -1;
+    }
+  if (client_read (c, client_msg, rsp->msglen) != 0)
+    {
+      err = errno;
+      close (c->fd);
+      c->fd = -1;
+      errno = err;
+      return -1;
+    }
+  client_msg[rsp->msglen] = '\0';
+  return 0;
+}
+
+quota_client *
+quota_client_open (char *path, int timeout)
+{
+  quota_client *c;
+
+  if (strlen (path) >= sizeof (c->addr.sun_path))
+    {
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+  c = malloc (sizeof (*c));
+  if (c == NULL)
+    return NULL;
+  memset (&c->addr, 0, sizeof (c->addr));
+  c->addr.sun_family = AF_UNIX;
+  strcpy (c->addr.sun_path, path);
+  c->timeout = (timeout > 0) ? timeout : -1;
+  c->fd = -1;
+  if (client_connect (c) != 0)
+    {
+      free (c);
+      return NULL;
+    }
+  errno = 0;
+  return c;
+}
+
+void
+quota_client_close (quota_client *c)
+{
+  if (c == NULL)
+    return;
+  if (c->fd != -1)
+    close (c->fd);
+  free (c);
+}
+
+query_ret
+quota_client_query (quota_client *c, char *dev, int uid, quota_type kind,
+                    int fresh)
+{
+  struct cached_rsp rsp;
+  query_ret ret;
+
+  memset (&ret, 0, sizeof (ret));
+  if (client_call (c, CACHED_QUERY, dev, uid, kind, fresh ? CACHED_FRESH : 0,
+                   &rsp)
+      != 0)
+    return ret;
+
+  if (rsp.err != 0)
+    errno = rsp.err;
+  else if (rsp.msglen != 0)
+    quota_rpc_seterror (client_msg);
+  else
+    {
+      ret = rsp.q;
+      errno = 0;
+    }
+  return ret;
+}
+
+int
+quota_client_invalidate (quota_client *c, char *dev, int uid,
+                         quota_type kind)
+{
+  struct cached_rsp rsp;
+
+  if (client_call (c, CACHED_INVALIDATE, dev, uid, kind, 0, &rsp) != 0)
+    return -1;
+  /* refused, see quota_cached.c */
+  if (rsp.err != 0)
+    {
+      errno = rsp.err;
+      return -1;
+    }
+  errno = 0;
+  return 0;
+}
@@ -0,0 +1,201 @@
+/*
+**  Per-device cache of quota meta information
+**
+**  Entries are keyed by the device argument as passed to the quota_*
+**  functions (including any "(XFS)" style prefix) and the quota kind.
+**  On Linux the whole cache is flushed when the mount table changes.
+*/
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "Quota.h"
+#include "include/devcache.h"
+
+#define DEVCACHE_SIZE 64
+#define DEVCACHE_KINDS 3
+#define DEVCACHE_NAMELEN 256
+
+/* seconds after which grace times are fetched from the kernel again */
+#define DEVCACHE_INFO_TTL 60
+/* seconds after which the quota on/off state is probed again; catches
+ * quotaon/quotaoff, which do not change the mount table */
+#define DEVCACHE_STATE_TTL 60
+
+struct devcache_ent
+{
+  char dev[DEVCACHE_NAMELEN];
+  unsigned info_valid; /* bit per kind */
+  time_t info_time[DEVCACHE_KINDS];
+  info_ret info[DEVCACHE_KINDS];
+  unsigned state_valid; /* bit per kind */
+  time_t state_time[DEVCACHE_KINDS];
+  /* 0 if enabled, -1 if the probe could not tell, else errno to report */
+  int state_err[DEVCACHE_KINDS];
+};
+
+static struct devcache_ent devcache[DEVCACHE_SIZE];
+static int devcache_next = 0;
+static pthread_mutex_t devcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef __linux__
+static int devcache_mounts_fd = -1;
+#endif
+
+/*
+ * flush all entries if the mount table changed since the last call.
+ * /proc/self/mounts reports POLLPRI once per change of the mount namespace.
+ * Must be called with devcache_lock held.
+ */
+static void
+devcache_check_mounts (void)
+{
+#ifdef __linux__
+  struct pollfd pfd;
+
+  if (devcache_mounts_fd == -1)
+    {
+      devcache_mounts_fd = open ("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+      memset (devcache, 0, sizeof (devcache));
+      return;
+    }
+
+  pfd.fd = devcache_mounts_fd;
+  pfd.events = POLLPRI;
+  pfd.revents = 0;
+  if ((poll (&pfd, 1, 0) > 0) && (pfd.revents & (POLLPRI | POLLERR)))
+    memset (devcache, 0, sizeof (devcache));
+#endif
+}
+
+/*
+ * lookup the entry for dev; if create is set, an unused or the oldest slot
+ * is recycled. Must be called with devcache_lock held.
+ */
+static struct devcache_ent *
+devcache_find (const char *dev, int create)
+{
+  struct devcache_ent *ent;
+  int i;
+
+  if (strlen (dev) >= DEVCACHE_NAMELEN)
+    return NULL;
+
+  for (i = 0; i < DEVCACHE_SIZE; i++)
+    {
+      if ((devcache[i].dev[0] != 0) && !strcmp (devcache[i].dev, dev))
+        return &devcache[i];
+    }
+  if (!create)
+    return NULL;
+
+  ent = &devcache[devcache_next];
+  devcache_next = (devcache_next + 1) % DEVCACHE_SIZE;
+  memset (ent, 0, sizeof (*ent));
+  strcpy (ent->dev, dev);
+  return ent;
+}
+
+int
+devcache_get_info (const char *dev, int kind, info_ret *info)
+{
+  struct devcache_ent *ent;
+  int ret = -1;
+
+  if ((kind < 0) || (kind >= DEVCACHE_KINDS))
+    return -1;
+
+  pthread_mutex_lock (&devcache_lock);
+  devcache_check_mounts ();
+  ent = devcache_find (dev, 0);
+  if ((ent != NULL) && (ent->info_valid & (1 << kind))
+      && (time (NULL) - ent->info_time[kind] < DEVCACHE_INFO_TTL))
+    {
+      *info = ent->info[kind];
+      ret = 0;
+    }
+  pthread_mutex_unlock (&devcache_lock);
+  return ret;
+}
+
+void
+devcache_set_info (const char *dev, int kind, const info_ret *info)
+{
+  struct devcache_ent *ent;
+
+  if ((kind < 0) || (kind >= DEVCACHE_KINDS))
+    return;
+
+  pthread_mutex_lock (&devcache_lock);
+  ent = devcache_find (dev, 1);
+  if (ent != NULL)
+    {
+      ent->info[kind] = *info;
+      ent->info_time[kind] = time (NULL);
+      ent->info_valid |= (1 << kind);
+    }
+  pthread_mutex_unlock (&devcache_lock);
+}
+
+void
+devcache_drop_info (const char *dev, int kind)
+{
+  struct devcache_ent *ent;
+
+  if ((kind < 0) || (kind >= DEVCACHE_KINDS))
+    return;
+
+  pthread_mutex_lock (&devcache_lock);
+  ent = devcache_find (dev, 0);
+  if (ent != NULL)
+    ent->info_valid &= ~(1 << kind);
+  pthread_mutex_unlock (&devcache_lock);
+}
+
+int
+devcache_get_state (const char *dev, int kind, int *err)
+{
+  struct devcache_ent *ent;
+  int ret = -1;
+
+  if ((kind < 0) || (kind >= DEVCACHE_KINDS))
+    return -1;
+
+  pthread_mutex_lock (&devcache_lock);
+  devcache_check_mounts ();
+  ent = devcache_find (dev, 0);
+  if ((ent != NULL) && (ent->state_valid & (1 << kind))
+      && (time (NULL) - ent->state_time[kind] < DEVCACHE_STATE_TTL))
+    {
+      *err = ent->state_err[kind];
+      ret = 0;
+    }
+  pthread_mutex_unlock (&devcache_lock);
+  return ret;
+}
+
+void
+devcache_set_state (const char *dev, int kind, int err)
+{
+  struct devcache_ent *ent;
+
+  if ((kind < 0) || (kind >= DEVCACHE_KINDS))
+    return;
+
+  pthread_mutex_lock (&devcache_lock);
+  ent = devcache_find (dev, 1);
+  if (ent != NULL)
+    {
+      ent->state_err[kind] = err;
+      ent->state_time[kind] = time (NULL);
+      ent->state_valid |= (1 << kind);
+    }
+  pthread_mutex_unlock (&devcache_lock);
+}
@@ -0,0 +1,196 @@
+/*
+**  Delta between two quota snapshots
+**
+**  The id columns are merge-joined. Runs of rows whose ids line up in both
+**  snapshots (the common case for consecutive scans) are compared column by
+**  column with vector operations, building a bitmask of changed fields per
+**  row; only rows with a non-zero mask are looked at individually.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Quota.h"
+#include "include/snapshot.h"
+
+/* rows compared per pass over the columns; keeps the masks in L1 */
+#define DIFF_BLOCK 256
+
+typedef uint64_t diff_v4u64 __attribute__ ((vector_size (32)));
+typedef uint32_t diff_v8u32 __attribute__ ((vector_size (32)));
+
+/* AVX2 where the CPU has it, otherwise the SSE2 lowering of the vectors */
+#if defined(__x86_64__) && defined(__linux__)
+#define DIFF_TARGETS __attribute__ ((target_clones ("avx2", "default")))
+#else
+#define DIFF_TARGETS
+#endif
+
+struct diff_out
+{
+  diff_entry *entries;
+  long count;
+  long size;
+};
+
+static int
+diff_emit (struct diff_out *out, const quota_snapshot *a, long i,
+           const quota_snapshot *b, long j, int change, int fields)
+{
+  diff_entry *ent;
+  unsigned int id;
+
+  if (out->count == out->size)
+    {
+      long size = (out->size != 0) ? (out->size * 2) : 1024;
+      diff_entry *entries = realloc (out->entries, size * sizeof (*entries));
+
+      if (entries == NULL)
+        return -1;
+      out->entries = entries;
+      out->size = size;
+    }
+
+  ent = &out->entries[out->count++];
+  memset (ent, 0, sizeof (*ent));
+  ent->change = change;
+  ent->fields = fields;
+  if (i >= 0)
+    quota_snapshot_entry ((quota_snapshot *)a, i, &id, &ent->old_q);
+  if (j >= 0)
+    quota_snapshot_entry ((quota_snapshot *)b, j, &id, &ent->new_q);
+  ent->id = id;
+  return 0;
+}
+
+/*
+ * number of leading positions at which the id columns agree, at most n
+ */
+DIFF_TARGETS static long
+diff_id_run (const uint32_t *ia, const uint32_t *ib, long n)
+{
+  long k = 0;
+
+  while (k + 8 <= n)
+    {
+      diff_v8u32 va, vb, ne;
+      uint64_t any[4];
+
+      memcpy (&va, ia + k, sizeof (va));
+      memcpy (&vb, ib + k, sizeof (vb));
+      ne = (diff_v8u32)(va != vb);
+      memcpy (any, &ne, sizeof (any));
+      if (any[0] | any[1] | any[2] | any[3])
+        break;
+      k += 8;
+    }
+  while ((k < n) && (ia[k] == ib[k]))
+    k++;
+  return k;
+}
+
+/*
+ * OR the quota_field bit of every column that differs into mask[0..n)
+ */
+DIFF_TARGETS static void
+diff_block_mask (const quota_snapshot *a, long i, const quota_snapshot *b,
+                 long j, long n, uint64_t *mask)
+{
+  int c;
+  long r;
+
+  memset (mask, 0, n * sizeof (*mask));
+  for (c = 0; c < SNAPSHOT_COLUMNS; c++)
+    {
+      const uint64_t *ca = a->cols[c] + i;
+      const uint64_t *cb = b->cols[c] + j;
+      uint64_t bit = (uint64_t)1 << c;
+      diff_v4u64 vbit = { bit, bit, bit, bit };
+
+      for (r = 0; r + 4 <= n; r += 4)
+        {
+          diff_v4u64 va, vb, vm;
+
+          memcpy (&va, ca + r, sizeof (va));
+          memcpy (&vb, cb + r, sizeof (vb));
+          memcpy (&vm, mask + r, sizeof (vm));
+          vm |= (diff_v4u64)(va != vb) & vbit;
+          memcpy (mask + r, &vm, sizeof (vm));
+        }
+      for (; r < n; r++)
+        {
+          if (ca[r] != cb[r])
+            mask[r] |= bit;
+        }
+    }
+}
+
+long
+quota_diff (quota_snapshot *a, quota_snapshot *b, diff_entry **entries)
+{
+  struct diff_out out = { NULL, 0, 0 };
+  uint64_t mask[DIFF_BLOCK];
+  long i = 0;
+  long j = 0;
+  long k, r, n;
+
+  while ((i < a->count) && (j < b->count))
+    {
+      n = a->count - i;
+      if (b->count - j < n)
+        n = b->count - j;
+      if (n > DIFF_BLOCK)
+        n = DIFF_BLOCK;
+
+      k = diff_id_run (a->ids + i, b->ids + j, n);
+      if (k > 0)
+        {
+          diff_block_mask (a, i, b, j, k, mask);
+          for (r = 0; r < k; r++)
+            {
+              if ((mask[r] != 0)
+                  && diff_emit (&out, a, i + r, b, j + r, PHP_QUOTA_DIFF_CHANGED,
+                                mask[r])
+                         != 0)
+                goto failure;
+            }
+          i += k;
+          j += k;
+        }
+      else if (a->ids[i] < b->ids[j])
+        {
+          if (diff_emit (&out, a, i++, b, -1, PHP_QUOTA_DIFF_REMOVED, 0) != 0)
+            goto failure;
+        }
+      else
+        {
+          if (diff_emit (&out, a, -1, b, j++, PHP_QUOTA_DIFF_ADDED, 0) != 0)
+            goto failure;
+        }
+    }
+  for (; i < a->count; i++)
+    {
+      if (diff_emit (&out, a, i, b, -1, PHP_QUOTA_DIFF_REMOVED, 0) != 0)
+        goto failure;
+    }
+  for (; j < b->count; j++)
+    {
+      if (diff_emit (&out, a, -1, b, j, PHP_QUOTA_DIFF_ADDED, 0) != 0)
+        goto failure;
+    }
+
+  *entries = out.entries;
+  return out.count;
+
+failure:
+  free (out.entries);
+  *entries = NULL;
+  return -1;
+}
+
+void
+quota_diff_free (diff_entry *entries)
+{
+  free (entries);
+}
@@ -0,0 +1,175 @@
+/*
+**  Streaming export of all quota entries of a device
+**
+**  Entries are enumerated with quota_query_next and formatted straight into
+**  a fixed-size output buffer, so memory use does not depend on the number
+**  of ids on the file system.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Quota.h"
+
+#define DUMP_BUFSIZE (1024 * 1024)
+/* longest formatted record: 9 numbers of 20 digits plus JSON keys */
+#define DUMP_MAXREC 512
+
+struct dump_buf
+{
+  int fd;
+  size_t len;
+  char *data;
+};
+
+static int
+dump_flush (struct dump_buf *buf)
+{
+  size_t done = 0;
+  ssize_t n;
+
+  while (done < buf->len)
+    {
+      n = write (buf->fd, buf->data + done, buf->len - done);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      done += n;
+    }
+  buf->len = 0;
+  return 0;
+}
+
+/*
+ * append the decimal representation of val; a lot cheaper than snprintf
+ * for the millions of numbers in a large dump
+ */
+static char *
+dump_u64 (char *p, uint64_t val)
+{
+  char tmp[20];
+  int i = 0;
+
+  do
+    {
+      tmp[i++] = '0' + (val % 10);
+      val /= 10;
+    }
+  while (val != 0);
+  while (i > 0)
+    *p++ = tmp[--i];
+  return p;
+}
+
+static char *
+dump_str (char *p, const char *str)
+{
+  size_t len = strlen (str);
+
+  memcpy (p, str, len);
+  return p + len;
+}
+
+static void
+dump_format (struct dump_buf *buf, quota_dump_format format, unsigned int id,
+             quota_type kind, const query_ret *q)
+{
+  char *start = buf->data + buf->len;
+  char *p = start;
+
+  if (format == PHP_QUOTA_DUMP_BINARY)
+    {
+      dump_record rec;
+
+      rec.id = id;
+      rec.kind = kind;
+      rec.q = *q;
+      memcpy (p, &rec, sizeof (rec));
+      p += sizeof (rec);
+    }
+  else if (format == PHP_QUOTA_DUMP_JSONL)
+    {
+      p = dump_u64 (dump_str (p, "{\"id\":"), id);
+      p = dump_u64 (dump_str (p, ",\"bc\":"), q->bc);
+      p = dump_u64 (dump_str (p, ",\"bs\":"), q->bs);
+      p = dump_u64 (dump_str (p, ",\"bh\":"), q->bh);
+      p = dump_u64 (dump_str (p, ",\"bt\":"), q->bt);
+      p = dump_u64 (dump_str (p, ",\"fc\":"), q->fc);
+      p = dump_u64 (dump_str (p, ",\"fs\":"), q->fs);
+      p = dump_u64 (dump_str (p, ",\"fh\":"), q->fh);
+      p = dump_u64 (dump_str (p, ",\"ft\":"), q->ft);
+      p = dump_str (p, "}\n");
+    }
+  else
+    {
+      p = dump_u64 (p, id);
+      p = dump_u64 (dump_str (p, ","), q->bc);
+      p = dump_u64 (dump_str (p, ","), q->bs);
+      p = dump_u64 (dump_str (p, ","), q->bh);
+      p = dump_u64 (dump_str (p, ","), q->bt);
+      p = dump_u64 (dump_str (p, ","), q->fc);
+      p = dump_u64 (dump_str (p, ","), q->fs);
+      p = dump_u64 (dump_str (p, ","), q->fh);
+      p = dump_u64 (dump_str (p, ","), q->ft);
+      *p++ = '\n';
+    }
+  buf->len += p - start;
+}
+
+long
+quota_dump (char *dev, quota_type kind, int fd, quota_dump_format format)
+{
+  struct dump_buf buf;
+  query_ret q;
+  unsigned int id = 0;
+  long count = 0;
+  int ret;
+
+  if ((format != PHP_QUOTA_DUMP_CSV) && (format != PHP_QUOTA_DUMP_JSONL)
+      && (format != PHP_QUOTA_DUMP_BINARY))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  buf.fd = fd;
+  buf.len = 0;
+  buf.data = malloc (DUMP_BUFSIZE);
+  if (buf.data == NULL)
+    return -1;
+
+  if (format == PHP_QUOTA_DUMP_CSV)
+    {
+      strcpy (buf.data, "id,bc,bs,bh,bt,fc,fs,fh,ft\n");
+      buf.len = strlen (buf.data);
+    }
+
+  while ((ret = quota_query_next (dev, &id, kind, &q)) == 0)
+    {
+      if ((buf.len + DUMP_MAXREC > DUMP_BUFSIZE) && (dump_flush (&buf) != 0))
+        {
+          count = -1;
+          break;
+        }
+      dump_format (&buf, format, id, kind, &q);
+      count++;
+
+      if (id == (unsigned int)-1)
+        {
+          ret = 1;
+          break;
+        }
+      id++;
+    }
+
+  if ((count >= 0) && ((ret < 0) || (dump_flush (&buf) != 0)))
+    count = -1;
+
+  free (buf.data);
+  return count;
+}
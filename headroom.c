@@ -0,0 +1,186 @@
+/*
+**  Write headroom of a path
+**
+**  Combines the user, group and project quotas of the file system a path
+**  is on with its free space, to answer how much a given uid and gid can
+**  still write there. The file system is found by its device number in
+**  /proc/self/mountinfo and the project id with FS_IOC_FSGETXATTR, so
+**  this is only available on Linux.
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Quota.h"
+#include "myconfig.h"
+
+#include "include/headroom.h"
+
+/*
+ * room left below the limits of one quota entry, in bytes (limits and
+ * usage are in blocks of block_size bytes, see quota_block_size) and
+ * files; UINT64_MAX if unlimited
+ */
+void
+headroom_room (const query_ret *q, unsigned int block_size, uint64_t now,
+               uint64_t *bytes, uint64_t *files)
+{
+  *bytes = *files = UINT64_MAX;
+  if (q->bh != 0)
+    *bytes = (q->bc < q->bh) ? (q->bh - q->bc) * block_size : 0;
+  /* over the soft limit for longer than the grace time */
+  if ((q->bs != 0) && (q->bc >= q->bs) && (q->bt != 0) && (q->bt <= now))
+    *bytes = 0;
+  if (q->fh != 0)
+    *files = (q->fc < q->fh) ? (q->fh - q->fc) : 0;
+  if ((q->fs != 0) && (q->fc >= q->fs) && (q->ft != 0) && (q->ft <= now))
+    *files = 0;
+}
+
+#ifdef MOUNTINFO
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+
+#include "include/mountinfo.h"
+
+static uint32_t
+headroom_projid (const char *path)
+{
+  struct fsxattr fsx;
+  int fd = open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  uint32_t projid = 0;
+
+  if (fd == -1)
+    return 0;
+  if (ioctl (fd, FS_IOC_FSGETXATTR, &fsx) == 0)
+    projid = fsx.fsx_projid;
+  close (fd);
+  return projid;
+}
+
+static void
+headroom_limit (headroom_ret *ret, int by, const query_ret *q,
+                unsigned int block_size, uint64_t now)
+{
+  uint64_t bytes, files;
+
+  headroom_room (q, block_size, now, &bytes, &files);
+  if (bytes < ret->bytes)
+    {
+      ret->bytes = bytes;
+      ret->bytes_by = by;
+    }
+  if (files < ret->files)
+    {
+      ret->files = files;
+      ret->files_by = by;
+    }
+}
+#endif /* MOUNTINFO */
+
+int
+quota_headroom (char *path, int uid, int gid, headroom_ret *ret)
+{
+#ifdef MOUNTINFO
+  unsigned int major, minor, mnt_id = 0;
+  uint32_t ids[3];
+  struct statvfs vfs;
+  uint64_t now = time (NULL);
+  char *dev;
+  int saved;
+  int kind;
+#ifdef STATX_BASIC_STATS
+  struct statx stx;
+#else
+  struct stat st;
+#endif
+
+  memset (ret, 0, sizeof (*ret));
+  ret->bytes = ret->files = UINT64_MAX;
+  ret->bytes_by = ret->files_by = PHP_QUOTA_HEADROOM_NONE;
+
+#ifdef STATX_BASIC_STATS
+#ifdef STATX_MNT_ID
+  if (statx (AT_FDCWD, path, 0, STATX_BASIC_STATS | STATX_MNT_ID, &stx) != 0)
+    return -1;
+  if (stx.stx_mask & STATX_MNT_ID)
+    mnt_id = stx.stx_mnt_id;
+#else
+  if (statx (AT_FDCWD, path, 0, STATX_BASIC_STATS, &stx) != 0)
+    return -1;
+#endif
+  major = stx.stx_dev_major;
+  minor = stx.stx_dev_minor;
+#else
+  if (stat (path, &st) != 0)
+    return -1;
+  major = major (st.st_dev);
+  minor = minor (st.st_dev);
+#endif
+  if (statvfs (path, &vfs) != 0)
+    return -1;
+
+  ret->dev_major = major;
+  ret->dev_minor = minor;
+  ret->projid = headroom_projid (path);
+  ids[PHP_QUOTA_TYPE_USER] = uid;
+  ids[PHP_QUOTA_TYPE_GROUP] = gid;
+  ids[PHP_QUOTA_TYPE_PROJECT] = ret->projid;
+
+  dev = mountinfo_quota_dev (MOUNTINFO, major, minor, mnt_id);
+  saved = errno;
+  for (kind = 0; (dev != NULL) && (kind < 3); kind++)
+    {
+      query_ret q;
+
+      /* project 0 holds whatever has no project of its own */
+      if ((kind == PHP_QUOTA_TYPE_PROJECT) && (ret->projid == 0))
+        continue;
+      errno = 0;
+      q = quota_query (dev, ids[kind], kind);
+      if ((errno != 0) || strcmp (quota_strerr (), strerror (0)))
+        continue;
+      ret->quotas |= 1 << kind;
+      headroom_limit (ret, kind, &q, quota_block_size (dev), now);
+    }
+  free (dev);
+  errno = saved;
+
+  /* root may use the blocks reserved for it */
+  {
+    uint64_t bytes = (uint64_t)((uid == 0) ? vfs.f_bfree : vfs.f_bavail)
+                     * vfs.f_frsize;
+    uint64_t files = (uid == 0) ? vfs.f_ffree : vfs.f_favail;
+
+    if (bytes < ret->bytes)
+      {
+        ret->bytes = bytes;
+        ret->bytes_by = PHP_QUOTA_HEADROOM_FS;
+      }
+    /* some file systems (btrfs) have no fixed number of inodes */
+    if ((vfs.f_files != 0) && (files < ret->files))
+      {
+        ret->files = files;
+        ret->files_by = PHP_QUOTA_HEADROOM_FS;
+      }
+  }
+  errno = 0;
+  return 0;
+#else
+  memset (ret, 0, sizeof (*ret));
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
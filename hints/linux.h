@@ -32,6 +32,7 @@
 /* definitions from sys/quota.h */
 #define USRQUOTA  0             /* element used for user quotas */
 #define GRPQUOTA  1             /* element used for group quotas */
+#define PRJQUOTA  2             /* element used for project quotas */
 extern int quotactl(int, const char *, uid_t, caddr_t);
 
 
@@ -60,9 +61,15 @@ struct dqblk {
 /* you can use this switch to hard-wire the quota API if it's not identified correctly */
 /* #define LINUX_API_VERSION 1 */  /* API range [1..3] */
 
-int linuxquota_query( const char * dev, int uid, int isgrp, struct dqblk * dqb );
-int linuxquota_setqlim( const char * dev, int uid, int isgrp, struct dqblk * dqb );
-int linuxquota_sync( const char * dev, int isgrp );
+int linuxquota_query( const char * dev, int uid, int type, struct dqblk * dqb );
+int linuxquota_query_next( const char * dev, unsigned int * id, int type, struct dqblk * dqb );
+int linuxquota_setqlim( const char * dev, int uid, int type, struct dqblk * dqb );
+int linuxquota_setqlim_fields( const char * dev, int uid, int type, struct dqblk * dqb, int mask );
+int linuxquota_sync( const char * dev, int type );
+int linuxquota_probe( const char * dev, int type );
+int linuxquota_getinfo( const char * dev, int type, info_ret * info );
+int linuxquota_setinfo( const char * dev, int type, info_ret * info, int mask );
+int linuxquota_kernel_stats( kernel_stats_ret * st );
 
 
 #define Q_DIV(X) (X)
@@ -76,6 +83,10 @@ int linuxquota_sync( const char * dev, int isgrp );
 
 #define MNTENT mntent
 
+/* read the mount table from here rather than MOUNTED (see mountinfo.c);
+   MOUNTED is still used if it cannot be opened */
+#define MOUNTINFO "/proc/self/mountinfo"
+
 #define GQA_TYPE_USR USRQUOTA  /* RQUOTA_USRQUOTA */
 #define GQA_TYPE_GRP GRPQUOTA  /* RQUOTA_GRPQUOTA */
 #define GQR_STATUS status
@@ -96,6 +96,10 @@
 /* name of the structure used by getmntent(3) */
 #define MNTENT mntent
 
+/* Linux: read the mount table from /proc/self/mountinfo, which has the
+   mount ids and device numbers and is much faster to parse */
+/* #define MOUNTINFO "/proc/self/mountinfo" /**/
+
 /* on some systems setmntent/endmntend do not exist  */
 /* #define NO_OPEN_MNTTAB /**/
 
@@ -0,0 +1,418 @@
+/*
+**  Usage history with time-to-limit forecasts
+**
+**  One history file is kept per device and kind. It holds a fixed number of
+**  per-id records in an open-addressing hash table; every record is a ring
+**  buffer of the most recent usage samples plus the limits of the newest
+**  sample. The file is memory-mapped, so a forecast only touches the pages
+**  of one record.
+**
+**  File layout (version 1, host byte order):
+**
+**    header   64 bytes, see struct history_header
+**    records  slots x (struct history_record + depth x history_sample)
+**
+**  A history file must have a single writer at a time; any number of
+**  processes may read it. When all slots are taken, the record sampled
+**  least recently makes room for a new id, so that sampling a device with
+**  more ids than slots keeps working.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Quota.h"
+
+#define HISTORY_MAGIC "PQHIST\0\0"
+#define HISTORY_VERSION 1
+#define HISTORY_BOM 0x01020304
+
+struct history_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t bom;
+  uint32_t slots; /* power of two */
+  uint32_t depth; /* samples per record */
+  uint32_t used;  /* records in use */
+  uint32_t reserved0;
+  uint64_t reserved[4];
+};
+
+struct history_record
+{
+  uint32_t id;
+  uint32_t inuse;
+  uint32_t head;  /* index the next sample is written to */
+  uint32_t count; /* valid samples, at most depth */
+  uint64_t bs, bh, fs, fh;
+  /* followed by depth x history_sample */
+};
+
+struct quota_history
+{
+  pthread_mutex_t lock;
+  struct history_header *hdr;
+  size_t maplen;
+  size_t recsize;
+};
+
+static struct history_record *
+history_rec (quota_history *h, uint32_t slot)
+{
+  return (struct history_record *)((char *)(h->hdr + 1) + slot * h->recsize);
+}
+
+static history_sample *
+history_samples (struct history_record *rec)
+{
+  return (history_sample *)(rec + 1);
+}
+
+static uint32_t
+history_hash (quota_history *h, unsigned int id)
+{
+  return (id * 2654435761u) & (h->hdr->slots - 1);
+}
+
+/* time of the newest sample of rec, 0 if it has none */
+static uint64_t
+history_newest (quota_history *h, struct history_record *rec)
+{
+  uint32_t depth = h->hdr->depth;
+
+  if (rec->count == 0)
+    return 0;
+  return history_samples (rec)[(rec->head + depth - 1) % depth].when;
+}
+
+/*
+ * free the record in slot, moving later records of the probe sequence
+ * back so that they stay reachable without tombstones
+ */
+static void
+history_remove (quota_history *h, uint32_t slot)
+{
+  uint32_t mask = h->hdr->slots - 1;
+  uint32_t i = slot, j = slot, k;
+
+  for (;;)
+    {
+      struct history_record *rec;
+
+      j = (j + 1) & mask;
+      rec = history_rec (h, j);
+      if (!rec->inuse || (j == slot))
+        break;
+      /* rec may move to i if its home k does not lie in (i, j] */
+      k = history_hash (h, rec->id);
+      if ((i <= j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j)))
+        {
+          memcpy (history_rec (h, i), rec, h->recsize);
+          i = j;
+        }
+    }
+  history_rec (h, i)->inuse = 0;
+  h->hdr->used--;
+}
+
+/* free the slot of the record sampled least recently */
+static void
+history_evict (quota_history *h)
+{
+  uint32_t slot, victim = 0;
+  uint64_t oldest = UINT64_MAX;
+
+  for (slot = 0; slot < h->hdr->slots; slot++)
+    {
+      struct history_record *rec = history_rec (h, slot);
+      uint64_t when;
+
+      if (!rec->inuse)
+        return;
+      when = history_newest (h, rec);
+      if (when < oldest)
+        {
+          oldest = when;
+          victim = slot;
+        }
+    }
+  history_remove (h, victim);
+}
+
+/*
+ * find the record of id; if create is set, claim an empty slot for it,
+ * evicting the least recently sampled record if there is none.
+ * Linear probing from a multiplicative hash of the id.
+ */
+static struct history_record *
+history_find (quota_history *h, unsigned int id, int create)
+{
+  uint32_t mask = h->hdr->slots - 1;
+  uint32_t slot = history_hash (h, id);
+  uint32_t n;
+
+  if (create && (h->hdr->used >= h->hdr->slots)
+      && (history_find (h, id, 0) == NULL))
+    history_evict (h);
+  for (n = 0; n <= mask; n++, slot = (slot + 1) & mask)
+    {
+      struct history_record *rec = history_rec (h, slot);
+
+      if (rec->inuse && (rec->id == id))
+        return rec;
+      if (!rec->inuse)
+        {
+          if (!create)
+            break;
+          rec->id = id;
+          rec->head = 0;
+          rec->count = 0;
+          rec->inuse = 1;
+          h->hdr->used++;
+          return rec;
+        }
+    }
+  errno = create ? ENOSPC : 0;
+  return NULL;
+}
+
+quota_history *
+quota_history_open (char *path, unsigned int slots, unsigned int depth)
+{
+  struct history_header hdr;
+  quota_history *h;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open (path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1)
+    return NULL;
+  if (fstat (fd, &st) != 0)
+    goto failure;
+
+  if (st.st_size == 0)
+    {
+      /* new file: round the table up to a power of two */
+      uint32_t n = 1;
+
+      if ((slots == 0) || (depth == 0) || (slots > (1u << 30)))
+        {
+          errno = EINVAL;
+          goto failure;
+        }
+      while (n < slots)
+        n <<= 1;
+
+      memset (&hdr, 0, sizeof (hdr));
+      memcpy (hdr.magic, HISTORY_MAGIC, sizeof (hdr.magic));
+      hdr.version = HISTORY_VERSION;
+      hdr.bom = HISTORY_BOM;
+      hdr.slots = n;
+      hdr.depth = depth;
+      st.st_size = sizeof (hdr)
+                   + (off_t)n
+                         * (sizeof (struct history_record)
+                            + depth * sizeof (history_sample));
+      if ((ftruncate (fd, st.st_size) != 0)
+          || (pwrite (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)))
+        goto failure;
+    }
+  else if ((st.st_size < (off_t)sizeof (hdr))
+           || (pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr))
+           || memcmp (hdr.magic, HISTORY_MAGIC, sizeof (hdr.magic))
+           || (hdr.version != HISTORY_VERSION) || (hdr.bom != HISTORY_BOM)
+           || (st.st_size
+               != (off_t)(sizeof (hdr)
+                          + (off_t)hdr.slots
+                                * (sizeof (struct history_record)
+                                   + hdr.depth * sizeof (history_sample)))))
+    {
+      errno = EINVAL;
+      goto failure;
+    }
+
+  map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto failure;
+  close (fd);
+
+  h = malloc (sizeof (*h));
+  if (h == NULL)
+    {
+      munmap (map, st.st_size);
+      return NULL;
+    }
+  pthread_mutex_init (&h->lock, NULL);
+  h->hdr = map;
+  h->maplen = st.st_size;
+  h->recsize = sizeof (struct history_record)
+               + h->hdr->depth * sizeof (history_sample);
+  return h;
+
+failure:
+  close (fd);
+  return NULL;
+}
+
+void
+quota_history_close (quota_history *h)
+{
+  if (h == NULL)
+    return;
+  munmap (h->hdr, h->maplen);
+  pthread_mutex_destroy (&h->lock);
+  free (h);
+}
+
+int
+quota_history_append (quota_history *h, unsigned int id, uint64_t when,
+                      query_ret *q)
+{
+  struct history_record *rec;
+  history_sample *smp;
+
+  pthread_mutex_lock (&h->lock);
+  rec = history_find (h, id, 1);
+  if (rec == NULL)
+    {
+      pthread_mutex_unlock (&h->lock);
+      return -1;
+    }
+
+  smp = &history_samples (rec)[rec->head];
+  smp->when = when;
+  smp->bc = q->bc;
+  smp->fc = q->fc;
+  rec->head = (rec->head + 1) % h->hdr->depth;
+  if (rec->count < h->hdr->depth)
+    rec->count++;
+  rec->bs = q->bs;
+  rec->bh = q->bh;
+  rec->fs = q->fs;
+  rec->fh = q->fh;
+  pthread_mutex_unlock (&h->lock);
+  return 0;
+}
+
+long
+quota_history_sample (quota_history *h, char *dev, quota_type kind)
+{
+  uint64_t now = time (NULL);
+  unsigned int id = 0;
+  long count = 0;
+  query_ret q;
+  int ret;
+
+  while ((ret = quota_query_next (dev, &id, kind, &q)) == 0)
+    {
+      if (quota_history_append (h, id, now, &q) != 0)
+        return -1;
+      count++;
+      if (id == (unsigned int)-1)
+        break;
+      id++;
+    }
+  return (ret < 0) ? -1 : count;
+}
+
+int
+quota_history_samples (quota_history *h, unsigned int id, history_sample *out,
+                       int n)
+{
+  struct history_record *rec;
+  uint32_t depth = h->hdr->depth;
+  uint32_t first, i;
+  int count = 0;
+
+  pthread_mutex_lock (&h->lock);
+  rec = history_find (h, id, 0);
+  if (rec != NULL)
+    {
+      first = (rec->head + depth - rec->count) % depth;
+      for (i = 0; (i < rec->count) && (count < n); i++)
+        out[count++] = history_samples (rec)[(first + i) % depth];
+    }
+  pthread_mutex_unlock (&h->lock);
+  return count;
+}
+
+/*
+ * time at which usage growing at rate per second from cur at when reaches
+ * limit; 0 if it is already there, -1 if there is no limit or no growth
+ */
+static int64_t
+history_eta (uint64_t limit, uint64_t cur, uint64_t when, double rate)
+{
+  if (limit == 0)
+    return -1;
+  if (cur >= limit)
+    return 0;
+  if (rate <= 0)
+    return -1;
+  return when + (int64_t)((limit - cur) / rate);
+}
+
+int
+quota_history_forecast (quota_history *h, unsigned int id, forecast_ret *out)
+{
+  struct history_record *rec;
+  history_sample *smp, *last;
+  uint32_t depth = h->hdr->depth;
+  double sx = 0, sxx = 0, sb = 0, sxb = 0, sf = 0, sxf = 0, den;
+  uint32_t first, i;
+  uint64_t t0;
+
+  memset (out, 0, sizeof (*out));
+  pthread_mutex_lock (&h->lock);
+  rec = history_find (h, id, 0);
+  if ((rec == NULL) || (rec->count == 0))
+    {
+      /* not an error; errno would be taken for one by the next call */
+      pthread_mutex_unlock (&h->lock);
+      return 1;
+    }
+
+  /* least squares fit of usage over time; x relative to the oldest sample */
+  first = (rec->head + depth - rec->count) % depth;
+  t0 = history_samples (rec)[first].when;
+  for (i = 0; i < rec->count; i++)
+    {
+      double x;
+
+      smp = &history_samples (rec)[(first + i) % depth];
+      x = (double)(smp->when - t0);
+      sx += x;
+      sxx += x * x;
+      sb += smp->bc;
+      sxb += x * smp->bc;
+      sf += smp->fc;
+      sxf += x * smp->fc;
+    }
+  den = rec->count * sxx - sx * sx;
+  if ((rec->count > 1) && (den > 0))
+    {
+      out->brate = (rec->count * sxb - sx * sb) / den;
+      out->frate = (rec->count * sxf - sx * sf) / den;
+    }
+
+  last = &history_samples (rec)[(rec->head + depth - 1) % depth];
+  out->samples = rec->count;
+  out->when = last->when;
+  out->bc = last->bc;
+  out->fc = last->fc;
+  out->bs_eta = history_eta (rec->bs, last->bc, last->when, out->brate);
+  out->bh_eta = history_eta (rec->bh, last->bc, last->when, out->brate);
+  out->fs_eta = history_eta (rec->fs, last->fc, last->when, out->frate);
+  out->fh_eta = history_eta (rec->fh, last->fc, last->when, out->frate);
+  pthread_mutex_unlock (&h->lock);
+  return 0;
+}
@@ -0,0 +1,49 @@
+/*
+ *  Wire protocol between quota-cached and the quota_client_* functions
+ *
+ *  Every request is a cached_req followed by devlen bytes of device name
+ *  (no terminating NUL); every reply is a cached_rsp followed by msglen
+ *  bytes of error message. Both sides use host byte order, the socket
+ *  never leaves the machine.
+ */
+
+#define CACHED_MAGIC 0x51434431 /* "QCD1" */
+#define CACHED_MAXDEV 4096
+#define CACHED_MAXMSG 256
+
+/* operations */
+#define CACHED_QUERY 1
+#define CACHED_INVALIDATE 2 /* id -1 drops all ids of the device */
+
+/* request flags */
+#define CACHED_FRESH 1 /* bypass the cache, but still coalesce */
+
+/* reply flags */
+#define CACHED_HIT 1
+#define CACHED_COALESCED 2
+
+struct cached_req
+{
+  uint32_t magic;
+  uint16_t op;
+  uint16_t kind;
+  int32_t id;
+  uint16_t devlen;
+  uint16_t flags;
+};
+
+/*
+ * err is the errno of the failed call; if it is 0 but msglen is not, the
+ * call failed with an RPC error described by the message
+ */
+struct cached_rsp
+{
+  uint32_t magic;
+  int32_t err;
+  uint16_t msglen;
+  uint16_t flags;
+  uint32_t reserved;
+  query_ret q;
+};
+
+void quota_rpc_seterror (const char *msg);
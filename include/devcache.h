@@ -0,0 +1,12 @@
+/*
+ *  Per-device cache of quota meta information
+ *  (grace times and quota format as reported by quota_getinfo,
+ *  and whether quotas are enabled at all)
+ */
+
+int devcache_get_info (const char *dev, int kind, info_ret *info);
+void devcache_set_info (const char *dev, int kind, const info_ret *info);
+void devcache_drop_info (const char *dev, int kind);
+
+int devcache_get_state (const char *dev, int kind, int *err);
+void devcache_set_state (const char *dev, int kind, int err);
@@ -0,0 +1,6 @@
+/*
+ *  Room left below a quota entry, shared with the ledger (see headroom.c)
+ */
+
+void headroom_room (const query_ret *q, unsigned int block_size, uint64_t now,
+                    uint64_t *bytes, uint64_t *files);
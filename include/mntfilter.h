@@ -0,0 +1,9 @@
+/*
+ *  Mount table filter of quota_setmntent_filter (see mntfilter.c)
+ */
+
+struct mntfilter;
+
+struct mntfilter *mntfilter_new (const mntent_filter *spec);
+int mntfilter_match (const struct mntfilter *f, const getmntent_ret *ent);
+void mntfilter_free (struct mntfilter *f);
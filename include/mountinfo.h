@@ -0,0 +1,25 @@
+/*
+ *  Parser for the Linux /proc/<pid>/mountinfo format (see mountinfo.c)
+ */
+
+struct mountinfo;
+
+struct mountinfo_entry
+{
+  unsigned int id;
+  unsigned int parent;
+  unsigned int major;
+  unsigned int minor;
+  char *root;   /* directory of the file system that is mounted */
+  char *path;   /* mount point */
+  char *opts;   /* per mount options */
+  char *type;
+  char *source;
+  char *super;  /* super block options */
+};
+
+struct mountinfo *mountinfo_open (const char *path);
+int mountinfo_next (struct mountinfo *mi, struct mountinfo_entry *ent);
+void mountinfo_close (struct mountinfo *mi);
+char *mountinfo_quota_dev (const char *path, unsigned int major,
+                           unsigned int minor, unsigned int mnt_id);
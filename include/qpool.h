@@ -0,0 +1,11 @@
+/*
+ *  Internal worker threads for running queries in parallel (see qpool.c)
+ */
+
+struct qpool_job
+{
+  struct qpool_job *next;
+  void (*run) (struct qpool_job *job);
+};
+
+void qpool_submit (struct qpool_job *job);
@@ -0,0 +1,10 @@
+/*
+ *  Operation counters and latency histograms (see stats.c)
+ *
+ *  Usage:  uint64_t t = quotastat_start ();
+ *          ...
+ *          quotastat_end (PHP_QUOTA_OP_QUERY, t, err, -1);
+ */
+
+uint64_t quotastat_start (void);
+void quotastat_end (int op, uint64_t start, int err, int rpcstat);
@@ -0,0 +1,65 @@
+/*
+ *  Trace points around backend calls (see trace.c)
+ *
+ *  QUOTA_TRACE evaluates expr, the backend call, and reports its entry and
+ *  exit to the registered callback and the slow-op log. With neither
+ *  enabled, all that is added to the call is one test of quota_trace_flags.
+ *  With <sys/sdt.h> available, USDT probes libquota:<name>__entry and
+ *  libquota:<name>__return are placed as well.
+ */
+
+#define QUOTA_TRACE_CALLBACK 1
+#define QUOTA_TRACE_SLOWLOG 2
+
+extern int quota_trace_flags;
+
+struct trace_ctx
+{
+  uint64_t start;
+  int point;
+  const char *target;
+  long id;
+  long cmd;
+};
+
+void trace_enter (struct trace_ctx *ctx, int point, const char *target,
+                  long id, long cmd);
+void trace_exit (struct trace_ctx *ctx, long ret, int err);
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define QUOTA_SDT(name, a, b, c) DTRACE_PROBE3 (libquota, name, a, b, c)
+#else
+#define QUOTA_SDT(name, a, b, c)
+#endif
+
+#define QUOTA_TRACE(name, point, target, id, cmd, expr)                       \
+  __extension__ ({                                                            \
+    __typeof__ (expr) trace_ret_;                                             \
+    QUOTA_SDT (name##__entry, target, id, cmd);                               \
+    if (__builtin_expect (quota_trace_flags != 0, 0))                         \
+      {                                                                       \
+        struct trace_ctx trace_ctx_;                                          \
+        trace_enter (&trace_ctx_, point, target, id, cmd);                    \
+        trace_ret_ = (expr);                                                  \
+        trace_exit (&trace_ctx_, (long)trace_ret_, errno);                    \
+      }                                                                       \
+    else                                                                      \
+      trace_ret_ = (expr);                                                    \
+    QUOTA_SDT (name##__return, target, id, trace_ret_);                       \
+    trace_ret_;                                                               \
+  })
+
+/*
+ * every quotactl call of the including file is traced; the argument order
+ * differs between the quotactl generations
+ */
+#if defined(Q_CTL_V2)
+#define quotactl(path, cmd, id, addr)                                         \
+  QUOTA_TRACE (quotactl, PHP_QUOTA_TRACE_QUOTACTL, (const char *)(path),      \
+               (long)(id), (long)(unsigned int)(cmd), quotactl (path, cmd, id, addr))
+#else
+#define quotactl(cmd, special, id, addr)                                      \
+  QUOTA_TRACE (quotactl, PHP_QUOTA_TRACE_QUOTACTL, (const char *)(special),   \
+               (long)(id), (long)(unsigned int)(cmd), quotactl (cmd, special, id, addr))
+#endif
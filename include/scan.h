@@ -0,0 +1,72 @@
+/*
+ *  Directory walks of quota_scan, for the usage tracker (see scan.c)
+ */
+
+/* usage of the entries of one directory by one id of one kind */
+struct scan_sum
+{
+  uint32_t kind;
+  uint32_t id;
+  uint64_t blocks; /* 512 byte units */
+  uint64_t inodes;
+};
+
+/*
+ * a file with more than one link; it is left out of the sums of the
+ * directories linking it, for the caller to charge once
+ */
+struct scan_link
+{
+  uint64_t ino;
+  uint64_t blocks; /* 512 byte units */
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t projid;
+  uint32_t reserved0;
+};
+
+/*
+ * Called by scan_tree for each directory, from any of its threads, with
+ * the usage of its entries (not of itself) sorted by kind and id, and its
+ * files with more than one link sorted by inode, each once.
+ */
+typedef void (*scan_dir_fn) (void *arg, int fd, uint32_t projid,
+                             const struct scan_sum *sums, int n,
+                             const struct scan_link *links, int nlinks);
+/* called by scan_dir_sums for each subdirectory */
+typedef void (*scan_subdir_fn) (void *arg, int fd, const char *name,
+                                uint32_t projid);
+
+int scan_tree (const char *path, int threads, int flags, scan_dir_fn fn,
+               void *arg, scan_ret *ret);
+
+/* hooks of scan_walk, called from any of its threads unless noted */
+struct scan_hooks
+{
+  /*
+   * each entry below the root, with its st_mode; a nonzero return leaves
+   * a directory out, a negative one is an error that keeps leave from
+   * the directories above the entry
+   */
+  int (*visit) (void *arg, int dirfd, const char *name, unsigned int mode);
+  /*
+   * each directory, opened read-only as the walk read it, once everything
+   * below it was visited, unless something below it failed; the root is
+   * last. A nonzero return fails the directories above it.
+   */
+  int (*leave) (void *arg, int fd);
+  /* now and then from the calling thread, or NULL */
+  void (*tick) (void *arg);
+  void *arg;
+};
+
+int scan_walk (const char *path, int threads, int flags,
+               const struct scan_hooks *hooks, scan_ret *ret);
+/*
+ * Usage of the entries of the directory fd in a new array, and its files
+ * with more than one link in another, as for a scan_dir_fn; returns the
+ * number of entries that could not be read, or -1.
+ */
+long scan_dir_sums (int fd, int flags, uint32_t projid, scan_subdir_fn fn,
+                    void *arg, struct scan_sum **sums, int *n,
+                    struct scan_link **links, int *nlinks);
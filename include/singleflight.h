@@ -0,0 +1,11 @@
+/*
+ *  Coalescing of concurrent identical queries (see singleflight.c)
+ */
+
+struct sf_call;
+
+int singleflight_enter (const char *key, int id, int kind,
+                        struct sf_call **call, query_ret *ret, int *err,
+                        const char **rpcerr);
+void singleflight_leave (struct sf_call *call, const query_ret *ret, int err,
+                         const char *rpcerr);
@@ -0,0 +1,17 @@
+/*
+ *  In-memory view of a columnar quota snapshot (see snapshot.c)
+ */
+
+#define SNAPSHOT_COLUMNS 8
+
+struct quota_snapshot
+{
+  void *map;     /* mapped file, or heap block for in-memory snapshots */
+  size_t maplen; /* 0 for in-memory snapshots */
+  long count;
+  int kind;
+  const uint32_t *ids;
+  const uint64_t *cols[SNAPSHOT_COLUMNS]; /* bc bs bh bt fc fs fh ft */
+};
+
+long snapshot_find (const quota_snapshot *snap, unsigned int id);
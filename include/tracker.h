@@ -0,0 +1,7 @@
+/*
+ *  Queries of "(TRACK)" devices (see tracker.c)
+ */
+
+int tracker_query (const char *state, int id, int kind, query_ret *ret);
+int tracker_query_next (const char *state, unsigned int *id, int kind,
+                        query_ret *ret);
@@ -0,0 +1,583 @@
+/*
+**  Shared reservation ledger for write admission
+**
+**  Processes that admit writes for the same ids share a ledger file, best
+**  kept on a tmpfs such as /dev/shm so that it goes away with the
+**  reservations at reboot. Every device, id and kind has a slot holding
+**  the room its quota left at the last query, and the bytes and inodes
+**  charged against that room since: outstanding reservations plus the
+**  committed ones that the quota did not yet count at the last query.
+**
+**  quota_reserve admits a request with a compare-and-swap on the charge,
+**  so that concurrent processes never hand out the same room twice. The
+**  quota is queried again only once the ttl of the slot has passed, by
+**  whichever process gets to it first; the others go on with the old
+**  values meanwhile.
+**
+**  Outstanding reservations are also kept per process, in the holders of
+**  the slot, so that what a process that died before its commit or release
+**  had reserved is given back at the next query. Once the table is full, a
+**  new id takes the slot of one that has nothing charged and needs a query
+**  anyway.
+**
+**  File layout (version 2, host byte order):
+**
+**    header   64 bytes, see struct ledger_header
+**    slots    slots x struct ledger_slot (512 bytes)
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Quota.h"
+#include "include/headroom.h"
+
+#define LEDGER_MAGIC "PQLEDGER"
+#define LEDGER_VERSION 2
+#define LEDGER_BOM 0x01020304
+#define LEDGER_HOLDERS 16
+
+struct ledger_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t bom;
+  uint32_t slots; /* power of two */
+  uint32_t reserved0;
+  uint64_t reserved[5];
+};
+
+/* reservations of one process that are neither committed nor released */
+struct ledger_holder
+{
+  uint32_t pid; /* 0 if unused */
+  uint32_t reserved0;
+  uint64_t bytes, inodes;
+};
+
+/*
+ * All members are accessed atomically. Room is UINT64_MAX without a
+ * limit; the charges are subtracted from it on admission.
+ */
+struct ledger_slot
+{
+  uint64_t key;     /* ledger_key of device, id and kind; 0 if unused */
+  uint64_t fetched; /* CLOCK_MONOTONIC ms of the last query, 0 if none */
+  uint32_t refresher; /* pid of the process querying the quota */
+  uint32_t reserved0;
+  uint64_t broom, iroom;
+  uint64_t bcharged, icharged;
+  uint64_t bcommitted, icommitted; /* since the last query */
+  struct ledger_holder holders[LEDGER_HOLDERS];
+  uint64_t reserved[6];
+};
+
+struct quota_ledger
+{
+  struct ledger_header *hdr;
+  struct ledger_slot *slots;
+  size_t maplen;
+  uint64_t ttl;
+};
+
+static uint64_t
+ledger_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static uint64_t
+ledger_key (const char *dev, int id, int kind)
+{
+  uint64_t h = 14695981039346656037ull;
+
+  for (; *dev != '\0'; dev++)
+    h = (h ^ (unsigned char)*dev) * 1099511628211ull;
+  h = (h ^ (uint32_t)id) * 1099511628211ull;
+  h = (h ^ (uint32_t)kind) * 1099511628211ull;
+  return (h != 0) ? h : 1;
+}
+
+/*
+ * whether the slot can be given to another id: nothing is charged and its
+ * values are too old to be used without a query
+ */
+static int
+ledger_idle (quota_ledger *l, struct ledger_slot *s, uint64_t now)
+{
+  uint64_t fetched = __atomic_load_n (&s->fetched, __ATOMIC_ACQUIRE);
+  int i;
+
+  if ((fetched != 0) && (fetched <= now) && (now - fetched < l->ttl))
+    return 0;
+  if ((__atomic_load_n (&s->refresher, __ATOMIC_ACQUIRE) != 0)
+      || (__atomic_load_n (&s->bcharged, __ATOMIC_ACQUIRE) != 0)
+      || (__atomic_load_n (&s->icharged, __ATOMIC_ACQUIRE) != 0)
+      || (__atomic_load_n (&s->bcommitted, __ATOMIC_ACQUIRE) != 0)
+      || (__atomic_load_n (&s->icommitted, __ATOMIC_ACQUIRE) != 0))
+    return 0;
+  for (i = 0; i < LEDGER_HOLDERS; i++)
+    {
+      if ((__atomic_load_n (&s->holders[i].bytes, __ATOMIC_ACQUIRE) != 0)
+          || (__atomic_load_n (&s->holders[i].inodes, __ATOMIC_ACQUIRE) != 0))
+        return 0;
+    }
+  return 1;
+}
+
+/*
+ * find the slot of key; if create is set, claim an empty slot for it, or
+ * in a full table the first idle one from its home on. Linear probing;
+ * as a full table stays full, lookups never stop early at a slot that was
+ * taken over.
+ */
+static struct ledger_slot *
+ledger_find (quota_ledger *l, uint64_t key, int create)
+{
+  uint32_t mask = l->hdr->slots - 1;
+  uint32_t home = (uint32_t)(key >> 32) & mask;
+  uint32_t slot = home;
+  uint64_t now;
+  uint32_t n;
+
+  for (n = 0; n <= mask; n++, slot = (slot + 1) & mask)
+    {
+      struct ledger_slot *s = &l->slots[slot];
+      uint64_t k = __atomic_load_n (&s->key, __ATOMIC_ACQUIRE);
+
+      if (k == key)
+        return s;
+      if (k == 0)
+        {
+          if (!create)
+            break;
+          if (__atomic_compare_exchange_n (&s->key, &k, key, 0,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+              || (k == key))
+            return s;
+        }
+    }
+  if (create)
+    {
+      now = ledger_now ();
+      for (n = 0, slot = home; n <= mask; n++, slot = (slot + 1) & mask)
+        {
+          struct ledger_slot *s = &l->slots[slot];
+          uint64_t k = __atomic_load_n (&s->key, __ATOMIC_ACQUIRE);
+
+          if (k == key)
+            return s;
+          if (ledger_idle (l, s, now)
+              && (__atomic_compare_exchange_n (&s->key, &k, key, 0,
+                                               __ATOMIC_ACQ_REL,
+                                               __ATOMIC_ACQUIRE)
+                  || (k == key)))
+            return s;
+        }
+    }
+  errno = create ? ENOSPC : ENOENT;
+  return NULL;
+}
+
+/*
+ * subtract n from *p, but not below 0 (release of more than was reserved)
+ */
+static void
+ledger_sub (uint64_t *p, uint64_t n)
+{
+  uint64_t v = __atomic_load_n (p, __ATOMIC_RELAXED);
+
+  while (!__atomic_compare_exchange_n (p, &v, (v > n) ? v - n : 0, 1,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    ;
+}
+
+/*
+ * give back what the holder h of the dead process pid had reserved; the
+ * exchanges make sure only one process does
+ */
+static void
+ledger_reap (struct ledger_slot *s, struct ledger_holder *h, uint32_t pid)
+{
+  ledger_sub (&s->bcharged, __atomic_exchange_n (&h->bytes, 0,
+                                                 __ATOMIC_ACQ_REL));
+  ledger_sub (&s->icharged, __atomic_exchange_n (&h->inodes, 0,
+                                                 __ATOMIC_ACQ_REL));
+  __atomic_compare_exchange_n (&h->pid, &pid, 0, 0, __ATOMIC_ACQ_REL,
+                               __ATOMIC_RELAXED);
+}
+
+/* reap the holders of processes that are gone; returns how many */
+static int
+ledger_reap_dead (struct ledger_slot *s)
+{
+  uint32_t self = getpid ();
+  int i, n = 0;
+
+  for (i = 0; i < LEDGER_HOLDERS; i++)
+    {
+      struct ledger_holder *h = &s->holders[i];
+      uint32_t pid = __atomic_load_n (&h->pid, __ATOMIC_ACQUIRE);
+
+      if ((pid != 0) && (pid != self) && (kill (pid, 0) != 0)
+          && (errno == ESRCH))
+        {
+          ledger_reap (s, h, pid);
+          n++;
+        }
+    }
+  return n;
+}
+
+/*
+ * the holder of this process in s; if create is set and it has none, a
+ * free one is claimed, reaping dead processes if there is none. NULL if
+ * all are held by live processes.
+ */
+static struct ledger_holder *
+ledger_holder (struct ledger_slot *s, int create)
+{
+  uint32_t self = getpid ();
+  int i, j, pass;
+
+  for (i = 0; i < LEDGER_HOLDERS; i++)
+    {
+      if (__atomic_load_n (&s->holders[i].pid, __ATOMIC_ACQUIRE) == self)
+        return &s->holders[i];
+    }
+  if (!create)
+    return NULL;
+  for (pass = 0; pass < 2; pass++)
+    {
+      for (i = 0; i < LEDGER_HOLDERS; i++)
+        {
+          uint32_t pid = 0;
+
+          if (!__atomic_compare_exchange_n (&s->holders[i].pid, &pid, self,
+                                            0, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_RELAXED))
+            continue;
+          /* another thread may have claimed one first; keep the lowest */
+          for (j = 0; j < i; j++)
+            {
+              if (__atomic_load_n (&s->holders[j].pid, __ATOMIC_ACQUIRE)
+                  == self)
+                {
+                  __atomic_store_n (&s->holders[i].pid, 0, __ATOMIC_RELEASE);
+                  return &s->holders[j];
+                }
+            }
+          return &s->holders[i];
+        }
+      if (ledger_reap_dead (s) == 0)
+        break;
+    }
+  errno = EAGAIN;
+  return NULL;
+}
+
+/* record bytes and inodes as reserved by this process */
+static int
+ledger_hold (struct ledger_slot *s, uint64_t bytes, uint64_t inodes)
+{
+  uint32_t self = getpid ();
+  struct ledger_holder *h;
+
+  for (;;)
+    {
+      h = ledger_holder (s, 1);
+      if (h == NULL)
+        return -1;
+      __atomic_add_fetch (&h->bytes, bytes, __ATOMIC_ACQ_REL);
+      __atomic_add_fetch (&h->inodes, inodes, __ATOMIC_ACQ_REL);
+      if (__atomic_load_n (&h->pid, __ATOMIC_ACQUIRE) == self)
+        return 0;
+      /* another thread of the process let it go meanwhile */
+      ledger_sub (&h->bytes, bytes);
+      ledger_sub (&h->inodes, inodes);
+    }
+}
+
+/* drop bytes and inodes from the reservations of this process */
+static void
+ledger_unhold (struct ledger_slot *s, uint64_t bytes, uint64_t inodes)
+{
+  struct ledger_holder *h = ledger_holder (s, 0);
+  uint32_t self = getpid ();
+
+  if (h == NULL)
+    return;
+  ledger_sub (&h->bytes, bytes);
+  ledger_sub (&h->inodes, inodes);
+  if ((__atomic_load_n (&h->bytes, __ATOMIC_ACQUIRE) == 0)
+      && (__atomic_load_n (&h->inodes, __ATOMIC_ACQUIRE) == 0))
+    __atomic_compare_exchange_n (&h->pid, &self, 0, 0, __ATOMIC_ACQ_REL,
+                                 __ATOMIC_RELAXED);
+}
+
+/*
+ * add n to *p if it then stays within room; returns 0 if it did
+ */
+static int
+ledger_charge (uint64_t *p, uint64_t n, uint64_t room)
+{
+  uint64_t v = __atomic_load_n (p, __ATOMIC_RELAXED);
+
+  do
+    {
+      if ((room != UINT64_MAX) && ((v > room) || (n > room - v)))
+        return 1;
+    }
+  while (!__atomic_compare_exchange_n (p, &v, v + n, 1, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_RELAXED));
+  return 0;
+}
+
+/*
+ * Query the quota and store the room it leaves. The committed charges are
+ * taken before the query, and the room is stored before they are dropped
+ * from the charge: a concurrent admission may count a write twice, but
+ * never not at all.
+ */
+static int
+ledger_refresh (struct ledger_slot *s, char *dev, int id, quota_type kind)
+{
+  uint64_t now = time (NULL);
+  uint64_t bcommitted, icommitted;
+  uint64_t broom, iroom;
+  query_ret q;
+
+  bcommitted = __atomic_exchange_n (&s->bcommitted, 0, __ATOMIC_ACQ_REL);
+  icommitted = __atomic_exchange_n (&s->icommitted, 0, __ATOMIC_ACQ_REL);
+  errno = 0;
+  q = quota_query (dev, id, kind);
+  if ((errno != 0) || strcmp (quota_strerr (), strerror (0)))
+    {
+      int err = errno;
+
+      /* give them back to the next refresh */
+      __atomic_add_fetch (&s->bcommitted, bcommitted, __ATOMIC_ACQ_REL);
+      __atomic_add_fetch (&s->icommitted, icommitted, __ATOMIC_ACQ_REL);
+      errno = err;
+      return -1;
+    }
+
+  headroom_room (&q, quota_block_size (dev), now, &broom, &iroom);
+
+  __atomic_store_n (&s->broom, broom, __ATOMIC_RELEASE);
+  __atomic_store_n (&s->iroom, iroom, __ATOMIC_RELEASE);
+  ledger_sub (&s->bcharged, bcommitted);
+  ledger_sub (&s->icharged, icommitted);
+  __atomic_store_n (&s->fetched, ledger_now (), __ATOMIC_RELEASE);
+  return 0;
+}
+
+/*
+ * Make sure the slot has values no older than the ttl, unless another
+ * process is already querying them; only a slot that never had any waits
+ * for that.
+ */
+static int
+ledger_update (quota_ledger *l, struct ledger_slot *s, char *dev, int id,
+               quota_type kind)
+{
+  uint32_t pid = getpid ();
+
+  for (;;)
+    {
+      uint64_t fetched = __atomic_load_n (&s->fetched, __ATOMIC_ACQUIRE);
+      uint64_t now = ledger_now ();
+      uint32_t holder = 0;
+      int ret;
+
+      /* a ledger kept over a reboot has times from the future */
+      if ((fetched != 0) && (fetched <= now) && (now - fetched < l->ttl))
+        return 0;
+      if (__atomic_compare_exchange_n (&s->refresher, &holder, pid, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+          ledger_reap_dead (s);
+          ret = ledger_refresh (s, dev, id, kind);
+          __atomic_store_n (&s->refresher, 0, __ATOMIC_RELEASE);
+          return ret;
+        }
+      /* go on with the old values, unless the holder died while querying */
+      if (fetched != 0)
+        {
+          if ((now - fetched < 2 * l->ttl) || (kill (holder, 0) == 0)
+              || (errno != ESRCH))
+            return 0;
+        }
+      else if ((kill (holder, 0) == 0) || (errno != ESRCH))
+        {
+          sched_yield ();
+          continue;
+        }
+      __atomic_compare_exchange_n (&s->refresher, &holder, 0, 0,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
+}
+
+quota_ledger *
+quota_ledger_open (char *path, unsigned int slots, unsigned int ttl)
+{
+  struct ledger_header hdr;
+  quota_ledger *l;
+  struct stat st;
+  void *map;
+  int fd;
+
+  /* workers of other uids may share it; the umask decides */
+  fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd == -1)
+    return NULL;
+  /* processes opening a new ledger at once: one writes the header, the
+     others only see it complete */
+  if ((flock (fd, LOCK_EX) != 0) || (fstat (fd, &st) != 0))
+    goto failure;
+
+  if (st.st_size == 0)
+    {
+      /* new file: round the table up to a power of two */
+      uint32_t n = 1;
+
+      if ((slots == 0) || (slots > (1u << 26)))
+        {
+          errno = EINVAL;
+          goto failure;
+        }
+      while (n < slots)
+        n <<= 1;
+
+      memset (&hdr, 0, sizeof (hdr));
+      memcpy (hdr.magic, LEDGER_MAGIC, sizeof (hdr.magic));
+      hdr.version = LEDGER_VERSION;
+      hdr.bom = LEDGER_BOM;
+      hdr.slots = n;
+      st.st_size = sizeof (hdr) + (off_t)n * sizeof (struct ledger_slot);
+      if ((ftruncate (fd, st.st_size) != 0)
+          || (pwrite (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)))
+        goto failure;
+    }
+  else if ((st.st_size < (off_t)sizeof (hdr))
+           || (pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr))
+           || memcmp (hdr.magic, LEDGER_MAGIC, sizeof (hdr.magic))
+           || (hdr.version != LEDGER_VERSION) || (hdr.bom != LEDGER_BOM)
+           || (st.st_size
+               != (off_t)(sizeof (hdr)
+                          + (off_t)hdr.slots * sizeof (struct ledger_slot))))
+    {
+      errno = EINVAL;
+      goto failure;
+    }
+
+  map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto failure;
+  close (fd);
+
+  l = malloc (sizeof (*l));
+  if (l == NULL)
+    {
+      munmap (map, st.st_size);
+      return NULL;
+    }
+  l->hdr = map;
+  l->slots = (struct ledger_slot *)(l->hdr + 1);
+  l->maplen = st.st_size;
+  l->ttl = ttl;
+  return l;
+
+failure:
+  close (fd);
+  return NULL;
+}
+
+void
+quota_ledger_close (quota_ledger *l)
+{
+  if (l == NULL)
+    return;
+  munmap (l->hdr, l->maplen);
+  free (l);
+}
+
+int
+quota_reserve (quota_ledger *l, char *dev, int id, quota_type kind,
+               uint64_t bytes, uint64_t inodes)
+{
+  uint64_t key = ledger_key (dev, id, kind);
+  struct ledger_slot *s;
+
+  for (;;)
+    {
+      s = ledger_find (l, key, 1);
+      if ((s == NULL) || (ledger_update (l, s, dev, id, kind) != 0))
+        return -1;
+
+      if (ledger_charge (&s->bcharged, bytes,
+                         __atomic_load_n (&s->broom, __ATOMIC_ACQUIRE))
+          != 0)
+        return 1;
+      if (ledger_charge (&s->icharged, inodes,
+                         __atomic_load_n (&s->iroom, __ATOMIC_ACQUIRE))
+          != 0)
+        {
+          ledger_sub (&s->bcharged, bytes);
+          return 1;
+        }
+      if (ledger_hold (s, bytes, inodes) != 0)
+        {
+          ledger_sub (&s->bcharged, bytes);
+          ledger_sub (&s->icharged, inodes);
+          return -1;
+        }
+      if (__atomic_load_n (&s->key, __ATOMIC_ACQUIRE) == key)
+        return 0;
+      /* the slot went to another id before the charge showed */
+      ledger_unhold (s, bytes, inodes);
+      ledger_sub (&s->bcharged, bytes);
+      ledger_sub (&s->icharged, inodes);
+    }
+}
+
+int
+quota_commit (quota_ledger *l, char *dev, int id, quota_type kind,
+              uint64_t bytes, uint64_t inodes)
+{
+  struct ledger_slot *s = ledger_find (l, ledger_key (dev, id, kind), 0);
+
+  if (s == NULL)
+    return -1;
+  ledger_unhold (s, bytes, inodes);
+  /* still charged until the next query counts them */
+  __atomic_add_fetch (&s->bcommitted, bytes, __ATOMIC_ACQ_REL);
+  __atomic_add_fetch (&s->icommitted, inodes, __ATOMIC_ACQ_REL);
+  return 0;
+}
+
+int
+quota_release (quota_ledger *l, char *dev, int id, quota_type kind,
+               uint64_t bytes, uint64_t inodes)
+{
+  struct ledger_slot *s = ledger_find (l, ledger_key (dev, id, kind), 0);
+
+  if (s == NULL)
+    return -1;
+  ledger_unhold (s, bytes, inodes);
+  ledger_sub (&s->bcharged, bytes);
+  ledger_sub (&s->icharged, inodes);
+  return 0;
+}
@@ -10,8 +10,11 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "Quota.h"
 #include "myconfig.h"
 
+#include "include/quotatrace.h"
+
 /* API v1 command definitions */
 #define Q_V1_GETQUOTA 0x0300
 #define Q_V1_SYNC 0x0600
@@ -24,8 +27,12 @@
 #define Q_V2_GETSTATS 0x1100
 /* proc API command definitions */
 #define Q_V3_SYNC 0x800001
+#define Q_V3_GETFMT 0x800004
+#define Q_V3_GETINFO 0x800005
+#define Q_V3_SETINFO 0x800006
 #define Q_V3_GETQUOTA 0x800007
 #define Q_V3_SETQUOTA 0x800008
+#define Q_V3_GETNEXTQUOTA 0x800009
 
 /* Interface versions */
 #define IFACE_UNSET 0
@@ -79,6 +86,37 @@ union dqblk_v3_wrap
   u_int64_t foo[9];
 };
 
+/* Q_GETNEXTQUOTA returns the id of the entry after dqb_valid */
+struct dqblk_v3_next
+{
+  u_int64_t dqb_bhardlimit;
+  u_int64_t dqb_bsoftlimit;
+  u_int64_t dqb_curspace;
+  u_int64_t dqb_ihardlimit;
+  u_int64_t dqb_isoftlimit;
+  u_int64_t dqb_curinodes;
+  u_int64_t dqb_btime;
+  u_int64_t dqb_itime;
+  u_int32_t dqb_valid;
+  u_int32_t dqb_id;
+};
+
+/*
+ * Quota file information used with Q_GETINFO/Q_SETINFO
+ * Following flags are used to specify which fields are valid
+ */
+#define IIF_BGRACE 1
+#define IIF_IGRACE 2
+#define IIF_FLAGS 4
+
+struct dqinfo_v3
+{
+  u_int64_t dqi_bgrace;
+  u_int64_t dqi_igrace;
+  u_int32_t dqi_flags;
+  u_int32_t dqi_valid;
+};
+
 struct dqstats_v2
 {
   u_int32_t lookups;
@@ -223,7 +261,7 @@ failure:
 ** For API v2 the results are copied back into a v1 structure.
 */
 int
-linuxquota_query (const char *dev, int uid, int isgrp, struct dqblk *dqb)
+linuxquota_query (const char *dev, int uid, int type, struct dqblk *dqb)
 {
   int ret;
 
@@ -234,7 +272,7 @@ linuxquota_query (const char *dev, int uid, int isgrp, struct dqblk *dqb)
     {
       union dqblk_v3_wrap dqb3;
 
-      ret = quotactl (QCMD (Q_V3_GETQUOTA, (isgrp ? GRPQUOTA : USRQUOTA)), dev,
+      ret = quotactl (QCMD (Q_V3_GETQUOTA, type), dev,
                       uid, (caddr_t)&dqb3.dqblk);
       if (ret == 0)
         {
@@ -252,8 +290,7 @@ linuxquota_query (const char *dev, int uid, int isgrp, struct dqblk *dqb)
     {
       struct dqblk_v2 dqb2;
 
-      ret = quotactl (QCMD (Q_V2_GETQUOTA, (isgrp ? GRPQUOTA : USRQUOTA)), dev,
-                      uid, (caddr_t)&dqb2);
+      ret = quotactl (QCMD (Q_V2_GETQUOTA, type), dev, uid, (caddr_t)&dqb2);
       if (ret == 0)
         {
           dqb->dqb_bhardlimit = dqb2.dqb_bhardlimit;
@@ -270,8 +307,7 @@ linuxquota_query (const char *dev, int uid, int isgrp, struct dqblk *dqb)
     {
       struct dqblk_v1 dqb1;
 
-      ret = quotactl (QCMD (Q_V1_GETQUOTA, (isgrp ? GRPQUOTA : USRQUOTA)), dev,
-                      uid, (caddr_t)&dqb1);
+      ret = quotactl (QCMD (Q_V1_GETQUOTA, type), dev, uid, (caddr_t)&dqb1);
       if (ret == 0)
         {
           dqb->dqb_bhardlimit = dqb1.dqb_bhardlimit;
@@ -287,12 +323,49 @@ linuxquota_query (const char *dev, int uid, int isgrp, struct dqblk *dqb)
   return ret;
 }
 
+/*
+** Wrapper for the quotactl(GETNEXTQUOTA) call: fetches the first entry with
+** an id >= *id and stores that id in *id. Fails with ENOENT after the last
+** entry. Only supported by the generic interface (kernel 4.6 and later).
+*/
+int
+linuxquota_query_next (const char *dev, unsigned int *id, int type,
+                       struct dqblk *dqb)
+{
+  struct dqblk_v3_next dqbn;
+  int ret;
+
+  if (kernel_iface == IFACE_UNSET)
+    linuxquota_get_api ();
+
+  if (kernel_iface != IFACE_GENERIC)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  ret = quotactl (QCMD (Q_V3_GETNEXTQUOTA, type), dev, *id, (caddr_t)&dqbn);
+  if (ret == 0)
+    {
+      *id = dqbn.dqb_id;
+      dqb->dqb_bhardlimit = dqbn.dqb_bhardlimit;
+      dqb->dqb_bsoftlimit = dqbn.dqb_bsoftlimit;
+      dqb->dqb_curblocks = dqbn.dqb_curspace / DEV_QBSIZE;
+      dqb->dqb_ihardlimit = dqbn.dqb_ihardlimit;
+      dqb->dqb_isoftlimit = dqbn.dqb_isoftlimit;
+      dqb->dqb_curinodes = dqbn.dqb_curinodes;
+      dqb->dqb_btime = dqbn.dqb_btime;
+      dqb->dqb_itime = dqbn.dqb_itime;
+    }
+  return ret;
+}
+
 /*
 ** Wrapper for the quotactl(GETQUOTA) call.
 ** For API v2 and v3 the parameters are copied into the internal structure.
 */
 int
-linuxquota_setqlim (const char *dev, int uid, int isgrp, struct dqblk *dqb)
+linuxquota_setqlim (const char *dev, int uid, int type, struct dqblk *dqb)
 {
   int ret;
 
@@ -313,7 +386,7 @@ linuxquota_setqlim (const char *dev, int uid, int isgrp, struct dqblk *dqb)
       dqb3.dqblk.dqb_itime = dqb->dqb_itime;
       dqb3.dqblk.dqb_valid = (QIF_BLIMITS | QIF_ILIMITS);
 
-      ret = quotactl (QCMD (Q_V3_SETQUOTA, (isgrp ? GRPQUOTA : USRQUOTA)), dev,
+      ret = quotactl (QCMD (Q_V3_SETQUOTA, type), dev,
                       uid, (caddr_t)&dqb3.dqblk);
     }
   else if (kernel_iface == IFACE_VFSV0)
@@ -329,8 +402,7 @@ linuxquota_setqlim (const char *dev, int uid, int isgrp, struct dqblk *dqb)
       dqb2.dqb_btime = dqb->dqb_btime;
       dqb2.dqb_itime = dqb->dqb_itime;
 
-      ret = quotactl (QCMD (Q_V2_SETQLIM, (isgrp ? GRPQUOTA : USRQUOTA)), dev,
-                      uid, (caddr_t)&dqb2);
+      ret = quotactl (QCMD (Q_V2_SETQLIM, type), dev, uid, (caddr_t)&dqb2);
     }
   else /* if (kernel_iface == IFACE_VFSOLD) */
     {
@@ -345,18 +417,207 @@ linuxquota_setqlim (const char *dev, int uid, int isgrp, struct dqblk *dqb)
       dqb1.dqb_btime = dqb->dqb_btime;
       dqb1.dqb_itime = dqb->dqb_itime;
 
-      ret = quotactl (QCMD (Q_V1_SETQLIM, (isgrp ? GRPQUOTA : USRQUOTA)), dev,
-                      uid, (caddr_t)&dqb1);
+      ret = quotactl (QCMD (Q_V1_SETQLIM, type), dev, uid, (caddr_t)&dqb1);
+    }
+
+  return ret;
+}
+
+/*
+** Wrapper for a partial quotactl(SETQUOTA) call: only the fields selected by
+** mask (quota_field bits) are applied. The generic interface expresses this
+** through dqb_valid, or through Q_XSETQLIM's d_fieldmask when only one limit
+** of a soft/hard pair changes. Older interfaces have no field mask, so the
+** current values are read and written back.
+*/
+int
+linuxquota_setqlim_fields (const char *dev, int uid, int type,
+                           struct dqblk *dqb, int mask)
+{
+  int bpair = mask & (PHP_QUOTA_FIELD_BS | PHP_QUOTA_FIELD_BH);
+  int ipair = mask & (PHP_QUOTA_FIELD_FS | PHP_QUOTA_FIELD_FH);
+  int ret;
+
+  if (kernel_iface == IFACE_UNSET)
+    linuxquota_get_api ();
+
+  if ((kernel_iface == IFACE_GENERIC)
+      && ((bpair == 0) || (bpair == (PHP_QUOTA_FIELD_BS | PHP_QUOTA_FIELD_BH)))
+      && ((ipair == 0) || (ipair == (PHP_QUOTA_FIELD_FS | PHP_QUOTA_FIELD_FH))))
+    {
+      union dqblk_v3_wrap dqb3;
+
+      dqb3.dqblk.dqb_bhardlimit = dqb->dqb_bhardlimit;
+      dqb3.dqblk.dqb_bsoftlimit = dqb->dqb_bsoftlimit;
+      dqb3.dqblk.dqb_curspace = dqb->dqb_curblocks * DEV_QBSIZE;
+      dqb3.dqblk.dqb_ihardlimit = dqb->dqb_ihardlimit;
+      dqb3.dqblk.dqb_isoftlimit = dqb->dqb_isoftlimit;
+      dqb3.dqblk.dqb_curinodes = dqb->dqb_curinodes;
+      dqb3.dqblk.dqb_btime = dqb->dqb_btime;
+      dqb3.dqblk.dqb_itime = dqb->dqb_itime;
+      dqb3.dqblk.dqb_valid = ((bpair ? QIF_BLIMITS : 0)
+                              | (ipair ? QIF_ILIMITS : 0)
+                              | ((mask & PHP_QUOTA_FIELD_BC) ? QIF_SPACE : 0)
+                              | ((mask & PHP_QUOTA_FIELD_FC) ? QIF_INODES : 0)
+                              | ((mask & PHP_QUOTA_FIELD_BT) ? QIF_BTIME : 0)
+                              | ((mask & PHP_QUOTA_FIELD_FT) ? QIF_ITIME : 0));
+
+      ret = quotactl (QCMD (Q_V3_SETQUOTA, type), dev,
+                      uid, (caddr_t)&dqb3.dqblk);
+    }
+#ifdef SGI_XFS
+  else if (kernel_iface == IFACE_GENERIC)
+    {
+      fs_disk_quota_t xfs_dqblk;
+
+      memset (&xfs_dqblk, 0, sizeof (xfs_dqblk));
+      xfs_dqblk.d_version = FS_DQUOT_VERSION;
+      xfs_dqblk.d_flags
+          = ((type == PRJQUOTA)
+                 ? XFS_PROJ_QUOTA
+                 : ((type == GRPQUOTA) ? XFS_GROUP_QUOTA : XFS_USER_QUOTA));
+      xfs_dqblk.d_id = uid;
+      xfs_dqblk.d_blk_softlimit = QX_MUL (dqb->dqb_bsoftlimit);
+      xfs_dqblk.d_blk_hardlimit = QX_MUL (dqb->dqb_bhardlimit);
+      xfs_dqblk.d_ino_softlimit = dqb->dqb_isoftlimit;
+      xfs_dqblk.d_ino_hardlimit = dqb->dqb_ihardlimit;
+      xfs_dqblk.d_bcount = QX_MUL (dqb->dqb_curblocks);
+      xfs_dqblk.d_icount = dqb->dqb_curinodes;
+      xfs_dqblk.d_btimer = dqb->dqb_btime;
+      xfs_dqblk.d_itimer = dqb->dqb_itime;
+      xfs_dqblk.d_fieldmask
+          = (((mask & PHP_QUOTA_FIELD_BS) ? FS_DQ_BSOFT : 0)
+             | ((mask & PHP_QUOTA_FIELD_BH) ? FS_DQ_BHARD : 0)
+             | ((mask & PHP_QUOTA_FIELD_FS) ? FS_DQ_ISOFT : 0)
+             | ((mask & PHP_QUOTA_FIELD_FH) ? FS_DQ_IHARD : 0)
+             | ((mask & PHP_QUOTA_FIELD_BC) ? FS_DQ_BCOUNT : 0)
+             | ((mask & PHP_QUOTA_FIELD_FC) ? FS_DQ_ICOUNT : 0)
+             | ((mask & PHP_QUOTA_FIELD_BT) ? FS_DQ_BTIMER : 0)
+             | ((mask & PHP_QUOTA_FIELD_FT) ? FS_DQ_ITIMER : 0));
+
+      ret = quotactl (QCMD (Q_XSETQLIM, type), dev, uid,
+                      (caddr_t)&xfs_dqblk);
+    }
+#endif
+  else if (mask & (PHP_QUOTA_FIELD_BC | PHP_QUOTA_FIELD_FC))
+    {
+      /* usage can only be set through the generic interface */
+      errno = ENOTSUP;
+      ret = -1;
+    }
+  else
+    {
+      struct dqblk cur;
+
+      ret = linuxquota_query (dev, uid, type, &cur);
+      if (ret == 0)
+        {
+          if (mask & PHP_QUOTA_FIELD_BS)
+            cur.dqb_bsoftlimit = dqb->dqb_bsoftlimit;
+          if (mask & PHP_QUOTA_FIELD_BH)
+            cur.dqb_bhardlimit = dqb->dqb_bhardlimit;
+          if (mask & PHP_QUOTA_FIELD_BT)
+            cur.dqb_btime = dqb->dqb_btime;
+          if (mask & PHP_QUOTA_FIELD_FS)
+            cur.dqb_isoftlimit = dqb->dqb_isoftlimit;
+          if (mask & PHP_QUOTA_FIELD_FH)
+            cur.dqb_ihardlimit = dqb->dqb_ihardlimit;
+          if (mask & PHP_QUOTA_FIELD_FT)
+            cur.dqb_itime = dqb->dqb_itime;
+          ret = linuxquota_setqlim (dev, uid, type, &cur);
+        }
+    }
+
+  return ret;
+}
+
+/*
+** Check whether quotas are turned on, using quotactl(GETFMT) which
+** needs no privileges. Fails with ESRCH if they are off; older interfaces
+** have no suitable call and fail with ENOTSUP.
+*/
+int
+linuxquota_probe (const char *dev, int type)
+{
+  u_int32_t fmt;
+
+  if (kernel_iface == IFACE_UNSET)
+    linuxquota_get_api ();
+
+  if (kernel_iface != IFACE_GENERIC)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  return quotactl (QCMD (Q_V3_GETFMT, type), dev, 0, (caddr_t)&fmt);
+}
+
+/*
+** Wrapper for the quotactl(GETFMT) and quotactl(GETINFO) calls.
+** Only supported by the generic interface.
+*/
+int
+linuxquota_getinfo (const char *dev, int type, info_ret *info)
+{
+  struct dqinfo_v3 dqi;
+  u_int32_t fmt;
+  int ret;
+
+  if (kernel_iface == IFACE_UNSET)
+    linuxquota_get_api ();
+
+  if (kernel_iface != IFACE_GENERIC)
+    {
+      errno = ENOTSUP;
+      return -1;
     }
 
+  ret = quotactl (QCMD (Q_V3_GETFMT, type), dev, 0, (caddr_t)&fmt);
+  if (ret == 0)
+    ret = quotactl (QCMD (Q_V3_GETINFO, type), dev, 0, (caddr_t)&dqi);
+  if (ret == 0)
+    {
+      info->bgrace = dqi.dqi_bgrace;
+      info->igrace = dqi.dqi_igrace;
+      info->flags = dqi.dqi_flags;
+      info->format = fmt;
+    }
   return ret;
 }
 
+/*
+** Wrapper for the quotactl(SETINFO) call; mask holds quota_info_field bits.
+*/
+int
+linuxquota_setinfo (const char *dev, int type, info_ret *info, int mask)
+{
+  struct dqinfo_v3 dqi;
+
+  if (kernel_iface == IFACE_UNSET)
+    linuxquota_get_api ();
+
+  if (kernel_iface != IFACE_GENERIC)
+    {
+      errno = ENOTSUP;
+      return -1;
+    }
+
+  dqi.dqi_bgrace = info->bgrace;
+  dqi.dqi_igrace = info->igrace;
+  dqi.dqi_flags = info->flags;
+  dqi.dqi_valid = (((mask & PHP_QUOTA_INFO_BGRACE) ? IIF_BGRACE : 0)
+                   | ((mask & PHP_QUOTA_INFO_IGRACE) ? IIF_IGRACE : 0)
+                   | ((mask & PHP_QUOTA_INFO_FLAGS) ? IIF_FLAGS : 0));
+
+  return quotactl (QCMD (Q_V3_SETINFO, type), dev, 0, (caddr_t)&dqi);
+}
+
 /*
 ** Wrapper for the quotactl(SYNC) call.
 */
 int
-linuxquota_sync (const char *dev, int isgrp)
+linuxquota_sync (const char *dev, int type)
 {
   int ret;
 
@@ -365,23 +626,86 @@ linuxquota_sync (const char *dev, int isgrp)
 
   if (kernel_iface == IFACE_GENERIC)
     {
-      ret = quotactl (QCMD (Q_V3_SYNC, (isgrp ? GRPQUOTA : USRQUOTA)), dev, 0,
-                      NULL);
+      ret = quotactl (QCMD (Q_V3_SYNC, type), dev, 0, NULL);
     }
   else if (kernel_iface == IFACE_VFSV0)
     {
-      ret = quotactl (QCMD (Q_V2_SYNC, (isgrp ? GRPQUOTA : USRQUOTA)), dev, 0,
-                      NULL);
+      ret = quotactl (QCMD (Q_V2_SYNC, type), dev, 0, NULL);
     }
   else /* if (kernel_iface == IFACE_VFSOLD) */
     {
-      ret = quotactl (QCMD (Q_V1_SYNC, (isgrp ? GRPQUOTA : USRQUOTA)), dev, 0,
-                      NULL);
+      ret = quotactl (QCMD (Q_V1_SYNC, type), dev, 0, NULL);
     }
 
   return ret;
 }
 
+/*
+** Kernel dquot cache statistics: from /proc/sys/fs/quota with the generic
+** interface, from quotactl(GETSTATS) before that.
+*/
+int
+linuxquota_kernel_stats (kernel_stats_ret *st)
+{
+  static const char *const names[] = {
+    "lookups",    "drops",           "reads",       "writes",
+    "cache_hits", "allocated_dquots", "free_dquots", "syncs",
+  };
+  uint64_t *vals[] = {
+    &st->lookups,    &st->drops,           &st->reads,       &st->writes,
+    &st->cache_hits, &st->allocated_dquots, &st->free_dquots, &st->syncs,
+  };
+  struct dqstats_v2 v2_stats;
+  int i;
+
+  if (kernel_iface == IFACE_UNSET)
+    linuxquota_get_api ();
+
+  memset (st, 0, sizeof (*st));
+  if (kernel_iface == IFACE_GENERIC)
+    {
+      for (i = 0; i < 8; i++)
+        {
+          char path[64];
+          unsigned long long val;
+          FILE *fp;
+          int n;
+
+          snprintf (path, sizeof (path), "/proc/sys/fs/quota/%s", names[i]);
+          fp = fopen (path, "r");
+          if (fp == NULL)
+            return -1;
+          n = fscanf (fp, "%llu", &val);
+          fclose (fp);
+          if (n != 1)
+            {
+              errno = EIO;
+              return -1;
+            }
+          *vals[i] = val;
+        }
+      return 0;
+    }
+
+  memset (&v2_stats, 0, sizeof (v2_stats));
+  if (quotactl (QCMD ((kernel_iface == IFACE_VFSV0) ? Q_V2_GETSTATS
+                                                    : Q_V1_GETSTATS,
+                      0),
+                NULL, 0, (void *)&v2_stats)
+      != 0)
+    return -1;
+  st->lookups = v2_stats.lookups;
+  st->drops = v2_stats.drops;
+  st->reads = v2_stats.reads;
+  st->writes = v2_stats.writes;
+  st->cache_hits = v2_stats.cache_hits;
+  st->allocated_dquots = v2_stats.allocated_dquots;
+  st->free_dquots = v2_stats.free_dquots;
+  st->syncs = v2_stats.syncs;
+  st->version = v2_stats.version;
+  return 0;
+}
+
 #if 0
 #define DEVICE_PATH "/dev/hda6"
 main()
@@ -0,0 +1,172 @@
+/*
+**  Mount table filter
+**
+**  Entries are checked by quota_getmntent before they are returned, so
+**  that callers (PHP in particular) only see the few mounts they asked
+**  for. All lists are comma separated; a type ending in '*' matches every
+**  type with that prefix ("nfs*"), and an option matches with any value
+**  ("usrjquota" matches "usrjquota=aquota.user").
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Quota.h"
+#include "include/mntfilter.h"
+
+struct mntfilter
+{
+  char *types;
+  char *skip_types;
+  char *opts;
+  char *any_opts;
+  char *prefix;
+  size_t prefixlen;
+  char strings[];
+};
+
+static char *
+mntfilter_copy (char **p, const char *s)
+{
+  char *ret;
+
+  if ((s == NULL) || (*s == '\0'))
+    return NULL;
+  ret = strcpy (*p, s);
+  *p += strlen (s) + 1;
+  return ret;
+}
+
+struct mntfilter *
+mntfilter_new (const mntent_filter *spec)
+{
+  const char *strs[] = { spec->types, spec->skip_types, spec->opts,
+                         spec->any_opts, spec->prefix };
+  struct mntfilter *f;
+  size_t len = 0;
+  char *p;
+  int i;
+
+  for (i = 0; i < 5; i++)
+    {
+      if (strs[i] != NULL)
+        len += strlen (strs[i]) + 1;
+    }
+  f = malloc (sizeof (*f) + len);
+  if (f == NULL)
+    return NULL;
+  p = f->strings;
+  f->types = mntfilter_copy (&p, spec->types);
+  f->skip_types = mntfilter_copy (&p, spec->skip_types);
+  f->opts = mntfilter_copy (&p, spec->opts);
+  f->any_opts = mntfilter_copy (&p, spec->any_opts);
+  f->prefix = mntfilter_copy (&p, spec->prefix);
+  f->prefixlen = (f->prefix != NULL) ? strlen (f->prefix) : 0;
+  /* "/home/" selects the same mounts as "/home" */
+  while ((f->prefixlen > 1) && (f->prefix[f->prefixlen - 1] == '/'))
+    f->prefixlen--;
+  return f;
+}
+
+void
+mntfilter_free (struct mntfilter *f)
+{
+  free (f);
+}
+
+/*
+ * end of the list item at s
+ */
+static const char *
+item_end (const char *s)
+{
+  while ((*s != '\0') && (*s != ','))
+    s++;
+  return s;
+}
+
+/*
+ * whether the comma separated list has an item matching s[0..len)
+ */
+static int
+list_has (const char *list, const char *s, size_t len)
+{
+  const char *item, *end;
+  size_t n;
+
+  for (item = list; item != NULL; item = (*end != '\0') ? end + 1 : NULL)
+    {
+      end = item_end (item);
+      n = end - item;
+      if ((n > 0) && (item[n - 1] == '*'))
+        {
+          if ((len >= n - 1) && !memcmp (item, s, n - 1))
+            return 1;
+        }
+      else if ((n == len) && !memcmp (item, s, n))
+        return 1;
+    }
+  return 0;
+}
+
+/*
+ * whether the mount options have option name (with or without a value)
+ */
+static int
+opts_have (const char *opts, const char *name, size_t len)
+{
+  const char *opt, *end;
+  size_t n;
+
+  for (opt = opts; opt != NULL; opt = (*end != '\0') ? end + 1 : NULL)
+    {
+      end = item_end (opt);
+      n = end - opt;
+      if ((n >= len) && !memcmp (opt, name, len)
+          && ((n == len) || (opt[len] == '=')))
+        return 1;
+    }
+  return 0;
+}
+
+static int
+opts_match (const char *opts, const char *list, int all)
+{
+  const char *item, *end;
+
+  for (item = list; item != NULL; item = (*end != '\0') ? end + 1 : NULL)
+    {
+      end = item_end (item);
+      if (end == item)
+        continue;
+      if (opts_have (opts, item, end - item) != all)
+        return !all;
+    }
+  return all;
+}
+
+int
+mntfilter_match (const struct mntfilter *f, const getmntent_ret *ent)
+{
+  const char *type = (ent->type != NULL) ? ent->type : "";
+  const char *opts = (ent->opts != NULL) ? ent->opts : "";
+  size_t typelen = strlen (type);
+
+  if ((f->types != NULL) && !list_has (f->types, type, typelen))
+    return 0;
+  if ((f->skip_types != NULL)
+      && list_has (f->skip_types, type, typelen))
+    return 0;
+  if (f->prefix != NULL)
+    {
+      if ((ent->path == NULL) || strncmp (ent->path, f->prefix, f->prefixlen)
+          || ((ent->path[f->prefixlen] != '\0')
+              && (ent->path[f->prefixlen] != '/') && (f->prefixlen > 1)))
+        return 0;
+    }
+  if ((f->opts != NULL) && !opts_match (opts, f->opts, 1))
+    return 0;
+  if ((f->any_opts != NULL) && !opts_match (opts, f->any_opts, 0))
+    return 0;
+  return 1;
+}
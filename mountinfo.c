@@ -0,0 +1,241 @@
+/*
+**  Parser for /proc/self/mountinfo
+**
+**  The whole file is read into one buffer when it is opened; entries are
+**  then split up in place, so that the strings of an entry point into the
+**  buffer and stay valid until mountinfo_close. Octal escapes (\040 for
+**  blanks etc.) are decoded only in fields that contain a backslash.
+**
+**  Line format, see proc(5):
+**  id parent major:minor root path opts [optional fields] - type source super
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "include/mountinfo.h"
+
+#define MOUNTINFO_CHUNK 65536
+
+struct mountinfo
+{
+  char *buf;
+  char *pos;
+  char *end;
+};
+
+struct mountinfo *
+mountinfo_open (const char *path)
+{
+  struct mountinfo *mi;
+  size_t size = MOUNTINFO_CHUNK;
+  size_t len = 0;
+  ssize_t n;
+  char *buf;
+  int fd;
+
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  buf = malloc (size);
+  mi = malloc (sizeof (*mi));
+  if ((buf == NULL) || (mi == NULL))
+    goto fail;
+
+  /* procfs hands out whole lines, up to a page per read */
+  for (;;)
+    {
+      if (size - len < MOUNTINFO_CHUNK / 4)
+        {
+          char *p = realloc (buf, size * 2);
+
+          if (p == NULL)
+            goto fail;
+          buf = p;
+          size *= 2;
+        }
+      n = read (fd, buf + len, size - len);
+      if (n == 0)
+        break;
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          goto fail;
+        }
+      len += n;
+    }
+  close (fd);
+
+  mi->buf = mi->pos = buf;
+  mi->end = buf + len;
+  return mi;
+
+fail:
+  n = errno;
+  close (fd);
+  free (buf);
+  free (mi);
+  errno = n;
+  return NULL;
+}
+
+/*
+ * decode \ooo escapes in place
+ */
+static void
+mountinfo_unescape (char *s)
+{
+  char *d;
+
+  s = strchr (s, '\\');
+  if (s == NULL)
+    return;
+  for (d = s; *s != '\0'; s++)
+    {
+      if ((s[0] == '\\') && (s[1] >= '0') && (s[1] <= '3') && (s[2] >= '0')
+          && (s[2] <= '7') && (s[3] >= '0') && (s[3] <= '7'))
+        {
+          *d++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+          s += 3;
+        }
+      else
+        *d++ = *s;
+    }
+  *d = '\0';
+}
+
+/*
+ * split off the next blank separated field of the line at *p
+ */
+static char *
+mountinfo_field (char **p, char *eol)
+{
+  char *s = *p;
+  char *e;
+
+  if (s >= eol)
+    return NULL;
+  e = memchr (s, ' ', eol - s);
+  if (e == NULL)
+    e = eol;
+  *e = '\0';
+  *p = e + 1;
+  return s;
+}
+
+static unsigned int
+mountinfo_number (const char *s, char **end)
+{
+  unsigned int n = 0;
+
+  while ((*s >= '0') && (*s <= '9'))
+    n = n * 10 + (*s++ - '0');
+  *end = (char *)s;
+  return n;
+}
+
+/*
+ * returns 0 for an entry, 1 at the end of the table; malformed lines are
+ * skipped
+ */
+int
+mountinfo_next (struct mountinfo *mi, struct mountinfo_entry *ent)
+{
+  while (mi->pos < mi->end)
+    {
+      char *line = mi->pos;
+      char *eol = memchr (line, '\n', mi->end - line);
+      char *p = line;
+      char *f, *e;
+
+      if (eol == NULL)
+        eol = mi->end;
+      mi->pos = eol + 1;
+
+      if (((f = mountinfo_field (&p, eol)) == NULL)
+          || (ent->id = mountinfo_number (f, &e), *e != '\0')
+          || ((f = mountinfo_field (&p, eol)) == NULL)
+          || (ent->parent = mountinfo_number (f, &e), *e != '\0')
+          || ((f = mountinfo_field (&p, eol)) == NULL)
+          || (ent->major = mountinfo_number (f, &e), *e != ':')
+          || (ent->minor = mountinfo_number (e + 1, &e), *e != '\0')
+          || ((ent->root = mountinfo_field (&p, eol)) == NULL)
+          || ((ent->path = mountinfo_field (&p, eol)) == NULL)
+          || ((ent->opts = mountinfo_field (&p, eol)) == NULL))
+        continue;
+      /* optional fields up to the separator */
+      while (((f = mountinfo_field (&p, eol)) != NULL) && strcmp (f, "-"))
+        ;
+      if ((f == NULL) || ((ent->type = mountinfo_field (&p, eol)) == NULL)
+          || ((ent->source = mountinfo_field (&p, eol)) == NULL)
+          || ((ent->super = mountinfo_field (&p, eol)) == NULL))
+        continue;
+
+      mountinfo_unescape (ent->root);
+      mountinfo_unescape (ent->path);
+      mountinfo_unescape (ent->type);
+      mountinfo_unescape (ent->source);
+      mountinfo_unescape (ent->super);
+      return 0;
+    }
+  return 1;
+}
+
+void
+mountinfo_close (struct mountinfo *mi)
+{
+  if (mi == NULL)
+    return;
+  free (mi->buf);
+  free (mi);
+}
+
+/*
+ * quota_query device of the mount in the table path with the given device
+ * number (and mount id, if known), in a new string, or NULL if none has one
+ */
+char *
+mountinfo_quota_dev (const char *path, unsigned int major, unsigned int minor,
+                     unsigned int mnt_id)
+{
+  struct mountinfo *mi = mountinfo_open (path);
+  struct mountinfo_entry ent, match;
+  char *dev = NULL;
+  int found = 0;
+
+  if (mi == NULL)
+    return NULL;
+  while (mountinfo_next (mi, &ent) == 0)
+    {
+      if ((ent.major != major) || (ent.minor != minor))
+        continue;
+      /* bind mounts share the device; the first one will do unless the
+       * mount id is found. The strings stay in the buffer of mi. */
+      if (!found || (ent.id == mnt_id))
+        match = ent;
+      found = 1;
+      if ((mnt_id == 0) || (ent.id == mnt_id))
+        break;
+    }
+  if (found)
+    {
+      ent = match;
+      if (!strcmp (ent.type, "xfs"))
+        {
+          dev = malloc (strlen (ent.source) + 6);
+          if (dev != NULL)
+            sprintf (dev, "(XFS)%s", ent.source);
+        }
+      else if (!strncmp (ent.type, "nfs", 3)
+               ? (strchr (ent.source, ':') != NULL)
+               : (*ent.source == '/'))
+        dev = strdup (ent.source);
+    }
+  mountinfo_close (mi);
+  return dev;
+}
@@ -0,0 +1,293 @@
+/*
+**  Project id assignment
+**
+**  Gives every file and directory below a directory a project id, and the
+**  directories the inherit flag, so that what is created below them later
+**  gets the id from the kernel. The tree is walked in parallel with the
+**  workers of quota_scan (see scan.c): files are changed as they are
+**  found, a directory only once everything below it is done. A call that
+**  was interrupted can so be repeated, and leaves out the subdirectories
+**  that have the id and the flag already. The directory itself is always
+**  walked, so that setting the id of a top directory by hand first does no
+**  harm.
+**
+**  Only regular files and directories can be opened safely to be changed;
+**  other entries (symbolic links, devices, fifos, sockets) keep the id they
+**  have, as with chattr -R -p and xfs_quota -x -c "project -s".
+**
+**  Run as root on a tree that users can write to, nothing is changed by
+**  path: files are opened in the descriptor of their directory without
+**  following symbolic links, directories are changed through the
+**  descriptor the walk read them with, and either must still be of the
+**  type that was found and on the file system of the top directory.
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Quota.h"
+#include "myconfig.h"
+
+#ifdef MOUNTINFO
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#if defined(MOUNTINFO) && defined(FS_IOC_FSSETXATTR)                         \
+    && defined(FS_XFLAG_PROJINHERIT) && defined(STATX_BASIC_STATS)
+
+#include "include/mountinfo.h"
+#include "include/scan.h"
+
+#define PROJECT_PROGRESS_MS 1000
+
+struct project
+{
+  uint32_t projid;
+  dev_t dev; /* of the top directory */
+  project_ret progress; /* updated atomically by the workers */
+  quota_project_fn fn;
+  void *arg;
+  uint64_t next; /* CLOCK_MONOTONIC ms of the next progress report */
+};
+
+static uint64_t
+project_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/*
+ * give the file fd the project id, and a directory the inherit flag;
+ * returns 1 if it had them already, 0 if it was changed, -1 on error
+ */
+static int
+project_set (int fd, uint32_t projid, int dir)
+{
+  struct fsxattr fsx;
+
+  if (ioctl (fd, FS_IOC_FSGETXATTR, &fsx) != 0)
+    return -1;
+  if ((fsx.fsx_projid == projid)
+      && (!dir || (fsx.fsx_xflags & FS_XFLAG_PROJINHERIT)))
+    return 1;
+  fsx.fsx_projid = projid;
+  if (dir)
+    fsx.fsx_xflags |= FS_XFLAG_PROJINHERIT;
+  return (ioctl (fd, FS_IOC_FSSETXATTR, &fsx) == 0) ? 0 : -1;
+}
+
+static void
+project_count (uint64_t *counter)
+{
+  __atomic_add_fetch (counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * whether fd is of the type in mode and on the file system of the top
+ * directory, not something swapped in since it was looked up
+ */
+static int
+project_same (const struct project *p, int fd, unsigned int mode)
+{
+  struct stat st;
+
+  return (fstat (fd, &st) == 0) && ((st.st_mode & S_IFMT) == (mode & S_IFMT))
+         && (st.st_dev == p->dev);
+}
+
+static int
+project_visit (void *arg, int dirfd, const char *name, unsigned int mode)
+{
+  struct project *p = arg;
+  struct fsxattr fsx;
+  int fd, r;
+
+  if (!S_ISREG (mode) && !S_ISDIR (mode))
+    return 0;
+  fd = openat (dirfd, name,
+               O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+  if ((fd != -1) && !project_same (p, fd, mode))
+    {
+      close (fd);
+      fd = -1;
+    }
+  if (fd == -1)
+    {
+      project_count (&p->progress.errors);
+      return -1;
+    }
+  if (S_ISDIR (mode))
+    {
+      /* directories are changed in project_leave, after their entries */
+      if (ioctl (fd, FS_IOC_FSGETXATTR, &fsx) != 0)
+        r = -1;
+      else
+        r = (fsx.fsx_projid == p->projid)
+            && (fsx.fsx_xflags & FS_XFLAG_PROJINHERIT);
+      close (fd);
+      if (r < 0)
+        project_count (&p->progress.errors);
+      else if (r > 0)
+        project_count (&p->progress.skipped);
+      return r;
+    }
+
+  r = project_set (fd, p->projid, 0);
+  close (fd);
+  if (r < 0)
+    {
+      project_count (&p->progress.errors);
+      return -1;
+    }
+  if (r == 0)
+    project_count (&p->progress.inodes);
+  return 0;
+}
+
+static int
+project_leave (void *arg, int fd)
+{
+  struct project *p = arg;
+  int r = -1;
+
+  if (project_same (p, fd, S_IFDIR))
+    r = project_set (fd, p->projid, 1);
+  if (r < 0)
+    {
+      project_count (&p->progress.errors);
+      return -1;
+    }
+  project_count (&p->progress.dirs);
+  if (r == 0)
+    project_count (&p->progress.inodes);
+  return 0;
+}
+
+static void
+project_report (struct project *p, project_ret *out)
+{
+  out->inodes = __atomic_load_n (&p->progress.inodes, __ATOMIC_RELAXED);
+  out->dirs = __atomic_load_n (&p->progress.dirs, __ATOMIC_RELAXED);
+  out->skipped = __atomic_load_n (&p->progress.skipped, __ATOMIC_RELAXED);
+  out->errors = __atomic_load_n (&p->progress.errors, __ATOMIC_RELAXED);
+}
+
+static void
+project_tick (void *arg)
+{
+  struct project *p = arg;
+  project_ret progress;
+  uint64_t now;
+
+  if (p->fn == NULL)
+    return;
+  now = project_now ();
+  if (now < p->next)
+    return;
+  p->next = now + PROJECT_PROGRESS_MS;
+  project_report (p, &progress);
+  p->fn (&progress, p->arg);
+}
+
+/* set limits as the limits of projid on the file system of path */
+static int
+project_limits (const char *path, uint32_t projid, const query_ret *limits)
+{
+  unsigned int mnt_id = 0;
+  struct statx stx;
+  char *dev;
+  int r;
+
+#ifdef STATX_MNT_ID
+  if (statx (AT_FDCWD, path, 0, STATX_BASIC_STATS | STATX_MNT_ID, &stx) != 0)
+    return -1;
+  if (stx.stx_mask & STATX_MNT_ID)
+    mnt_id = stx.stx_mnt_id;
+#else
+  if (statx (AT_FDCWD, path, 0, STATX_BASIC_STATS, &stx) != 0)
+    return -1;
+#endif
+  dev = mountinfo_quota_dev (MOUNTINFO, stx.stx_dev_major,
+                             stx.stx_dev_minor, mnt_id);
+  if (dev == NULL)
+    {
+      errno = ENODEV;
+      return -1;
+    }
+  r = quota_setqlim (dev, projid, limits->bs, limits->bh, limits->fs,
+                     limits->fh, 0, PHP_QUOTA_TYPE_PROJECT);
+  free (dev);
+  return r;
+}
+
+int
+quota_project_assign (char *path, uint32_t projid, int threads,
+                      query_ret *limits, quota_project_fn fn, void *arg,
+                      project_ret *ret)
+{
+  struct scan_hooks hooks;
+  struct project p;
+  struct stat st;
+  scan_ret walk;
+
+  memset (ret, 0, sizeof (*ret));
+  if (stat (path, &st) != 0)
+    return -1;
+  if (!S_ISDIR (st.st_mode))
+    {
+      errno = ENOTDIR;
+      return -1;
+    }
+
+  memset (&p, 0, sizeof (p));
+  p.projid = projid;
+  p.dev = st.st_dev;
+  p.fn = fn;
+  p.arg = arg;
+  p.next = project_now () + PROJECT_PROGRESS_MS;
+  hooks.visit = project_visit;
+  hooks.leave = project_leave;
+  hooks.tick = project_tick;
+  hooks.arg = &p;
+  if (scan_walk (path, threads, PHP_QUOTA_SCAN_XDEV, &hooks, &walk) != 0)
+    return -1;
+
+  /* entries the walk could not read */
+  p.progress.errors += walk.errors;
+  project_report (&p, ret);
+  if (fn != NULL)
+    fn (ret, arg);
+
+  /* after the walk, so that moving the usage over cannot fail on them */
+  if ((limits != NULL) && (project_limits (path, projid, limits) != 0))
+    return -1;
+  errno = 0;
+  return 0;
+}
+
+#else /* !MOUNTINFO || !FS_IOC_FSSETXATTR || !STATX_BASIC_STATS */
+
+int
+quota_project_assign (char *path, uint32_t projid, int threads,
+                      query_ret *limits, quota_project_fn fn, void *arg,
+                      project_ret *ret)
+{
+  memset (ret, 0, sizeof (*ret));
+  errno = ENOTSUP;
+  return -1;
+}
+
+#endif
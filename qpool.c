@@ -0,0 +1,136 @@
+/*
+**  Internal worker threads
+**
+**  A small pool of threads, started on first use and left to exit after
+**  some idle time, that runs jobs in submission order. Jobs must not wait
+**  for other jobs. Workers block all signals, so that signal handlers of
+**  the application (e.g. PHP's pcntl) keep running in its own threads. If
+**  no worker can be started at all, jobs are run by the submitting thread.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "include/qpool.h"
+
+#define QPOOL_THREADS 8
+#define QPOOL_IDLE 30 /* seconds */
+
+static pthread_mutex_t qpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qpool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t qpool_once = PTHREAD_ONCE_INIT;
+static struct qpool_job *qpool_head, *qpool_tail;
+static int qpool_threads; /* running workers */
+static int qpool_idle;    /* workers waiting for a job */
+static int qpool_queued;  /* jobs not yet taken by a worker */
+
+/*
+ * only the forking thread exists in the child; forget the workers of the
+ * parent and the jobs they would have run
+ */
+static void
+qpool_atfork_child (void)
+{
+  pthread_mutex_init (&qpool_lock, NULL);
+  pthread_cond_init (&qpool_cond, NULL);
+  qpool_head = qpool_tail = NULL;
+  qpool_threads = qpool_idle = qpool_queued = 0;
+}
+
+static void
+qpool_init (void)
+{
+  pthread_atfork (NULL, NULL, qpool_atfork_child);
+}
+
+static void *
+qpool_worker (void *arg)
+{
+  struct qpool_job *job;
+  struct timespec ts;
+
+  pthread_mutex_lock (&qpool_lock);
+  for (;;)
+    {
+      while ((job = qpool_head) == NULL)
+        {
+          clock_gettime (CLOCK_REALTIME, &ts);
+          ts.tv_sec += QPOOL_IDLE;
+          qpool_idle++;
+          if ((pthread_cond_timedwait (&qpool_cond, &qpool_lock, &ts)
+               == ETIMEDOUT)
+              && (qpool_head == NULL))
+            {
+              qpool_idle--;
+              qpool_threads--;
+              pthread_mutex_unlock (&qpool_lock);
+              return NULL;
+            }
+          qpool_idle--;
+        }
+      qpool_head = job->next;
+      if (qpool_head == NULL)
+        qpool_tail = NULL;
+      qpool_queued--;
+      pthread_mutex_unlock (&qpool_lock);
+
+      job->run (job);
+
+      pthread_mutex_lock (&qpool_lock);
+    }
+}
+
+void
+qpool_submit (struct qpool_job *job)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  sigset_t all, old;
+  int saved = errno;
+
+  pthread_once (&qpool_once, qpool_init);
+  job->next = NULL;
+
+  pthread_mutex_lock (&qpool_lock);
+  if (qpool_tail != NULL)
+    qpool_tail->next = job;
+  else
+    qpool_head = job;
+  qpool_tail = job;
+  qpool_queued++;
+
+  if (qpool_idle > 0)
+    pthread_cond_signal (&qpool_cond);
+  if ((qpool_queued > qpool_idle) && (qpool_threads < QPOOL_THREADS))
+    {
+      /* the new thread inherits the signal mask */
+      sigfillset (&all);
+      pthread_sigmask (SIG_SETMASK, &all, &old);
+      pthread_attr_init (&attr);
+      pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+      if (pthread_create (&thread, &attr, qpool_worker, NULL) == 0)
+        qpool_threads++;
+      pthread_attr_destroy (&attr);
+      pthread_sigmask (SIG_SETMASK, &old, NULL);
+    }
+
+  if (qpool_threads == 0)
+    {
+      /* no worker, and none can be started: run the queue right here */
+      while ((job = qpool_head) != NULL)
+        {
+          qpool_head = job->next;
+          if (qpool_head == NULL)
+            qpool_tail = NULL;
+          qpool_queued--;
+          pthread_mutex_unlock (&qpool_lock);
+          job->run (job);
+          pthread_mutex_lock (&qpool_lock);
+        }
+    }
+  pthread_mutex_unlock (&qpool_lock);
+  errno = saved;
+}
@@ -5,6 +5,13 @@ include("def.php");
 enum QuotaType: int {
     case User = 0;
     case Group = 1;
+    case Project = 2;
+}
+
+enum DumpFormat: int {
+    case Csv = 0;
+    case JsonLines = 1;
+    case Binary = 2;
 }
 
 class QueryRet
@@ -55,51 +62,123 @@ class QueryRet
     }
 }
 
+class InfoRet
+{
+    public int $bgrace, $igrace, $flags, $format;
+
+    function __construct(int $bgrace, int $igrace, int $flags, int $format) {
+        $this->bgrace = $bgrace;
+        $this->igrace = $igrace;
+        $this->flags = $flags;
+        $this->format = $format;
+    }
+
+    function getBlockGrace(): int {
+        return $this->bgrace;
+    }
+
+    function getFileGrace(): int {
+        return $this->igrace;
+    }
+}
+
 class GetMntentRet
 {
     public string $dev, $path, $type, $opts;
+    // only known on Linux, 0 elsewhere
+    public int $mntId, $parentId, $devMajor, $devMinor;
 
-    function __construct(string $dev, string $path, string $type, string $opts) {
+    function __construct(string $dev, string $path, string $type, string $opts, int $mntId = 0, int $parentId = 0, int $devMajor = 0, int $devMinor = 0) {
         $this->dev = $dev;
         $this->path = $path;
         $this->type = $type;
         $this->opts = $opts;
+        $this->mntId = $mntId;
+        $this->parentId = $parentId;
+        $this->devMajor = $devMajor;
+        $this->devMinor = $devMinor;
     }
 }
 
 /**
+ * Entries of the mount table, read one at a time: only the current entry
+ * is held, and rewind() reads the table again from the start. With
+ * $snapshot, the table is instead read completely on the first rewind()
+ * and then iterated from memory, so repeated iterations see the same
+ * entries.
+ *
+ * The library keeps one mount table position per process, so only one
+ * streaming iteration can be in progress at a time.
+ *
  * @implements Iterator<int, GetMntentRet>
  */
 class GetMntent implements Iterator
 {
-    private $valid = true;
-    private $position = 0;
-    private $array = array();
     private PHPQuota $phpQuota;
+    private $filter;
+    private bool $snapshot;
+    private bool $open = false;
+    private int $position = 0;
+    private GetMntentRet | null $current = null;
+    /** @var list<GetMntentRet> | null */
+    private $entries = null;
 
-    public function __construct(PHPQuota $phpQuota) {
+    public function __construct(PHPQuota $phpQuota, array | null $filter = null, bool $snapshot = false) {
         $this->phpQuota = $phpQuota;
-        $this->position = 0;
-
-        $phpQuota->setmntentRaw();
-        $this->next();
+        $this->filter = $filter;
+        $this->snapshot = $snapshot;
     }
 
     /**
      * @return void
      */
     public function __destruct() {
-        $this->phpQuota->endmntentRaw();
+        $this->close();
+    }
+
+    private function close(): void {
+        if ($this->open) {
+            $this->open = false;
+            $this->phpQuota->endmntentRaw();
+        }
+    }
+
+    private function fetch(): void {
+        if ($this->snapshot) {
+            $this->current = $this->entries[$this->position] ?? null;
+            return;
+        }
+
+        $this->current = $this->phpQuota->getmntentRaw();
+        if (is_null($this->current)) {
+            // done; don't hold the table until the iterator is destroyed
+            $this->close();
+        }
     }
 
     public function rewind(): void {
-        if ($this->position > 0) {
-            $this->position--;
+        $this->close();
+        if (!$this->snapshot || is_null($this->entries)) {
+            $this->phpQuota->setmntentRaw($this->filter);
+            $this->open = true;
         }
+        if ($this->snapshot && is_null($this->entries)) {
+            $this->entries = array();
+            while (!is_null($ent = $this->phpQuota->getmntentRaw())) {
+                $this->entries[] = $ent;
+            }
+            $this->close();
+        }
+
+        $this->position = 0;
+        $this->fetch();
     }
 
-    public function current(): GetMntentRet {
-        return $this->array[$this->position];
+    /**
+     * null before the first rewind() (foreach does it) and after the end.
+     */
+    public function current(): GetMntentRet | null {
+        return $this->current;
     }
 
     public function key(): int {
@@ -107,36 +186,566 @@ class GetMntent implements Iterator
     }
 
     public function next(): void {
-        if (!$this->valid) {
+        if (is_null($this->current)) {
             return;
         }
+        $this->position++;
+        $this->fetch();
+    }
+
+    public function valid(): bool {
+        return !is_null($this->current);
+    }
+}
+
+/**
+ * Read-only view of a snapshot file written by PHPQuota::snapshotWrite().
+ * The file is memory-mapped, so opening it does not read the table.
+ */
+class QuotaSnapshot implements Countable
+{
+    private $ffi;
+    private $snap;
+
+    public function __construct($ffi, FFI\CData $snap) {
+        $this->ffi = $ffi;
+        $this->snap = $snap;
+    }
+
+    public function __destruct() {
+        $this->ffi->quota_snapshot_close($this->snap);
+    }
+
+    public function count(): int {
+        return $this->ffi->quota_snapshot_count($this->snap);
+    }
+
+    public function lookup(int $id): QueryRet | null {
+        $queryRet = $this->ffi->new("query_ret");
+        if ($this->ffi->quota_snapshot_lookup($this->snap, $id, FFI::addr($queryRet)) != 0) {
+            return null;
+        }
+
+        return new QueryRet(
+            $queryRet->bc,
+            $queryRet->bs,
+            $queryRet->bh,
+            $queryRet->bt,
+            $queryRet->fc,
+            $queryRet->fs,
+            $queryRet->fh,
+            $queryRet->ft,
+        );
+    }
+
+    public function getHandle(): FFI\CData {
+        return $this->snap;
+    }
+}
+
+/**
+ * Usage history file opened with PHPQuota::historyOpen(). sample() is meant
+ * to be called periodically, e.g. from cron; forecast() then projects when
+ * each id runs into its limits.
+ */
+class QuotaHistory
+{
+    private PHPQuota $phpQuota;
+    private $ffi;
+    private $history;
+
+    public function __construct(PHPQuota $phpQuota, $ffi, FFI\CData $history) {
+        $this->phpQuota = $phpQuota;
+        $this->ffi = $ffi;
+        $this->history = $history;
+    }
+
+    public function __destruct() {
+        $this->ffi->quota_history_close($this->history);
+    }
+
+    /**
+     * Append the current usage of every id on a device.
+     *
+     * @return int number of ids sampled
+     */
+    public function sample(string $dev, QuotaType $kind = QuotaType::User): int {
+        $ret = $this->ffi->quota_history_sample($this->history, PHPQuota::phpStringToFFI($dev), $kind->value);
+        $this->phpQuota->checkError();
+
+        return $ret;
+    }
+
+    public function append(int $id, QueryRet $queryRet, int | null $when = null): void {
+        $q = $this->ffi->new("query_ret");
+        foreach (array_keys(PHPQuota::FIELDS) as $name) {
+            $q->$name = $queryRet->$name;
+        }
+        $this->ffi->quota_history_append($this->history, $id, $when ?? time(), FFI::addr($q));
+        $this->phpQuota->checkError();
+    }
+
+    /**
+     * @return array<int, array<string, int>> oldest first, each with the
+     * keys when, bc and fc
+     */
+    public function samples(int $id, int $max = 1024): array {
+        $out = $this->ffi->new("history_sample[" . max($max, 1) . "]");
+        $n = $this->ffi->quota_history_samples($this->history, $id, $out, $max);
+
+        $ret = array();
+        for ($i = 0; $i < $n; $i++) {
+            $ret[] = array("when" => $out[$i]->when, "bc" => $out[$i]->bc, "fc" => $out[$i]->fc);
+        }
+        return $ret;
+    }
+
+    /**
+     * Usage trend of an id: the keys samples, when, bc, fc, brate and frate
+     * (growth per second), and bs_eta, bh_eta, fs_eta and fh_eta (timestamp
+     * at which the limit is reached, 0 if it already is, null if never).
+     * Returns null if the id has no samples.
+     *
+     * @return array<string, int | float | null> | null
+     */
+    public function forecast(int $id): array | null {
+        $f = $this->ffi->new("forecast_ret");
+        if ($this->ffi->quota_history_forecast($this->history, $id, FFI::addr($f)) != 0) {
+            return null;
+        }
+
+        $eta = function (int $t): int | null {
+            return ($t < 0) ? null : $t;
+        };
+        return array(
+            "samples" => $f->samples,
+            "when" => $f->when,
+            "bc" => $f->bc,
+            "fc" => $f->fc,
+            "brate" => $f->brate,
+            "frate" => $f->frate,
+            "bs_eta" => $eta($f->bs_eta),
+            "bh_eta" => $eta($f->bh_eta),
+            "fs_eta" => $eta($f->fs_eta),
+            "fh_eta" => $eta($f->fh_eta),
+        );
+    }
+}
+
+/**
+ * Reservation ledger opened with PHPQuota::ledgerOpen(). Workers that admit
+ * writes for the same ids open the same file, so that their reservations
+ * add up across processes: reserve() before writing, commit() what was
+ * written and release() the rest.
+ */
+class QuotaLedger
+{
+    private PHPQuota $phpQuota;
+    private $ffi;
+    private $ledger;
+
+    public function __construct(PHPQuota $phpQuota, $ffi, FFI\CData $ledger) {
+        $this->phpQuota = $phpQuota;
+        $this->ffi = $ffi;
+        $this->ledger = $ledger;
+    }
+
+    public function __destruct() {
+        $this->ffi->quota_ledger_close($this->ledger);
+    }
+
+    private function call(string $fn, string $dev, int | null $id, int $bytes, int $inodes, QuotaType $kind): int {
+        $ret = $this->ffi->$fn($this->ledger, PHPQuota::phpStringToFFI($dev), $id ?? posix_getuid(), $kind->value, $bytes, $inodes);
+        if ($ret < 0) {
+            $this->phpQuota->checkError();
+            throw new Exception("Ledger call failed");
+        }
+        return $ret;
+    }
+
+    /**
+     * @return bool false if the quota of the id leaves no room for the
+     * request
+     */
+    public function reserve(string $dev, int | null $id, int $bytes, int $inodes = 0, QuotaType $kind = QuotaType::User): bool {
+        return $this->call("quota_reserve", $dev, $id, $bytes, $inodes, $kind) == 0;
+    }
+
+    public function commit(string $dev, int | null $id, int $bytes, int $inodes = 0, QuotaType $kind = QuotaType::User): void {
+        $this->call("quota_commit", $dev, $id, $bytes, $inodes, $kind);
+    }
+
+    public function release(string $dev, int | null $id, int $bytes, int $inodes = 0, QuotaType $kind = QuotaType::User): void {
+        $this->call("quota_release", $dev, $id, $bytes, $inodes, $kind);
+    }
+}
+
+class QuotaTracker
+{
+    private PHPQuota $phpQuota;
+    private $ffi;
+    private $tracker;
+    private $state;
+
+    public function __construct(PHPQuota $phpQuota, $ffi, FFI\CData $tracker, string $state) {
+        $this->phpQuota = $phpQuota;
+        $this->ffi = $ffi;
+        $this->tracker = $tracker;
+        $this->state = $state;
+    }
+
+    public function __destruct() {
+        $this->ffi->quota_tracker_close($this->tracker);
+    }
+
+    /**
+     * The device to pass to query() and enumerate() for the totals.
+     */
+    public function dev(): string {
+        return "(TRACK)" . $this->state;
+    }
+
+    /**
+     * File descriptor that is readable when there are events, for an
+     * event loop.
+     */
+    public function fd(): int {
+        return $this->ffi->quota_tracker_fd($this->tracker);
+    }
+
+    /**
+     * Wait up to $timeout milliseconds (-1: until there is one) for events
+     * and apply them.
+     *
+     * @return int the number of directories read again
+     */
+    public function run(int $timeout = -1): int {
+        $ret = $this->ffi->quota_tracker_run($this->tracker, $timeout);
+        if ($ret < 0) {
+            $this->phpQuota->checkError();
+            throw new Exception("Tracker run failed");
+        }
+        return $ret;
+    }
+
+    /**
+     * Save the directory records, so that a restart needs no full walk.
+     */
+    public function save(): void {
+        if ($this->ffi->quota_tracker_save($this->tracker) != 0) {
+            $this->phpQuota->checkError();
+            throw new Exception("Cannot save tracker state");
+        }
+    }
+}
+
+/**
+ * Non-blocking queries for event loops. Requests run on worker threads of
+ * the library and are identified by the tag the submitting method returns.
+ *
+ * Inside a Fiber, await() suspends the fiber until its request is done;
+ * the event loop is expected to resume it once stream() is readable, e.g.
+ * with Revolt: EventLoop::onReadable($async->stream(), fn() => $fiber->resume()).
+ * Outside of a Fiber, await() blocks.
+ */
+class QuotaAsync
+{
+    private PHPQuota $phpQuota;
+    private $ffi;
+    private $async;
+    private $stream = null;
+    private int $nextTag = 1;
+    /** @var array<int, QueryRet | Exception | null> */
+    private array $results = array();
+
+    public function __construct(PHPQuota $phpQuota, $ffi, FFI\CData $async) {
+        $this->phpQuota = $phpQuota;
+        $this->ffi = $ffi;
+        $this->async = $async;
+    }
+
+    public function __destruct() {
+        if (!is_null($this->stream)) {
+            fclose($this->stream);
+        }
+        $this->ffi->quota_async_close($this->async);
+    }
+
+    /**
+     * Readable while completed requests wait for poll().
+     *
+     * @return resource
+     */
+    public function stream() {
+        if (is_null($this->stream)) {
+            $this->stream = fopen("php://fd/" . $this->ffi->quota_async_fd($this->async), "r");
+        }
+        return $this->stream;
+    }
+
+    private function submit(int $op, string $dev, string | null $path, int $id, QuotaType $kind, array $limits = array(0, 0, 0, 0), int $timelimflag = 0): int {
+        $req = $this->ffi->new("quota_request");
+        // quota_submit copies the strings, they only need to live until then
+        $cdev = PHPQuota::phpStringToFFI($dev);
+        $req->dev = $this->ffi->cast("char *", FFI::addr($cdev));
+        if (!is_null($path)) {
+            $cpath = PHPQuota::phpStringToFFI($path);
+            $req->path = $this->ffi->cast("char *", FFI::addr($cpath));
+        }
+        $req->tag = $this->nextTag++;
+        $req->op = $op;
+        $req->kind = $kind->value;
+        $req->id = $id;
+        $req->bs = $limits[0];
+        $req->bh = $limits[1];
+        $req->fs = $limits[2];
+        $req->fh = $limits[3];
+        $req->timelimflag = $timelimflag;
+
+        if ($this->ffi->quota_submit($this->async, FFI::addr($req)) != 0) {
+            $this->phpQuota->checkError();
+            throw new Exception("Cannot submit request");
+        }
+        return $req->tag;
+    }
+
+    public function query(string $dev, int | null $uid = null, QuotaType $kind = QuotaType::User): int {
+        return $this->submit($this->ffi->PHP_QUOTA_ASYNC_QUERY, $dev, null, $uid ?? posix_getuid(), $kind);
+    }
+
+    public function setqlim(string $dev, int | null $uid, float $bs, float $bh, float $fs, float $fh, int $timelimflag = 0, QuotaType $kind = QuotaType::User): int {
+        return $this->submit($this->ffi->PHP_QUOTA_ASYNC_SETQLIM, $dev, null, $uid ?? posix_getuid(), $kind, array($bs, $bh, $fs, $fh), $timelimflag);
+    }
+
+    public function rpcquery(string $host, string $path, int | null $uid = null, QuotaType $kind = QuotaType::User): int {
+        return $this->submit($this->ffi->PHP_QUOTA_ASYNC_RPCQUERY, $host, $path, $uid ?? posix_getuid(), $kind);
+    }
+
+    /**
+     * Collect the requests that are done, without waiting.
+     *
+     * @return int number of requests collected
+     */
+    public function poll(): int {
+        $out = $this->ffi->new("quota_completion[64]");
+        $total = 0;
+        do {
+            $n = $this->ffi->quota_reap($this->async, $out, 64, 0);
+            for ($i = 0; $i < $n; $i++) {
+                $c = $out[$i];
+                if (!is_null($c->msg)) {
+                    $this->results[$c->tag] = new Exception(FFI::string($c->msg), $c->err);
+                } elseif ($c->op == $this->ffi->PHP_QUOTA_ASYNC_SETQLIM) {
+                    $this->results[$c->tag] = null;
+                } else {
+                    $this->results[$c->tag] = new QueryRet($c->q->bc, $c->q->bs, $c->q->bh, $c->q->bt, $c->q->fc, $c->q->fs, $c->q->fh, $c->q->ft);
+                }
+            }
+            $total += $n;
+        } while ($n == 64);
+        return $total;
+    }
+
+    public function ready(int $tag): bool {
+        return array_key_exists($tag, $this->results);
+    }
+
+    /**
+     * Result of a collected request: a QueryRet for queries, null for
+     * setqlim. Throws if the request failed.
+     */
+    public function result(int $tag): QueryRet | null {
+        if (!$this->ready($tag)) {
+            throw new Exception("Request " . $tag . " is not done");
+        }
+        $ret = $this->results[$tag];
+        unset($this->results[$tag]);
+        if ($ret instanceof Exception) {
+            throw $ret;
+        }
+        return $ret;
+    }
 
-        if ($this->position < count($this->array) - 1) {
-            $this->position++;
+    public function await(int $tag): QueryRet | null {
+        $this->poll();
+        while (!$this->ready($tag)) {
+            if (!is_null(Fiber::getCurrent())) {
+                Fiber::suspend();
+            } else {
+                $read = array($this->stream());
+                $write = $except = null;
+                stream_select($read, $write, $except, null);
+            }
+            $this->poll();
+        }
+        return $this->result($tag);
+    }
+}
+
+class QuotaExceededException extends Exception
+{
+    public string $limit;
+
+    function __construct(string $message, string $limit) {
+        parent::__construct($message);
+        $this->limit = $limit;
+    }
+}
+
+/**
+ * Write filter that stops an upload as soon as it would not fit into the
+ * headroom of its uid (see PHPQuota::headroom()), instead of failing with
+ * EDQUOT after the fact. Attach it with PHPQuota::guardUpload().
+ *
+ * The headroom is looked up at the start and then whenever the upload has
+ * used up its reservation, at most every $interval bytes; lookups are
+ * cached for $ttl seconds per uid, gid and directory, as the group and the
+ * project id of the directory may limit as well. Uploads in this process
+ * reserve $interval bytes at a time, and the reservations of the other
+ * uploads of the uid and gid to the directory are subtracted from the
+ * headroom, so that parallel uploads do not each count on the whole of it.
+ * What finished uploads wrote is counted until the next lookup sees it.
+ */
+class QuotaUploadFilter extends php_user_filter
+{
+    const NAME = "quota.headroom";
+
+    /** @var array<string, array<int, array{claimed: int, written: int, closed: bool}>> */
+    private static array $uploads = array();
+    /** @var array<string, array{time: float, bytes: int|null, by: string, base: array<int, int>}> */
+    private static array $lookups = array();
+    private static int $nextId = 1;
+
+    private int $id;
+    private string $key;
+    private int $written = 0;
+
+    public static function register(): void {
+        if (!in_array(self::NAME, stream_get_filters())) {
+            stream_filter_register(self::NAME, self::class);
+        }
+    }
+
+    public function onCreate(): bool {
+        $dir = file_exists($this->params["path"]) ? $this->params["path"] : dirname($this->params["path"]);
+        $dir = realpath($dir);
+        if ($dir === false) {
+            return false;
+        }
+        $this->params["dir"] = $dir;
+        $this->key = $this->params["uid"] . ":" . $this->params["gid"] . ":" . $dir;
+        $this->id = self::$nextId++;
+        self::$uploads[$this->key][$this->id] = array("claimed" => 0, "written" => 0, "closed" => false);
+
+        try {
+            $this->reserve(max($this->params["expected"] ?? 0, 1));
+        } catch (QuotaExceededException $e) {
+            $this->onClose();
+            throw $e;
+        }
+        return true;
+    }
+
+    public function onClose(): void {
+        $lookup = self::$lookups[$this->key] ?? null;
+        if (is_null($lookup) || microtime(true) - $lookup["time"] > $this->params["ttl"]) {
+            // the next reserve() looks up anew, which sees what it wrote
+            unset(self::$uploads[$this->key][$this->id]);
+            if (empty(self::$uploads[$this->key])) {
+                unset(self::$uploads[$this->key], self::$lookups[$this->key]);
+            }
             return;
         }
+        // what it wrote since the cached lookup takes room until the next
+        // lookup, which drops it
+        self::$uploads[$this->key][$this->id]["claimed"] = $this->written;
+        self::$uploads[$this->key][$this->id]["closed"] = true;
+    }
 
-        $ret = $this->phpQuota->getmntentRaw();
-        if ($ret == null) {
-            $this->valid = false;
-        } else {
-            array_push($this->array, $ret);
-            $this->position++;
+    private function lookup(): array {
+        $h = $this->params["quota"]->headroom($this->params["dir"], $this->params["uid"], $this->params["gid"]);
+        // what the uploads have written so far is part of the new value
+        $base = array();
+        foreach (self::$uploads[$this->key] as $id => $upload) {
+            if ($upload["closed"]) {
+                unset(self::$uploads[$this->key][$id]);
+            } else {
+                $base[$id] = $upload["written"];
+            }
         }
+        self::$lookups[$this->key] = array("time" => microtime(true), "bytes" => $h["bytes"], "by" => $h["bytes_by"], "base" => $base);
+        return self::$lookups[$this->key];
     }
 
-    public function valid(): bool {
-        return $this->valid;
+    /**
+     * Bytes the uploads of the key will have added since $lookup, if this
+     * one claims $claim in all.
+     */
+    private function used(array $lookup, int $claim): int {
+        $used = 0;
+        foreach (self::$uploads[$this->key] as $id => $upload) {
+            $claimed = ($id == $this->id) ? $claim : $upload["claimed"];
+            $used += $claimed - ($lookup["base"][$id] ?? 0);
+        }
+        return $used;
+    }
+
+    /**
+     * Claim room for $bytes more, or throw.
+     */
+    private function reserve(int $bytes): void {
+        $interval = $this->params["interval"];
+        // whole intervals, so that the headroom is checked every $interval
+        $claim = intdiv($this->written + $bytes + $interval - 1, $interval) * $interval;
+
+        $lookup = self::$lookups[$this->key] ?? null;
+        $fresh = is_null($lookup) || microtime(true) - $lookup["time"] > $this->params["ttl"];
+        if ($fresh) {
+            $lookup = $this->lookup();
+        }
+        if (!is_null($lookup["bytes"]) && $this->used($lookup, $claim) > $lookup["bytes"] && !$fresh) {
+            // the cached value may be too pessimistic, e.g. after deletions
+            $lookup = $this->lookup();
+        }
+
+        $used = $this->used($lookup, $claim);
+        if (!is_null($lookup["bytes"]) && $used > $lookup["bytes"]) {
+            $own = $claim - ($lookup["base"][$this->id] ?? 0);
+            throw new QuotaExceededException(
+                "Upload exceeds the " . $lookup["by"] . " limit: " . $lookup["bytes"] . " bytes left, of which "
+                    . ($used - $own) . " are reserved by other uploads",
+                $lookup["by"]
+            );
+        }
+        self::$uploads[$this->key][$this->id]["claimed"] = $claim;
+    }
+
+    public function filter($in, $out, &$consumed, bool $closing): int {
+        while ($bucket = stream_bucket_make_writeable($in)) {
+            $len = strlen($bucket->data);
+            if ($this->written + $len > self::$uploads[$this->key][$this->id]["claimed"]) {
+                $this->reserve($len);
+            }
+            $this->written += $len;
+            self::$uploads[$this->key][$this->id]["written"] = $this->written;
+            $consumed += $len;
+            stream_bucket_append($out, $bucket);
+        }
+        return PSFS_PASS_ON;
     }
 }
 
 class PHPQuota
 {
     protected $ffi;
+    private $client = null;
 
     const RPC_DEFAULT_TIMEOUT = 4000;
 
-    static private function phpStringToFFI(string $s): FFI\CData {
+    /**
+     * @internal for the classes of this file
+     */
+    static public function phpStringToFFI(string $s): FFI\CData {
         $csize = strlen($s) + 1;
         $d = FFI::new("char[" . $csize . "]");
         FFI::memset($d, 0, $csize);
@@ -144,24 +753,64 @@ class PHPQuota
         return $d;
     }
 
-    private function checkError(): void {
+    /**
+     * @internal for the classes of this file
+     */
+    public function checkError(): void {
         $maybeErr = $this->ffi->quota_strerr();
         if (!empty($maybeErr) && $maybeErr != "Success") {
             throw new Exception($maybeErr);
         }
     }
 
-    function __construct(string $library_dir = __DIR__ . "/libquota.so")
+    /**
+     * With $cache_socket set, query() is answered by the quota-cached daemon
+     * listening there instead of calling into the kernel or NFS server, and
+     * the setqlim*() methods drop the daemon's cached entry of the id.
+     */
+    function __construct(string $library_dir = __DIR__ . "/libquota.so", string | null $cache_socket = null, int $cache_timeout = 5000)
     {
         $this->ffi = FFI::cdef(PHP_QUOTA_DEF, $library_dir);
+        if (!is_null($cache_socket)) {
+            $this->client = $this->ffi->quota_client_open(PHPQuota::phpStringToFFI($cache_socket), $cache_timeout);
+            if (is_null($this->client)) {
+                $this->checkError();
+                throw new Exception("Cannot connect to quota-cached");
+            }
+        }
+    }
+
+    function __destruct()
+    {
+        if (!is_null($this->client)) {
+            $this->ffi->quota_client_close($this->client);
+        }
+        // the closure goes away with this object
+        if (!is_null($this->traceFn)) {
+            $this->ffi->quota_trace_set(null, null);
+        }
     }
 
-    function query(string $dev, int | null $uid = null, QuotaType $kind = QuotaType::User): QueryRet
+    private function invalidate(FFI\CData $dev, int $uid, QuotaType $kind): void
+    {
+        if (!is_null($this->client)) {
+            $this->ffi->quota_client_invalidate($this->client, $dev, $uid, $kind->value);
+        }
+    }
+
+    /**
+     * @param bool $fresh in client mode, bypass the daemon's cache
+     */
+    function query(string $dev, int | null $uid = null, QuotaType $kind = QuotaType::User, bool $fresh = false): QueryRet
     {
         $uid = $uid ?? posix_getuid();
 
         $dev = PHPQuota::phpStringToFFI($dev);
-        $queryRet = $this->ffi->quota_query($dev, $uid, $kind->value);
+        if (!is_null($this->client)) {
+            $queryRet = $this->ffi->quota_client_query($this->client, $dev, $uid, $kind->value, $fresh ? 1 : 0);
+        } else {
+            $queryRet = $this->ffi->quota_query($dev, $uid, $kind->value);
+        }
         $this->checkError();
 
         return new QueryRet(
@@ -176,6 +825,88 @@ class PHPQuota
         );
     }
 
+    /**
+     * Query one id on every mounted file system with quotas at once; the
+     * devices are queried in parallel, so slow NFS servers do not add up.
+     *
+     * Returns "total" (a QueryRet summing usage and limits, space in 1 KiB
+     * blocks also where XFS devices report 512-byte ones, with the earliest
+     * grace expiry) and "mounts", one array per device with
+     * "dev", "path", "query" (a QueryRet, null if the query failed) and
+     * "error" (the reason it failed, null otherwise).
+     *
+     * @return array{total: QueryRet, mounts: list<array{dev: string, path: string, query: QueryRet|null, error: string|null}>}
+     */
+    function queryAllMounts(int | null $uid = null, QuotaType $kind = QuotaType::User): array
+    {
+        $uid = $uid ?? posix_getuid();
+
+        $total = $this->ffi->new("query_ret");
+        for ($size = 64; ; $size = $n) {
+            $out = $this->ffi->new("mount_query_ret[" . $size . "]");
+            $n = $this->ffi->quota_query_all_mounts($uid, $kind->value, $out, $size, FFI::addr($total));
+            // otherwise there are more mounts than fit into $out, and
+            // nothing was queried yet
+            if ($n <= $size) {
+                break;
+            }
+        }
+        $this->checkError();
+
+        $mounts = array();
+        for ($i = 0; $i < $n; $i++) {
+            $ent = $out[$i];
+            $mounts[] = array(
+                "dev" => FFI::string($ent->dev),
+                "path" => FFI::string($ent->path),
+                "query" => is_null($ent->msg) ? new QueryRet($ent->q->bc, $ent->q->bs, $ent->q->bh, $ent->q->bt, $ent->q->fc, $ent->q->fs, $ent->q->fh, $ent->q->ft) : null,
+                "error" => is_null($ent->msg) ? null : FFI::string($ent->msg),
+            );
+        }
+        $this->ffi->quota_query_all_free($out, $n);
+
+        return array(
+            "total" => new QueryRet($total->bc, $total->bs, $total->bh, $total->bt, $total->fc, $total->fs, $total->fh, $total->ft),
+            "mounts" => $mounts,
+        );
+    }
+
+    /**
+     * Iterate over all quota entries of a device, in ascending id order.
+     *
+     * @return Generator<int, QueryRet>
+     */
+    function enumerate(string $dev, QuotaType $kind = QuotaType::User): Generator
+    {
+        $cDev = PHPQuota::phpStringToFFI($dev);
+        $id = FFI::new("unsigned int");
+        $queryRet = $this->ffi->new("query_ret");
+
+        while (true) {
+            $ret = $this->ffi->quota_query_next($cDev, FFI::addr($id), $kind->value, FFI::addr($queryRet));
+            $this->checkError();
+            if ($ret != 0) {
+                return;
+            }
+
+            yield $id->cdata => new QueryRet(
+                $queryRet->bc,
+                $queryRet->bs,
+                $queryRet->bh,
+                $queryRet->bt,
+                $queryRet->fc,
+                $queryRet->fs,
+                $queryRet->fh,
+                $queryRet->ft,
+            );
+
+            if ($id->cdata == 0xFFFFFFFF) {
+                return;
+            }
+            $id->cdata++;
+        }
+    }
+
     function setqlim(string $dev, int | null $uid, float $bs, float $bh, float $fs, float $fh, int $timelimflag = 0, QuotaType $kind = QuotaType::User): int
     {
         $uid = $uid ?? posix_getuid();
@@ -183,10 +914,91 @@ class PHPQuota
         $dev = PHPQuota::phpStringToFFI($dev);
         $ret = $this->ffi->quota_setqlim($dev, $uid, $bs, $bh, $fs, $fh, $timelimflag, $kind->value);
         $this->checkError();
+        $this->invalidate($dev, $uid, $kind);
         
         return $ret;
     }
 
+    /**
+     * Apply limits for many ids on one device with a single library call.
+     *
+     * Each entry is an array with the keys uid, bs, bh, fs, fh and optionally
+     * timelimflag; an entry without one of the others throws before anything
+     * is applied. A failing entry does not abort the batch.
+     *
+     * @param array<int, array<string, int|float>> $entries
+     * @return array<int, int> errno per entry, 0 on success
+     */
+    function setqlimMany(string $dev, array $entries, QuotaType $kind = QuotaType::User): array
+    {
+        $n = count($entries);
+        if ($n == 0) {
+            return array();
+        }
+
+        $cEntries = $this->ffi->new("setqlim_entry[" . $n . "]");
+        $cStatus = FFI::new("int[" . $n . "]");
+        $i = 0;
+        foreach ($entries as $key => $entry) {
+            // a missing key must not fall back to the own uid or a 0 limit
+            foreach (array("uid", "bs", "bh", "fs", "fh") as $name) {
+                if (!array_key_exists($name, $entry)) {
+                    throw new Exception("Missing " . $name . " in entry " . $key);
+                }
+                $cEntries[$i]->$name = $entry[$name];
+            }
+            $cEntries[$i]->timelimflag = $entry["timelimflag"] ?? 0;
+            $i++;
+        }
+
+        $dev = PHPQuota::phpStringToFFI($dev);
+        $this->ffi->quota_setqlim_many($dev, $cEntries, $n, $kind->value, $cStatus);
+        $this->checkError();
+        $this->invalidate($dev, -1, $kind);
+
+        $ret = array();
+        for ($i = 0; $i < $n; $i++) {
+            $ret[] = $cStatus[$i];
+        }
+        return $ret;
+    }
+
+    const FIELDS = array(
+        "bc" => 1, "bs" => 2, "bh" => 4, "bt" => 8,
+        "fc" => 16, "fs" => 32, "fh" => 64, "ft" => 128,
+    );
+
+    /**
+     * Change only the given fields of a quota entry in one call.
+     *
+     * $fields maps QueryRet member names (bc, bs, bh, bt, fc, fs, fh, ft) to
+     * their new value, in the units query() returns (512-byte blocks on
+     * "(XFS)" devices); all other fields are left untouched.
+     *
+     * @param array<string, int> $fields
+     */
+    function setqlimFields(string $dev, int | null $uid, array $fields, QuotaType $kind = QuotaType::User): int
+    {
+        $uid = $uid ?? posix_getuid();
+
+        $vals = $this->ffi->new("query_ret");
+        $mask = 0;
+        foreach ($fields as $name => $value) {
+            if (!isset(self::FIELDS[$name])) {
+                throw new Exception("Unknown quota field " . $name);
+            }
+            $vals->$name = $value;
+            $mask |= self::FIELDS[$name];
+        }
+
+        $dev = PHPQuota::phpStringToFFI($dev);
+        $ret = $this->ffi->quota_setqlim_fields($dev, $uid, FFI::addr($vals), $mask, $kind->value);
+        $this->checkError();
+        $this->invalidate($dev, $uid, $kind);
+
+        return $ret;
+    }
+
     function sync(string $dev = ""): int
     {
         $dev = PHPQuota::phpStringToFFI($dev);
@@ -196,6 +1008,507 @@ class PHPQuota
         return $ret;
     }
 
+    /**
+     * Whether quotas of the given kind are turned on for a device, or null
+     * if that can only be told by running a query.
+     */
+    function enabled(string $dev, QuotaType $kind = QuotaType::User): bool | null
+    {
+        $dev = PHPQuota::phpStringToFFI($dev);
+        $ret = $this->ffi->quota_enabled($dev, $kind->value);
+        $this->checkError();
+
+        return ($ret < 0) ? null : ($ret == 1);
+    }
+
+    function getinfo(string $dev, QuotaType $kind = QuotaType::User): InfoRet
+    {
+        $info = $this->ffi->new("info_ret");
+
+        $dev = PHPQuota::phpStringToFFI($dev);
+        $this->ffi->quota_getinfo($dev, $kind->value, FFI::addr($info));
+        $this->checkError();
+
+        return new InfoRet($info->bgrace, $info->igrace, $info->flags, $info->format);
+    }
+
+    /**
+     * Change the grace times (in seconds) and/or flags of a filesystem.
+     * Arguments left null are not modified.
+     */
+    function setinfo(string $dev, QuotaType $kind = QuotaType::User, int | null $bgrace = null, int | null $igrace = null, int | null $flags = null): int
+    {
+        $info = $this->ffi->new("info_ret");
+        $mask = 0;
+        if (!is_null($bgrace)) {
+            $info->bgrace = $bgrace;
+            $mask |= 1;
+        }
+        if (!is_null($igrace)) {
+            $info->igrace = $igrace;
+            $mask |= 2;
+        }
+        if (!is_null($flags)) {
+            $info->flags = $flags;
+            $mask |= 4;
+        }
+
+        $dev = PHPQuota::phpStringToFFI($dev);
+        $ret = $this->ffi->quota_setinfo($dev, $kind->value, FFI::addr($info), $mask);
+        $this->checkError();
+
+        return $ret;
+    }
+
+    /**
+     * Stream every quota entry of a device to a file descriptor
+     * (e.g. 1 for stdout) without building PHP objects.
+     *
+     * @return int number of entries written
+     */
+    function dump(string $dev, int $fd, DumpFormat $format = DumpFormat::Csv, QuotaType $kind = QuotaType::User): int
+    {
+        $dev = PHPQuota::phpStringToFFI($dev);
+        $ret = $this->ffi->quota_dump($dev, $kind->value, $fd, $format->value);
+        $this->checkError();
+
+        return $ret;
+    }
+
+    /**
+     * Write all quota entries of a device to a columnar snapshot file.
+     *
+     * @return int number of entries written
+     */
+    function snapshotWrite(string $dev, string $path, QuotaType $kind = QuotaType::User): int
+    {
+        $dev = PHPQuota::phpStringToFFI($dev);
+        $path = PHPQuota::phpStringToFFI($path);
+        $ret = $this->ffi->quota_snapshot_write($dev, $kind->value, $path);
+        $this->checkError();
+
+        return $ret;
+    }
+
+    function snapshotOpen(string $path): QuotaSnapshot
+    {
+        $path = PHPQuota::phpStringToFFI($path);
+        $snap = $this->ffi->quota_snapshot_open($path);
+        if (is_null($snap)) {
+            $this->checkError();
+            throw new Exception("Cannot open snapshot");
+        }
+
+        return new QuotaSnapshot($this->ffi, $snap);
+    }
+
+    /**
+     * Build an in-memory snapshot from scan results, e.g. from enumerate().
+     *
+     * @param array<int, QueryRet> $rows id => QueryRet
+     */
+    function snapshotFromRows(array $rows): QuotaSnapshot
+    {
+        $n = count($rows);
+        $ids = FFI::new("unsigned int[" . max($n, 1) . "]");
+        $cRows = $this->ffi->new("query_ret[" . max($n, 1) . "]");
+        $i = 0;
+        foreach ($rows as $id => $row) {
+            $ids[$i] = $id;
+            foreach (array_keys(self::FIELDS) as $name) {
+                $cRows[$i]->$name = $row->$name;
+            }
+            $i++;
+        }
+
+        $snap = $this->ffi->quota_snapshot_from_rows($ids, $cRows, $n);
+        if (is_null($snap)) {
+            $this->checkError();
+            throw new Exception("Cannot build snapshot");
+        }
+
+        return new QuotaSnapshot($this->ffi, $snap);
+    }
+
+    /**
+     * Compare two scans. Each change is an array with the keys id, change
+     * (1 added, 2 removed, 3 changed), fields (bitmask as in FIELDS), old
+     * and new (QueryRet, or null for added/removed ids).
+     *
+     * @return array<int, array<string, mixed>>
+     */
+    function diff(QuotaSnapshot $a, QuotaSnapshot $b): array
+    {
+        $entries = $this->ffi->new("diff_entry*");
+        $n = $this->ffi->quota_diff($a->getHandle(), $b->getHandle(), FFI::addr($entries));
+        if ($n < 0) {
+            $this->checkError();
+            throw new Exception("Cannot compute diff");
+        }
+
+        $toQueryRet = function ($q): QueryRet {
+            return new QueryRet($q->bc, $q->bs, $q->bh, $q->bt, $q->fc, $q->fs, $q->fh, $q->ft);
+        };
+
+        $ret = array();
+        for ($i = 0; $i < $n; $i++) {
+            $ent = $entries[$i];
+            $ret[] = array(
+                "id" => $ent->id,
+                "change" => $ent->change,
+                "fields" => $ent->fields,
+                "old" => ($ent->change == 1) ? null : $toQueryRet($ent->old_q),
+                "new" => ($ent->change == 2) ? null : $toQueryRet($ent->new_q),
+            );
+        }
+        $this->ffi->quota_diff_free($entries);
+
+        return $ret;
+    }
+
+    /**
+     * Open a usage history file, creating it with room for $slots ids and
+     * $depth samples per id if it does not exist yet (the defaults keep a
+     * day of 5 minute samples). With more ids than $slots, the ones sampled
+     * least recently are dropped.
+     */
+    function historyOpen(string $path, int $slots = 65536, int $depth = 288): QuotaHistory
+    {
+        $path = PHPQuota::phpStringToFFI($path);
+        $history = $this->ffi->quota_history_open($path, $slots, $depth);
+        if (is_null($history)) {
+            $this->checkError();
+            throw new Exception("Cannot open history");
+        }
+
+        return new QuotaHistory($this, $this->ffi, $history);
+    }
+
+    /**
+     * Open a reservation ledger, creating it with room for $slots ids if it
+     * does not exist yet. Quotas are queried again after $ttl milliseconds,
+     * which also gives back what crashed workers had reserved. Keep it on a
+     * tmpfs, e.g. /dev/shm, so that it is gone after a reboot; the file is
+     * created with mode 0666 less the umask.
+     */
+    function ledgerOpen(string $path, int $slots = 65536, int $ttl = 5000): QuotaLedger
+    {
+        $path = PHPQuota::phpStringToFFI($path);
+        $ledger = $this->ffi->quota_ledger_open($path, $slots, $ttl);
+        if (is_null($ledger)) {
+            $this->checkError();
+            throw new Exception("Cannot open ledger");
+        }
+
+        return new QuotaLedger($this, $this->ffi, $ledger);
+    }
+
+    const HEADROOM_LIMITS = array("user", "group", "project", "fs", null);
+
+    /**
+     * How much $uid and $gid can still write at $path, in one call: bytes
+     * and files (null if unlimited), what limits each of them (bytes_by,
+     * files_by: "user", "group", "project", "fs" or null), the quota kinds that
+     * apply (quotas: list of QuotaType) and the project id of the path.
+     *
+     * @return array<string, mixed>
+     */
+    function headroom(string $path, int | null $uid = null, int | null $gid = null): array
+    {
+        $uid = $uid ?? posix_getuid();
+        $gid = $gid ?? posix_getgid();
+
+        $ret = $this->ffi->new("headroom_ret");
+        $this->ffi->quota_headroom(PHPQuota::phpStringToFFI($path), $uid, $gid, FFI::addr($ret));
+        $this->checkError();
+
+        $quotas = array();
+        foreach (QuotaType::cases() as $kind) {
+            if ($ret->quotas & (1 << $kind->value)) {
+                $quotas[] = $kind;
+            }
+        }
+        // UINT64_MAX comes back as -1
+        return array(
+            "bytes" => ($ret->bytes < 0) ? null : $ret->bytes,
+            "files" => ($ret->files < 0) ? null : $ret->files,
+            "bytes_by" => self::HEADROOM_LIMITS[$ret->bytes_by],
+            "files_by" => self::HEADROOM_LIMITS[$ret->files_by],
+            "quotas" => $quotas,
+            "projid" => $ret->projid,
+        );
+    }
+
+    /**
+     * Add up the usage below $path per uid, gid and, with $project, project
+     * id, for file systems without quotas. The keys user, group and project
+     * hold QuotaSnapshots like snapshotOpen() returns (project is null
+     * without $project); inodes, dirs and errors count what was scanned and
+     * what could not be read.
+     *
+     * @return array<string, mixed>
+     */
+    function scan(string $path, int $threads = 0, bool $xdev = false, bool $project = false): array
+    {
+        $ret = $this->ffi->new("scan_ret");
+        $flags = ($xdev ? 1 : 0) | ($project ? 2 : 0);
+        if ($this->ffi->quota_scan(PHPQuota::phpStringToFFI($path), $threads, $flags, FFI::addr($ret)) != 0) {
+            $this->checkError();
+            throw new Exception("Cannot scan " . $path);
+        }
+
+        $snaps = array();
+        foreach (QuotaType::cases() as $kind) {
+            $snap = $ret->snaps[$kind->value];
+            $snaps[$kind->value] = is_null($snap) ? null : new QuotaSnapshot($this->ffi, $snap);
+        }
+        return array(
+            "user" => $snaps[QuotaType::User->value],
+            "group" => $snaps[QuotaType::Group->value],
+            "project" => $snaps[QuotaType::Project->value],
+            "inodes" => $ret->inodes,
+            "dirs" => $ret->dirs,
+            "errors" => $ret->errors,
+        );
+    }
+
+    /**
+     * Keep the usage below $path current in the file $state, like scan()
+     * adds it up once: the totals are read with query() and enumerate() on
+     * $tracker->dev(), while $tracker->run() applies file system events.
+     * A tracker of the same tree that was closed before leaves its state, so
+     * only directories changed since are read again. Hard links count once,
+     * except that a file linked again while tracked is counted twice until
+     * the directory of its first link changes. Needs CAP_SYS_ADMIN.
+     */
+    function trackerOpen(string $path, string $state, int $slots = 65536, int $threads = 0, bool $project = false): QuotaTracker
+    {
+        $tracker = $this->ffi->quota_tracker_open(PHPQuota::phpStringToFFI($path), PHPQuota::phpStringToFFI($state), $slots, $threads, $project ? 2 : 0);
+        if (is_null($tracker)) {
+            $this->checkError();
+            throw new Exception("Cannot track " . $path);
+        }
+
+        return new QuotaTracker($this, $this->ffi, $tracker, $state);
+    }
+
+    /**
+     * Give every file and directory below the directory $path the project
+     * id $projid, and directories the inherit flag, in parallel. A call that
+     * was interrupted can be repeated and leaves out what is done. $progress
+     * gets an array like the one returned about once a second; with
+     * $limits (bs, bh, fs, fh as for setqlim(), as a list or with these
+     * keys) the project's limits are set afterwards, so that a directory is
+     * taken under a project quota in one call.
+     *
+     * @return array<string, int> inodes changed, dirs done, skipped
+     * subdirectories and errors
+     */
+    function projectAssign(string $path, int $projid, int $threads = 0, callable | null $progress = null, array | null $limits = null): array
+    {
+        $toArray = function ($r): array {
+            return array(
+                "inodes" => $r->inodes,
+                "dirs" => $r->dirs,
+                "skipped" => $r->skipped,
+                "errors" => $r->errors,
+            );
+        };
+        $fn = is_null($progress) ? null : function ($r, $arg) use ($progress, $toArray) {
+            $progress($toArray($r));
+        };
+        $vals = null;
+        if (!is_null($limits)) {
+            // a missing limit would silently become 0, i.e. unlimited
+            $vals = $this->ffi->new("query_ret");
+            foreach (array("bs", "bh", "fs", "fh") as $i => $name) {
+                if (array_key_exists($name, $limits)) {
+                    $vals->$name = (int)$limits[$name];
+                } elseif (array_key_exists($i, $limits)) {
+                    $vals->$name = (int)$limits[$i];
+                } else {
+                    throw new Exception("Missing limit " . $name);
+                }
+            }
+        }
+
+        $ret = $this->ffi->new("project_ret");
+        if ($this->ffi->quota_project_assign(PHPQuota::phpStringToFFI($path), $projid, $threads, is_null($vals) ? null : FFI::addr($vals), $fn, null, FFI::addr($ret)) != 0) {
+            $this->checkError();
+            throw new Exception("Cannot assign project " . $projid . " to " . $path);
+        }
+        return $toArray($ret);
+    }
+
+    /**
+     * Guard writes to $stream, which goes to $path, by the headroom of $uid
+     * and $gid (see QuotaUploadFilter): a write that would not fit throws
+     * a QuotaExceededException. Pass the size of the upload as $expected
+     * if it is known, to fail before anything is written.
+     *
+     * @param resource $stream
+     * @return resource the filter, for stream_filter_remove()
+     */
+    function guardUpload($stream, string $path, int | null $uid = null, int | null $gid = null, int | null $expected = null, int $interval = 8 << 20, float $ttl = 5.0)
+    {
+        QuotaUploadFilter::register();
+        $filter = stream_filter_append($stream, QuotaUploadFilter::NAME, STREAM_FILTER_WRITE, array(
+            "quota" => $this,
+            "path" => $path,
+            "uid" => $uid ?? posix_getuid(),
+            "gid" => $gid ?? posix_getgid(),
+            "expected" => $expected,
+            "interval" => max($interval, 1),
+            "ttl" => $ttl,
+        ));
+        if ($filter === false) {
+            throw new Exception("Cannot attach quota filter to stream");
+        }
+        return $filter;
+    }
+
+    /**
+     * Completion queue for non-blocking requests, see QuotaAsync.
+     */
+    function async(): QuotaAsync
+    {
+        $async = $this->ffi->quota_async_open();
+        if (is_null($async)) {
+            $this->checkError();
+            throw new Exception("Cannot create completion queue");
+        }
+
+        return new QuotaAsync($this, $this->ffi, $async);
+    }
+
+    /**
+     * Dquot cache statistics of the kernel (Linux only): lookups, drops,
+     * reads, writes, cache_hits, allocated_dquots, free_dquots, syncs and
+     * version.
+     *
+     * @return array<string, int>
+     */
+    function kernelStats(): array
+    {
+        $st = $this->ffi->new("kernel_stats_ret");
+        $this->ffi->quota_kernel_stats(FFI::addr($st));
+        $this->checkError();
+
+        $ret = array();
+        foreach (array("lookups", "drops", "reads", "writes", "cache_hits", "allocated_dquots", "free_dquots", "syncs", "version") as $name) {
+            $ret[$name] = $st->$name;
+        }
+        return $ret;
+    }
+
+    const OPS = array("query", "setqlim", "sync", "rpc", "mntent");
+
+    /**
+     * Call counts, error counts and latency histograms of the library
+     * operations, keyed by the names in OPS. Each entry holds calls, errors,
+     * total_us, latency (upper bound in microseconds => calls, non-empty
+     * buckets only), errno (errno => failures, 0 for RPC errors) and
+     * rpc_status (clnt_stat => failures).
+     *
+     * @return array<string, array<string, mixed>>
+     */
+    function stats(): array
+    {
+        $n = count(self::OPS);
+        $cStats = $this->ffi->new("quota_op_stats[" . $n . "]");
+        $this->ffi->quota_stats($cStats, $n);
+
+        $ret = array();
+        foreach (self::OPS as $op => $name) {
+            $st = $cStats[$op];
+            $latency = array();
+            for ($i = 0; $i < count($st->latency); $i++) {
+                if ($st->latency[$i] != 0) {
+                    $latency[1 << $i] = $st->latency[$i];
+                }
+            }
+            $errnos = array();
+            for ($i = 0; $i < count($st->errnos); $i++) {
+                if ($st->errnos[$i] != 0) {
+                    $errnos[$i] = $st->errnos[$i];
+                }
+            }
+            $rpcStatus = array();
+            for ($i = 0; $i < count($st->rpc_status); $i++) {
+                if ($st->rpc_status[$i] != 0) {
+                    $rpcStatus[$i] = $st->rpc_status[$i];
+                }
+            }
+            $ret[$name] = array(
+                "calls" => $st->calls,
+                "errors" => $st->errors,
+                "total_us" => $st->total_us,
+                "latency" => $latency,
+                "errno" => $errnos,
+                "rpc_status" => $rpcStatus,
+            );
+        }
+        return $ret;
+    }
+
+    function statsReset(): void
+    {
+        $this->ffi->quota_stats_reset();
+    }
+
+    const TRACE_POINTS = array("quotactl", "clnt_call", "hostlookup", "mnttab");
+
+    private $traceFn = null;
+
+    /**
+     * Call $fn at entry and exit of every backend call, or stop with null.
+     * $fn receives an array with the keys point (a TRACE_POINTS name), exit
+     * (false on entry), target, id, cmd, and on exit ret, errno and
+     * duration_ns. $fn only runs in this thread: events of the library's
+     * own threads are passed on when the call that started them returns,
+     * or by tracePoll().
+     */
+    function trace(callable | null $fn): void
+    {
+        if (is_null($fn)) {
+            $this->ffi->quota_trace_set(null, null);
+            $this->traceFn = null;
+            return;
+        }
+
+        // keep the closure alive as long as the library may call it
+        $this->traceFn = function ($ev, $arg) use ($fn) {
+            $fn(array(
+                "point" => self::TRACE_POINTS[$ev->point],
+                "exit" => $ev->phase == 1,
+                "target" => FFI::string($ev->target),
+                "id" => $ev->id,
+                "cmd" => $ev->cmd,
+                "ret" => $ev->ret,
+                "errno" => $ev->err,
+                "duration_ns" => $ev->duration_ns,
+            ));
+        };
+        $this->ffi->quota_trace_set($this->traceFn, null);
+    }
+
+    /**
+     * Pass on the trace events of the library's threads that are waiting.
+     */
+    function tracePoll(): void
+    {
+        $this->ffi->quota_trace_poll();
+    }
+
+    /**
+     * Log every backend call taking $threshold_us or longer to $fd, or turn
+     * the log off with a threshold of 0.
+     */
+    function slowlog(int $threshold_us, int $fd = 2): void
+    {
+        $this->ffi->quota_slowlog_set($threshold_us, $fd);
+    }
+
     function rpcquery(string $host, string $path, int | null $uid = null, QuotaType $kind = QuotaType::User): QueryRet
     {
         $uid = $uid ?? posix_getuid();
@@ -233,9 +1546,35 @@ class PHPQuota
         return $ret;
     }
 
-    function setmntentRaw(): int
+    /**
+     * $filter restricts the entries getmntentRaw() returns; it is checked
+     * in the library, so that skipped entries never reach PHP. Keys:
+     * "types" and "skip_types" (file system types, "nfs*" matches by
+     * prefix), "opts" (options that must all be set), "any_opts" (options
+     * of which one must be set) and "prefix" (directory whose mount points
+     * are wanted). Lists are arrays or comma separated strings.
+     *
+     * @param array<string, string | list<string>> | null $filter
+     */
+    function setmntentRaw(array | null $filter = null): int
     {
-        $ret = $this->ffi->quota_setmntent();
+        if (is_null($filter)) {
+            $ret = $this->ffi->quota_setmntent();
+            $this->checkError();
+            return $ret;
+        }
+
+        $spec = $this->ffi->new("mntent_filter");
+        $strings = array();
+        foreach (array("types", "skip_types", "opts", "any_opts", "prefix") as $key) {
+            if (isset($filter[$key])) {
+                $value = is_array($filter[$key]) ? implode(",", $filter[$key]) : $filter[$key];
+                // keep the buffers alive until the library has copied them
+                $strings[$key] = PHPQuota::phpStringToFFI($value);
+                $spec->$key = $this->ffi->cast("char *", FFI::addr($strings[$key]));
+            }
+        }
+        $ret = $this->ffi->quota_setmntent_filter(FFI::addr($spec));
         $this->checkError();
         return $ret;
     }
@@ -257,7 +1596,11 @@ class PHPQuota
                 FFI::string($getmntent_ret->dev),
                 FFI::string($getmntent_ret->path),
                 FFI::string($getmntent_ret->type),
-                FFI::string($getmntent_ret->opts)
+                FFI::string($getmntent_ret->opts),
+                $getmntent_ret->mnt_id,
+                $getmntent_ret->parent_id,
+                $getmntent_ret->dev_major,
+                $getmntent_ret->dev_minor
             );
             $this->ffi->quota_getmntent_free($getmntent_ret);
             $this->checkError();
@@ -272,8 +1615,11 @@ class PHPQuota
         $this->checkError();
     }
 
-    function getmntent(): GetMntent {
-        return new GetMntent($this);
+    /**
+     * @param array<string, string | list<string>> | null $filter see setmntentRaw()
+     */
+    function getmntent(array | null $filter = null, bool $snapshot = false): GetMntent {
+        return new GetMntent($this, $filter, $snapshot);
     }
 
     function getqcargtype(): string
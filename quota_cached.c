@@ -0,0 +1,557 @@
+/*
+**  quota-cached: local quota cache daemon
+**
+**  Serves quota_query results over a Unix domain socket to the
+**  quota_client_* functions (protocol in include/cached.h). Results are
+**  kept for a configurable time, and concurrent requests for the same
+**  device, id and kind are collapsed into a single quota_query call: the
+**  first connection thread to miss the cache runs the query, later ones
+**  wait for its result.
+**
+**  The peer of each connection is taken from the socket (SO_PEERCRED):
+**  root and the members of the group given with -g may query and
+**  invalidate any id, everyone else only their own uid and groups, so
+**  that the daemon tells nobody more than quota_query would as them.
+**
+**  Usage: quota-cached [-s socket] [-t seconds] [-m entries] [-M mode]
+**                      [-g group]
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <grp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Quota.h"
+#include "include/cached.h"
+
+#define CACHED_SOCKET "/run/quota-cached.sock"
+#define CACHED_TTL 10
+#define CACHED_ENTRIES 100000
+#define CACHED_BUCKETS 65536
+#define CACHED_GROUPS 256 /* of a peer; more are not looked at */
+
+#define ENTRY_PENDING 0
+#define ENTRY_READY 1
+
+struct entry
+{
+  struct entry *next;
+  int state;
+  int waiters;  /* threads waiting for a pending query */
+  int dropped;  /* invalidated while pending; do not keep the result */
+  double expires;
+  int32_t id;
+  uint16_t kind;
+  uint16_t devlen;
+  struct cached_rsp rsp;
+  char msg[CACHED_MAXMSG];
+  char dev[];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_done = PTHREAD_COND_INITIALIZER;
+static struct entry *buckets[CACHED_BUCKETS];
+static long entries;
+
+static double ttl = CACHED_TTL;
+static long max_entries = CACHED_ENTRIES;
+static gid_t admin_gid;
+static int admin_set;
+
+/* the process at the other end of a connection */
+struct peer
+{
+  int fd;
+  int admin; /* may ask about any id */
+  uid_t uid;
+  int ngroups;
+  gid_t groups[CACHED_GROUPS];
+};
+
+static double
+now_seconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int
+entry_hash (const char *dev, size_t devlen, int32_t id, int kind)
+{
+  unsigned int h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < devlen; i++)
+    h = (h ^ (unsigned char)dev[i]) * 16777619u;
+  h = (h ^ (uint32_t)id) * 16777619u;
+  h = (h ^ kind) * 16777619u;
+  return h & (CACHED_BUCKETS - 1);
+}
+
+static struct entry *
+entry_find (unsigned int bucket, const char *dev, size_t devlen, int32_t id,
+            int kind)
+{
+  struct entry *e;
+
+  for (e = buckets[bucket]; e != NULL; e = e->next)
+    {
+      if ((e->id == id) && (e->kind == kind) && (e->devlen == devlen)
+          && !memcmp (e->dev, dev, devlen))
+        return e;
+    }
+  return NULL;
+}
+
+static void
+entry_unlink (unsigned int bucket, struct entry *e)
+{
+  struct entry **p;
+
+  for (p = &buckets[bucket]; *p != e; p = &(*p)->next)
+    ;
+  *p = e->next;
+  entries--;
+  free (e);
+}
+
+/*
+ * drop expired results; called with cache_lock held when the cache is full
+ */
+static void
+cache_sweep (double now)
+{
+  struct entry **p;
+  unsigned int i;
+
+  for (i = 0; i < CACHED_BUCKETS; i++)
+    {
+      for (p = &buckets[i]; *p != NULL;)
+        {
+          struct entry *e = *p;
+
+          if ((e->state == ENTRY_READY) && (e->waiters == 0)
+              && (e->expires <= now))
+            {
+              *p = e->next;
+              entries--;
+              free (e);
+            }
+          else
+            p = &e->next;
+        }
+    }
+}
+
+static void
+cache_invalidate (const char *dev, size_t devlen, int32_t id, int kind)
+{
+  struct entry **p;
+  unsigned int i;
+
+  pthread_mutex_lock (&cache_lock);
+  for (i = 0; i < CACHED_BUCKETS; i++)
+    {
+      for (p = &buckets[i]; *p != NULL;)
+        {
+          struct entry *e = *p;
+
+          if (((id == -1) || (e->id == id)) && (e->kind == kind)
+              && (e->devlen == devlen) && !memcmp (e->dev, dev, devlen))
+            {
+              if ((e->state == ENTRY_READY) && (e->waiters == 0))
+                {
+                  *p = e->next;
+                  entries--;
+                  free (e);
+                  continue;
+                }
+              e->dropped = 1;
+              e->expires = 0;
+            }
+          p = &e->next;
+        }
+    }
+  pthread_mutex_unlock (&cache_lock);
+}
+
+static void
+backend_query (char *dev, int32_t id, int kind, struct cached_rsp *rsp,
+               char *msg)
+{
+  const char *str;
+  int err;
+
+  errno = 0;
+  rsp->q = quota_query (dev, id, kind);
+  err = errno;
+  str = quota_strerr ();
+  if ((err == 0) && strcmp (str, strerror (0)))
+    {
+      /* RPC error; only the message tells what happened */
+      rsp->msglen = strlen (str);
+      if (rsp->msglen > CACHED_MAXMSG)
+        rsp->msglen = CACHED_MAXMSG;
+      memcpy (msg, str, rsp->msglen);
+    }
+  else
+    rsp->msglen = 0;
+
+  rsp->err = err;
+  if ((err != 0) || (rsp->msglen != 0))
+    memset (&rsp->q, 0, sizeof (rsp->q));
+}
+
+static void
+handle_query (char *dev, size_t devlen, int32_t id, int kind, int flags,
+              struct cached_rsp *rsp, char *msg)
+{
+  unsigned int bucket = entry_hash (dev, devlen, id, kind);
+  double now = now_seconds ();
+  struct entry *e;
+
+  pthread_mutex_lock (&cache_lock);
+  e = entry_find (bucket, dev, devlen, id, kind);
+  if ((e != NULL) && (e->state == ENTRY_PENDING))
+    {
+      e->waiters++;
+      while (e->state == ENTRY_PENDING)
+        pthread_cond_wait (&cache_done, &cache_lock);
+      e->waiters--;
+      *rsp = e->rsp;
+      memcpy (msg, e->msg, rsp->msglen);
+      rsp->flags = CACHED_COALESCED;
+      pthread_mutex_unlock (&cache_lock);
+      return;
+    }
+  if ((e != NULL) && (e->expires > now) && !(flags & CACHED_FRESH))
+    {
+      *rsp = e->rsp;
+      memcpy (msg, e->msg, rsp->msglen);
+      rsp->flags = CACHED_HIT;
+      pthread_mutex_unlock (&cache_lock);
+      return;
+    }
+
+  if (e == NULL)
+    {
+      if (entries >= max_entries)
+        cache_sweep (now);
+      if (entries < max_entries)
+        {
+          e = malloc (sizeof (*e) + devlen);
+          if (e != NULL)
+            {
+              memcpy (e->dev, dev, devlen);
+              e->devlen = devlen;
+              e->id = id;
+              e->kind = kind;
+              e->waiters = 0;
+              e->next = buckets[bucket];
+              buckets[bucket] = e;
+              entries++;
+            }
+        }
+    }
+  if (e != NULL)
+    {
+      e->state = ENTRY_PENDING;
+      e->dropped = 0;
+    }
+  pthread_mutex_unlock (&cache_lock);
+
+  backend_query (dev, id, kind, rsp, msg);
+  rsp->flags = 0;
+  if (e == NULL)
+    return;
+
+  pthread_mutex_lock (&cache_lock);
+  e->rsp = *rsp;
+  memcpy (e->msg, msg, rsp->msglen);
+  /* errors are handed to the waiting threads, but never kept */
+  if (e->dropped || (rsp->err != 0) || (rsp->msglen != 0))
+    e->expires = 0;
+  else
+    e->expires = now_seconds () + ttl;
+  e->state = ENTRY_READY;
+  if (e->waiters != 0)
+    pthread_cond_broadcast (&cache_done);
+  else if (e->expires == 0)
+    entry_unlink (bucket, e);
+  pthread_mutex_unlock (&cache_lock);
+}
+
+static int
+read_all (int fd, void *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = recv (fd, data, len, 0);
+      if (n == 0)
+        return -1;
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      data = (char *)data + n;
+      len -= n;
+    }
+  return 0;
+}
+
+static int
+write_all (int fd, const void *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = send (fd, data, len, MSG_NOSIGNAL);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      data = (const char *)data + n;
+      len -= n;
+    }
+  return 0;
+}
+
+static int
+peer_in_group (const struct peer *p, gid_t gid)
+{
+  int i;
+
+  for (i = 0; i < p->ngroups; i++)
+    {
+      if (p->groups[i] == gid)
+        return 1;
+    }
+  return 0;
+}
+
+/*
+ * Who is connected on fd; -1 if that cannot be told. Without
+ * SO_PEERGROUPS only the primary group of the peer counts.
+ */
+static int
+peer_get (struct peer *p, int fd)
+{
+#ifdef SO_PEERCRED
+  struct ucred cred;
+  socklen_t len = sizeof (cred);
+
+  memset (p, 0, sizeof (*p));
+  p->fd = fd;
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+    return -1;
+  p->uid = cred.uid;
+#ifdef SO_PEERGROUPS
+  len = sizeof (p->groups) - sizeof (p->groups[0]);
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERGROUPS, p->groups, &len) == 0)
+    p->ngroups = len / sizeof (p->groups[0]);
+#endif
+  p->groups[p->ngroups++] = cred.gid;
+  p->admin = (p->uid == 0) || (admin_set && peer_in_group (p, admin_gid));
+  return 0;
+#else
+  /* only the permissions of the socket keep others out */
+  memset (p, 0, sizeof (*p));
+  p->fd = fd;
+  p->admin = 1;
+  return 0;
+#endif
+}
+
+/*
+ * whether the peer may query or invalidate id; project ids have no owner
+ * to check against, and -1 (all ids) is for administrators as well
+ */
+static int
+peer_allowed (const struct peer *p, int32_t id, int kind)
+{
+  if (p->admin)
+    return 1;
+  if (kind == PHP_QUOTA_TYPE_USER)
+    return (id != -1) && ((uid_t)id == p->uid);
+  if (kind == PHP_QUOTA_TYPE_GROUP)
+    return (id != -1) && peer_in_group (p, (gid_t)id);
+  return 0;
+}
+
+static void *
+connection (void *arg)
+{
+  char reply[sizeof (struct cached_rsp) + CACHED_MAXMSG];
+  struct cached_rsp *rsp = (struct cached_rsp *)reply;
+  char *msg = reply + sizeof (struct cached_rsp);
+  char dev[CACHED_MAXDEV + 1];
+  struct cached_req req;
+  struct peer *p = arg;
+  int fd = p->fd;
+
+  while ((read_all (fd, &req, sizeof (req)) == 0)
+         && (req.magic == CACHED_MAGIC) && (req.devlen <= CACHED_MAXDEV)
+         && (read_all (fd, dev, req.devlen) == 0))
+    {
+      dev[req.devlen] = '\0';
+      memset (rsp, 0, sizeof (*rsp));
+      if (((req.op == CACHED_QUERY) || (req.op == CACHED_INVALIDATE))
+          && !peer_allowed (p, req.id, req.kind))
+        rsp->err = EACCES;
+      else if (req.op == CACHED_QUERY)
+        handle_query (dev, req.devlen, req.id, req.kind, req.flags, rsp, msg);
+      else if (req.op == CACHED_INVALIDATE)
+        cache_invalidate (dev, req.devlen, req.id, req.kind);
+      else
+        rsp->err = EINVAL;
+      rsp->magic = CACHED_MAGIC;
+      if (write_all (fd, reply, sizeof (*rsp) + rsp->msglen) != 0)
+        break;
+    }
+  close (fd);
+  free (p);
+  return NULL;
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "usage: quota-cached [-s socket] [-t seconds] [-m entries] "
+           "[-M mode] [-g group]\n"
+           "  -s  socket path (default %s)\n"
+           "  -t  seconds results are kept (default %d)\n"
+           "  -m  maximum number of cached results (default %d)\n"
+           "  -M  socket permissions, octal (default 0660)\n"
+           "  -g  group whose members may query any id (default: root "
+           "only)\n",
+           CACHED_SOCKET, CACHED_TTL, CACHED_ENTRIES);
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  const char *path = CACHED_SOCKET;
+  mode_t mode = 0660;
+  pthread_attr_t attr;
+  int sock;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "s:t:m:M:g:h")) != -1)
+    {
+      switch (opt)
+        {
+        case 's':
+          path = optarg;
+          break;
+        case 't':
+          ttl = atof (optarg);
+          break;
+        case 'm':
+          max_entries = atol (optarg);
+          break;
+        case 'M':
+          mode = strtol (optarg, NULL, 8);
+          break;
+        case 'g':
+          {
+            struct group *gr = getgrnam (optarg);
+            char *end;
+
+            if (gr != NULL)
+              admin_gid = gr->gr_gid;
+            else
+              {
+                admin_gid = strtoul (optarg, &end, 10);
+                if ((*optarg == '\0') || (*end != '\0'))
+                  {
+                    fprintf (stderr, "quota-cached: unknown group %s\n",
+                             optarg);
+                    return 2;
+                  }
+              }
+            admin_set = 1;
+          }
+          break;
+        default:
+          usage ();
+        }
+    }
+  if ((optind != argc) || (ttl < 0) || (max_entries < 0)
+      || (strlen (path) >= sizeof (addr.sun_path)))
+    usage ();
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+
+  sock = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1)
+    {
+      perror ("quota-cached: socket");
+      return 1;
+    }
+  unlink (path);
+  if ((bind (sock, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+      || (chmod (path, mode) != 0) || (listen (sock, 128) != 0))
+    {
+      perror ("quota-cached: bind");
+      return 1;
+    }
+
+  signal (SIGPIPE, SIG_IGN);
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+  for (;;)
+    {
+      pthread_t thread;
+      struct peer *p;
+      int fd = accept (sock, NULL, NULL);
+
+      if (fd == -1)
+        {
+          if (errno != EINTR)
+            perror ("quota-cached: accept");
+          continue;
+        }
+      p = malloc (sizeof (*p));
+      if ((p == NULL) || (peer_get (p, fd) != 0))
+        {
+          /* nobody is served without knowing who asks */
+          free (p);
+          close (fd);
+          continue;
+        }
+      if (pthread_create (&thread, &attr, connection, p) != 0)
+        {
+          perror ("quota-cached: pthread_create");
+          free (p);
+          close (fd);
+        }
+    }
+}
@@ -0,0 +1,661 @@
+/*
+**  quota-exporter: OpenMetrics exporter for file system quotas
+**
+**  A scanner thread enumerates every mount with quotas turned on, for users
+**  and groups, and renders the result into a page that is served as is on
+**  GET /metrics until the next scan replaces it. Scrapes therefore never
+**  wait for quotactl, however large the quota tables are.
+**
+**  Usage: quota-exporter [-l address] [-p port] [-i seconds]
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Quota.h"
+
+#define EXPORTER_PORT 9942
+#define EXPORTER_INTERVAL 60
+#define EXPORTER_KINDS 2
+
+/*
+ * rendered output; replaced as a whole after every scan and freed when the
+ * last connection still sending it is done
+ */
+struct page
+{
+  int refs;
+  size_t len;
+  char *data;
+};
+
+struct buf
+{
+  size_t len;
+  size_t size;
+  char *data;
+};
+
+/* quota entries of one mount and kind */
+struct table
+{
+  char *dev;
+  char *path;
+  quota_type kind;
+  unsigned int block_size; /* bytes per block of bc, bs and bh */
+  long count;
+  unsigned int *ids;
+  query_ret *rows;
+  double duration;
+  int failed;
+};
+
+struct scan
+{
+  struct table *tables;
+  int count;
+  int size;
+};
+
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct page *current;
+
+static unsigned long scans_total;
+static unsigned long scan_errors_total;
+static unsigned int interval = EXPORTER_INTERVAL;
+
+static const char *const kind_names[EXPORTER_KINDS] = { "user", "group" };
+
+static double
+now_seconds (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+buf_reserve (struct buf *b, size_t n)
+{
+  if (b->len + n < b->size)
+    return;
+  while (b->len + n >= b->size)
+    b->size = (b->size != 0) ? (b->size * 2) : 65536;
+  b->data = realloc (b->data, b->size);
+  if (b->data == NULL)
+    {
+      perror ("quota-exporter");
+      exit (1);
+    }
+}
+
+static void
+buf_printf (struct buf *b, const char *fmt, ...)
+{
+  va_list ap;
+  int n;
+
+  buf_reserve (b, 256);
+  va_start (ap, fmt);
+  n = vsnprintf (b->data + b->len, b->size - b->len, fmt, ap);
+  va_end (ap);
+  if ((size_t)n >= b->size - b->len)
+    {
+      buf_reserve (b, n + 1);
+      va_start (ap, fmt);
+      vsnprintf (b->data + b->len, b->size - b->len, fmt, ap);
+      va_end (ap);
+    }
+  b->len += n;
+}
+
+/*
+ * label value with backslash, quote and newline escaped
+ */
+static void
+buf_label (struct buf *b, const char *str)
+{
+  buf_reserve (b, 2 * strlen (str) + 1);
+  for (; *str != '\0'; str++)
+    {
+      if (*str == '\n')
+        {
+          b->data[b->len++] = '\\';
+          b->data[b->len++] = 'n';
+          continue;
+        }
+      if ((*str == '\\') || (*str == '"'))
+        b->data[b->len++] = '\\';
+      b->data[b->len++] = *str;
+    }
+}
+
+static void
+buf_labels (struct buf *b, const struct table *t)
+{
+  buf_printf (b, "{mountpoint=\"");
+  buf_label (b, t->path);
+  buf_printf (b, "\",device=\"");
+  buf_label (b, t->dev);
+  buf_printf (b, "\",type=\"%s\"", kind_names[t->kind]);
+}
+
+/*
+ * argument for quota_query et al. for a mount table entry, or NULL if its
+ * quotas cannot be enumerated
+ */
+static char *
+mount_dev (const getmntent_ret *ent)
+{
+  char *dev;
+
+  if (!strcmp (ent->type, "xfs"))
+    {
+      dev = malloc (strlen (ent->dev) + 6);
+      if (dev != NULL)
+        sprintf (dev, "(XFS)%s", ent->dev);
+      return dev;
+    }
+  /* rquota has no way to list the ids of a remote file system */
+  if (!strncmp (ent->type, "nfs", 3) || (strchr (ent->dev, '/') == NULL))
+    return NULL;
+  return strdup (ent->dev);
+}
+
+static void
+scan_add (struct scan *s, char *dev, const char *path, quota_type kind)
+{
+  struct table *t;
+  unsigned int id = 0;
+  long size = 0;
+  double start = now_seconds ();
+  query_ret q;
+  int ret;
+
+  if (s->count == s->size)
+    {
+      s->size = (s->size != 0) ? (s->size * 2) : 16;
+      s->tables = realloc (s->tables, s->size * sizeof (*s->tables));
+      if (s->tables == NULL)
+        {
+          perror ("quota-exporter");
+          exit (1);
+        }
+    }
+  t = &s->tables[s->count++];
+  memset (t, 0, sizeof (*t));
+  t->dev = strdup (dev);
+  t->path = strdup (path);
+  t->kind = kind;
+  t->block_size = quota_block_size (dev);
+
+  while ((ret = quota_query_next (dev, &id, kind, &q)) == 0)
+    {
+      if (t->count == size)
+        {
+          size = (size != 0) ? (size * 2) : 256;
+          t->ids = realloc (t->ids, size * sizeof (*t->ids));
+          t->rows = realloc (t->rows, size * sizeof (*t->rows));
+          if ((t->ids == NULL) || (t->rows == NULL))
+            {
+              perror ("quota-exporter");
+              exit (1);
+            }
+        }
+      t->ids[t->count] = id;
+      t->rows[t->count] = q;
+      t->count++;
+      if (id == (unsigned int)-1)
+        break;
+      id++;
+    }
+  if (ret < 0)
+    {
+      fprintf (stderr, "quota-exporter: %s (%s): %s\n", path, kind_names[kind],
+               quota_strerr ());
+      t->failed = 1;
+      scan_errors_total++;
+    }
+  t->duration = now_seconds () - start;
+}
+
+static void
+scan_free (struct scan *s)
+{
+  int i;
+
+  for (i = 0; i < s->count; i++)
+    {
+      free (s->tables[i].dev);
+      free (s->tables[i].path);
+      free (s->tables[i].ids);
+      free (s->tables[i].rows);
+    }
+  free (s->tables);
+}
+
+/*
+ * one metric family; OpenMetrics wants all samples of a family together.
+ * With blocks, the values are space in the blocks of their device.
+ */
+static void
+render_family (struct buf *b, const struct scan *s, const char *name,
+               const char *help, const char *unit, size_t offset,
+               int blocks)
+{
+  int i;
+  long r;
+
+  buf_printf (b, "# TYPE %s gauge\n", name);
+  if (unit != NULL)
+    buf_printf (b, "# UNIT %s %s\n", name, unit);
+  buf_printf (b, "# HELP %s %s\n", name, help);
+  for (i = 0; i < s->count; i++)
+    {
+      const struct table *t = &s->tables[i];
+      uint64_t scale = blocks ? t->block_size : 1;
+
+      for (r = 0; r < t->count; r++)
+        {
+          const query_ret *q = &t->rows[r];
+          uint64_t val = *(const uint64_t *)((const char *)q + offset);
+
+          /* ids without usage or limits only exist in the quota file */
+          if ((q->bc | q->bs | q->bh | q->fc | q->fs | q->fh) == 0)
+            continue;
+          buf_printf (b, "%s", name);
+          buf_labels (b, t);
+          buf_printf (b, ",id=\"%u\"} %llu\n", t->ids[r],
+                      (unsigned long long)(val * scale));
+        }
+    }
+}
+
+static struct page *
+render (const struct scan *s, double duration)
+{
+  struct page *page;
+  struct buf b = { 0, 0, NULL };
+  int i;
+
+  /* space comes in the blocks of each device, see quota_block_size */
+  render_family (&b, s, "quota_block_usage_bytes",
+                 "Space used, as accounted by the quota system", "bytes",
+                 offsetof (query_ret, bc), 1);
+  render_family (&b, s, "quota_block_soft_limit_bytes",
+                 "Space soft limit, 0 if unlimited", "bytes",
+                 offsetof (query_ret, bs), 1);
+  render_family (&b, s, "quota_block_hard_limit_bytes",
+                 "Space hard limit, 0 if unlimited", "bytes",
+                 offsetof (query_ret, bh), 1);
+  render_family (&b, s, "quota_block_grace_expiry_seconds",
+                 "End of the space grace period, 0 if not running", "seconds",
+                 offsetof (query_ret, bt), 0);
+  render_family (&b, s, "quota_file_usage", "Inodes used", NULL,
+                 offsetof (query_ret, fc), 0);
+  render_family (&b, s, "quota_file_soft_limit",
+                 "Inode soft limit, 0 if unlimited", NULL,
+                 offsetof (query_ret, fs), 0);
+  render_family (&b, s, "quota_file_hard_limit",
+                 "Inode hard limit, 0 if unlimited", NULL,
+                 offsetof (query_ret, fh), 0);
+  render_family (&b, s, "quota_file_grace_expiry_seconds",
+                 "End of the inode grace period, 0 if not running", "seconds",
+                 offsetof (query_ret, ft), 0);
+
+  buf_printf (&b, "# TYPE quota_exporter_table_scan_duration_seconds gauge\n"
+                  "# UNIT quota_exporter_table_scan_duration_seconds seconds\n"
+                  "# HELP quota_exporter_table_scan_duration_seconds Time "
+                  "taken to enumerate one quota table\n");
+  for (i = 0; i < s->count; i++)
+    {
+      buf_printf (&b, "quota_exporter_table_scan_duration_seconds");
+      buf_labels (&b, &s->tables[i]);
+      buf_printf (&b, "} %.6f\n", s->tables[i].duration);
+    }
+  buf_printf (&b, "# TYPE quota_exporter_table_entries gauge\n"
+                  "# HELP quota_exporter_table_entries Quota entries found, "
+                  "0 if the scan failed\n");
+  for (i = 0; i < s->count; i++)
+    {
+      buf_printf (&b, "quota_exporter_table_entries");
+      buf_labels (&b, &s->tables[i]);
+      buf_printf (&b, "} %ld\n", s->tables[i].failed ? 0 : s->tables[i].count);
+    }
+
+  buf_printf (&b,
+              "# TYPE quota_exporter_scan_duration_seconds gauge\n"
+              "# UNIT quota_exporter_scan_duration_seconds seconds\n"
+              "# HELP quota_exporter_scan_duration_seconds Time taken by the "
+              "last scan of all mounts\n"
+              "quota_exporter_scan_duration_seconds %.6f\n"
+              "# TYPE quota_exporter_last_scan_timestamp_seconds gauge\n"
+              "# UNIT quota_exporter_last_scan_timestamp_seconds seconds\n"
+              "# HELP quota_exporter_last_scan_timestamp_seconds Completion "
+              "time of the last scan\n"
+              "quota_exporter_last_scan_timestamp_seconds %lld\n"
+              "# TYPE quota_exporter_refresh_interval_seconds gauge\n"
+              "# UNIT quota_exporter_refresh_interval_seconds seconds\n"
+              "# HELP quota_exporter_refresh_interval_seconds Time between "
+              "the start of two scans\n"
+              "quota_exporter_refresh_interval_seconds %u\n"
+              "# TYPE quota_exporter_scans counter\n"
+              "# HELP quota_exporter_scans Scans completed\n"
+              "quota_exporter_scans_total %lu\n"
+              "# TYPE quota_exporter_scan_errors counter\n"
+              "# HELP quota_exporter_scan_errors Quota tables that could not "
+              "be enumerated\n"
+              "quota_exporter_scan_errors_total %lu\n"
+              "# EOF\n",
+              duration, (long long)time (NULL), interval, scans_total,
+              scan_errors_total);
+
+  page = malloc (sizeof (*page));
+  if (page == NULL)
+    {
+      perror ("quota-exporter");
+      exit (1);
+    }
+  page->refs = 1;
+  page->len = b.len;
+  page->data = b.data;
+  return page;
+}
+
+static void
+page_put (struct page *page)
+{
+  int last;
+
+  pthread_mutex_lock (&page_lock);
+  last = (--page->refs == 0);
+  pthread_mutex_unlock (&page_lock);
+  if (last)
+    {
+      free (page->data);
+      free (page);
+    }
+}
+
+static void
+scan_all (void)
+{
+  struct scan s = { NULL, 0, 0 };
+  struct page *page, *old;
+  getmntent_ret ent;
+  double start = now_seconds ();
+  int kind;
+  int i;
+
+  if (quota_setmntent () != 0)
+    {
+      perror ("quota-exporter: setmntent");
+      scan_errors_total++;
+      return;
+    }
+
+  /* collect the devices first; quota calls must not run inside the loop */
+  {
+    char **devs = NULL;
+    char **paths = NULL;
+    int n = 0;
+
+    while (ent = quota_getmntent (), ent.dev != NULL)
+      {
+        char *dev = mount_dev (&ent);
+
+        /* bind mounts share the quota table of the first mount point */
+        for (i = 0; (dev != NULL) && (i < n); i++)
+          {
+            if (!strcmp (devs[i], dev))
+              {
+                free (dev);
+                dev = NULL;
+              }
+          }
+        if (dev != NULL)
+          {
+            devs = realloc (devs, (n + 1) * sizeof (*devs));
+            paths = realloc (paths, (n + 1) * sizeof (*paths));
+            if ((devs == NULL) || (paths == NULL))
+              {
+                perror ("quota-exporter");
+                exit (1);
+              }
+            devs[n] = dev;
+            paths[n] = strdup (ent.path);
+            n++;
+          }
+        quota_getmntent_free (ent);
+      }
+    quota_endmntent ();
+
+    for (i = 0; i < n; i++)
+      {
+        for (kind = 0; kind < EXPORTER_KINDS; kind++)
+          {
+            if (quota_enabled (devs[i], kind) == 1)
+              scan_add (&s, devs[i], paths[i], kind);
+          }
+        free (devs[i]);
+        free (paths[i]);
+      }
+    free (devs);
+    free (paths);
+  }
+
+  scans_total++;
+  page = render (&s, now_seconds () - start);
+  scan_free (&s);
+
+  pthread_mutex_lock (&page_lock);
+  old = current;
+  current = page;
+  pthread_mutex_unlock (&page_lock);
+  if (old != NULL)
+    page_put (old);
+}
+
+static void *
+scanner (void *arg)
+{
+  (void)arg;
+  for (;;)
+    {
+      double start = now_seconds ();
+      double left;
+
+      scan_all ();
+      left = interval - (now_seconds () - start);
+      if (left > 0)
+        usleep (left * 1e6);
+    }
+  return NULL;
+}
+
+static int
+send_all (int fd, const char *data, size_t len)
+{
+  ssize_t n;
+
+  while (len > 0)
+    {
+      n = send (fd, data, len, MSG_NOSIGNAL);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      data += n;
+      len -= n;
+    }
+  return 0;
+}
+
+static void
+send_response (int fd, const char *status, const char *type, const char *body,
+               size_t len)
+{
+  char hdr[256];
+
+  snprintf (hdr, sizeof (hdr),
+            "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n"
+            "Connection: close\r\n\r\n",
+            status, type, len);
+  if (send_all (fd, hdr, strlen (hdr)) == 0)
+    send_all (fd, body, len);
+}
+
+static void
+serve (int fd)
+{
+  struct timeval tv = { 5, 0 };
+  struct page *page;
+  char req[4096];
+  size_t len = 0;
+  ssize_t n;
+
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+  /* the request line and headers are all that is read */
+  while (len < sizeof (req) - 1)
+    {
+      n = recv (fd, req + len, sizeof (req) - 1 - len, 0);
+      if (n <= 0)
+        return;
+      len += n;
+      req[len] = '\0';
+      if (strstr (req, "\r\n\r\n") != NULL)
+        break;
+    }
+
+  if (strncmp (req, "GET /metrics ", 13) && strncmp (req, "GET /metrics?", 13))
+    {
+      const char *msg = "Not found; metrics are at /metrics\n";
+
+      send_response (fd, "404 Not Found", "text/plain", msg, strlen (msg));
+      return;
+    }
+
+  pthread_mutex_lock (&page_lock);
+  page = current;
+  if (page != NULL)
+    page->refs++;
+  pthread_mutex_unlock (&page_lock);
+
+  if (page == NULL)
+    {
+      const char *msg = "First scan still running\n";
+
+      send_response (fd, "503 Service Unavailable", "text/plain", msg,
+                     strlen (msg));
+      return;
+    }
+  send_response (fd, "200 OK",
+                 "application/openmetrics-text; version=1.0.0; charset=utf-8",
+                 page->data, page->len);
+  page_put (page);
+}
+
+static void
+usage (void)
+{
+  fprintf (stderr,
+           "usage: quota-exporter [-l address] [-p port] [-i seconds]\n"
+           "  -l  address to listen on (default 127.0.0.1)\n"
+           "  -p  port to listen on (default %d)\n"
+           "  -i  seconds between scans (default %d)\n",
+           EXPORTER_PORT, EXPORTER_INTERVAL);
+  exit (2);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_in addr;
+  const char *listen_addr = "127.0.0.1";
+  int port = EXPORTER_PORT;
+  pthread_t thread;
+  int one = 1;
+  int sock;
+  int opt;
+
+  while ((opt = getopt (argc, argv, "l:p:i:h")) != -1)
+    {
+      switch (opt)
+        {
+        case 'l':
+          listen_addr = optarg;
+          break;
+        case 'p':
+          port = atoi (optarg);
+          break;
+        case 'i':
+          interval = atoi (optarg);
+          break;
+        default:
+          usage ();
+        }
+    }
+  if ((optind != argc) || (port <= 0) || (port > 65535) || (interval == 0))
+    usage ();
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (port);
+  if (inet_pton (AF_INET, listen_addr, &addr.sin_addr) != 1)
+    {
+      fprintf (stderr, "quota-exporter: invalid address %s\n", listen_addr);
+      return 2;
+    }
+
+  sock = socket (AF_INET, SOCK_STREAM, 0);
+  if (sock == -1)
+    {
+      perror ("quota-exporter: socket");
+      return 1;
+    }
+  setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+  if ((bind (sock, (struct sockaddr *)&addr, sizeof (addr)) != 0)
+      || (listen (sock, 16) != 0))
+    {
+      perror ("quota-exporter: bind");
+      return 1;
+    }
+
+  signal (SIGPIPE, SIG_IGN);
+  if (pthread_create (&thread, NULL, scanner, NULL) != 0)
+    {
+      perror ("quota-exporter: pthread_create");
+      return 1;
+    }
+
+  for (;;)
+    {
+      int fd = accept (sock, NULL, NULL);
+
+      if (fd == -1)
+        {
+          if (errno != EINTR)
+            perror ("quota-exporter: accept");
+          continue;
+        }
+      serve (fd);
+      close (fd);
+    }
+}
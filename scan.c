@@ -0,0 +1,1076 @@
+/*
+**  Usage scanner for file systems without quotas
+**
+**  Walks a directory tree and adds up the allocated blocks and the inodes
+**  per uid, gid and project id, the way the kernel would charge them to
+**  quotas: hard links count once, and usage is in 1 KiB blocks. Results
+**  are in-memory snapshots, so that they can be looked up and compared
+**  like enumerated quota tables.
+**
+**  Directories are read with getdents64 and their entries looked up with
+**  statx relative to the directory, by a number of threads that each have
+**  a queue of directories to read. A directory is opened relative to its
+**  parent, which stays open until everything below it is done, and must
+**  still be the inode that was looked up: paths are never resolved again,
+**  so that neither their length nor renames or symbolic links swapped in
+**  during the walk can lead it elsewhere. A thread takes the newest directory of
+**  its own queue (depth first, keeping its queue short) and, when that is
+**  empty, the oldest of another thread's queue (the largest subtrees).
+**  Every thread keeps its own counts, which are merged at the end.
+**
+**  The usage tracker (tracker.c) walks trees the same way, but takes the
+**  usage of each directory's entries instead of the totals.
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Quota.h"
+#include "include/scan.h"
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(SYS_getdents64) && defined(STATX_BASIC_STATS)
+
+#define SCAN_THREADS 64
+#define SCAN_DENTS 65536 /* getdents64 buffer per thread */
+#define SCAN_MASK                                                             \
+  (STATX_TYPE | STATX_NLINK | STATX_UID | STATX_GID | STATX_INO               \
+   | STATX_BLOCKS)
+
+struct scan_dirent
+{
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+struct scan_dir
+{
+  struct scan_dir *parent;
+  long refs;  /* itself until read, and each subdirectory until done */
+  int failed; /* something below could not be read */
+  int fd;     /* -1 until read */
+  uint32_t projid;
+  uint32_t dev_major, dev_minor; /* as looked up in the parent */
+  uint64_t ino;
+  char name[];
+};
+
+/* usage of one id, in an open-addressing table */
+struct scan_usage
+{
+  uint32_t id;
+  uint32_t inuse;
+  uint64_t blocks; /* 512 byte units, as in stx_blocks */
+  uint64_t inodes;
+};
+
+struct scan_map
+{
+  struct scan_usage *slots;
+  uint32_t mask;
+  uint32_t used;
+};
+
+/* usage of the entries of one directory, for a scan_dir_fn */
+struct scan_sums
+{
+  struct scan_sum *v;
+  int n, size;
+  int last[3]; /* index of the last id added of each kind */
+  struct scan_link *links;
+  int nlinks, links_size;
+};
+
+struct scan_worker
+{
+  struct scan *scan;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  struct scan_dir **queue; /* head is stolen, tail is taken by the owner */
+  size_t head, tail, size;
+  struct scan_map maps[3];
+  struct scan_sums sums;
+  uint64_t inodes, dirs, errors;
+  char *dents;
+};
+
+struct scan
+{
+  struct scan_worker *workers;
+  int nworkers;
+  int flags;
+  scan_dir_fn fn;
+  void *fn_arg;
+  const struct scan_hooks *hooks;
+  uint32_t dev_major, dev_minor;
+  long pending; /* directories queued or being read */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int idle;
+  /* inodes with more than one link that were counted already */
+  pthread_mutex_t links_lock;
+  uint64_t *links;
+  uint32_t links_mask;
+  uint32_t links_used;
+};
+
+static int
+scan_map_add (struct scan_map *m, uint32_t id, uint64_t blocks,
+              uint64_t inodes)
+{
+  uint32_t slot;
+
+  if ((m->slots == NULL) || (m->used >= m->mask / 2))
+    {
+      uint32_t size = (m->slots == NULL) ? 256 : (m->mask + 1) * 2;
+      struct scan_usage *old = m->slots;
+      uint32_t i, oldsize = (old == NULL) ? 0 : m->mask + 1;
+
+      m->slots = calloc (size, sizeof (*m->slots));
+      if (m->slots == NULL)
+        {
+          m->slots = old;
+          return -1;
+        }
+      m->mask = size - 1;
+      m->used = 0;
+      for (i = 0; i < oldsize; i++)
+        {
+          if (old[i].inuse)
+            scan_map_add (m, old[i].id, old[i].blocks, old[i].inodes);
+        }
+      free (old);
+    }
+
+  for (slot = (id * 2654435761u) & m->mask;; slot = (slot + 1) & m->mask)
+    {
+      struct scan_usage *u = &m->slots[slot];
+
+      if (!u->inuse)
+        {
+          u->id = id;
+          u->inuse = 1;
+          m->used++;
+        }
+      if (u->id == id)
+        {
+          u->blocks += blocks;
+          u->inodes += inodes;
+          return 0;
+        }
+    }
+}
+
+/*
+ * returns 1 if the inode was seen before, 0 if not (it is now)
+ */
+static int
+scan_link_seen (struct scan *s, const struct statx *stx)
+{
+  uint64_t key = stx->stx_ino ^ ((uint64_t)stx->stx_dev_major << 52)
+                 ^ ((uint64_t)stx->stx_dev_minor << 32);
+  uint32_t slot;
+  int seen = 0;
+
+  /* 0 marks an empty slot */
+  key = (key != 0) ? key : 1;
+  pthread_mutex_lock (&s->links_lock);
+  if ((s->links == NULL) || (s->links_used >= s->links_mask / 2))
+    {
+      uint32_t size = (s->links == NULL) ? 1024 : (s->links_mask + 1) * 2;
+      uint64_t *links = calloc (size, sizeof (*links));
+      uint32_t i;
+
+      if (links == NULL)
+        {
+          /* counting it twice is better than not at all */
+          pthread_mutex_unlock (&s->links_lock);
+          return 0;
+        }
+      for (i = 0; (s->links != NULL) && (i <= s->links_mask); i++)
+        {
+          if (s->links[i] != 0)
+            {
+              for (slot = (s->links[i] * 0x9e3779b97f4a7c15ull) >> 40;
+                   links[slot & (size - 1)] != 0; slot++)
+                ;
+              links[slot & (size - 1)] = s->links[i];
+            }
+        }
+      free (s->links);
+      s->links = links;
+      s->links_mask = size - 1;
+    }
+  for (slot = (key * 0x9e3779b97f4a7c15ull) >> 40;; slot++)
+    {
+      uint64_t *l = &s->links[slot & s->links_mask];
+
+      if (*l == key)
+        {
+          seen = 1;
+          break;
+        }
+      if (*l == 0)
+        {
+          *l = key;
+          s->links_used++;
+          break;
+        }
+    }
+  pthread_mutex_unlock (&s->links_lock);
+  return seen;
+}
+
+static int
+scan_sums_add (struct scan_sums *v, int kind, uint32_t id, uint64_t blocks)
+{
+  struct scan_sum *sum;
+
+  /* the entries of a directory mostly have the same owner; last[] may be
+     left from the previous directory */
+  if ((v->last[kind] < v->n) && (v->v[v->last[kind]].kind == (uint32_t)kind)
+      && (v->v[v->last[kind]].id == id))
+    sum = &v->v[v->last[kind]];
+  else
+    {
+      if (v->n == v->size)
+        {
+          int size = (v->size == 0) ? 16 : v->size * 2;
+          struct scan_sum *n = realloc (v->v, size * sizeof (*n));
+
+          if (n == NULL)
+            return -1;
+          v->v = n;
+          v->size = size;
+        }
+      v->last[kind] = v->n;
+      sum = &v->v[v->n++];
+      sum->kind = kind;
+      sum->id = id;
+      sum->blocks = 0;
+      sum->inodes = 0;
+    }
+  sum->blocks += blocks;
+  sum->inodes++;
+  return 0;
+}
+
+static int
+scan_links_add (struct scan_sums *v, const struct statx *stx, uint32_t projid)
+{
+  struct scan_link *l;
+
+  if (v->nlinks == v->links_size)
+    {
+      int size = (v->links_size == 0) ? 16 : v->links_size * 2;
+      struct scan_link *n = realloc (v->links, size * sizeof (*n));
+
+      if (n == NULL)
+        return -1;
+      v->links = n;
+      v->links_size = size;
+    }
+  l = &v->links[v->nlinks++];
+  l->ino = stx->stx_ino;
+  l->blocks = stx->stx_blocks;
+  l->uid = stx->stx_uid;
+  l->gid = stx->stx_gid;
+  l->projid = projid;
+  l->reserved0 = 0;
+  return 0;
+}
+
+static int
+scan_link_cmp (const void *a, const void *b)
+{
+  const struct scan_link *x = a, *y = b;
+
+  return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+static int
+scan_sum_cmp (const void *a, const void *b)
+{
+  const struct scan_sum *x = a, *y = b;
+
+  if (x->kind != y->kind)
+    return (x->kind < y->kind) ? -1 : 1;
+  return (x->id < y->id) ? -1 : (x->id > y->id);
+}
+
+/*
+ * sort by kind and id, merging the entries of the same id, and the links
+ * by inode, keeping one of those in the directory twice
+ */
+static void
+scan_sums_finish (struct scan_sums *v)
+{
+  int i, n = 0;
+
+  qsort (v->links, v->nlinks, sizeof (*v->links), scan_link_cmp);
+  for (i = 0; i < v->nlinks; i++)
+    {
+      if ((n == 0) || (v->links[n - 1].ino != v->links[i].ino))
+        v->links[n++] = v->links[i];
+    }
+  v->nlinks = n;
+  n = 0;
+
+  qsort (v->v, v->n, sizeof (*v->v), scan_sum_cmp);
+  for (i = 0; i < v->n; i++)
+    {
+      if ((n > 0) && !scan_sum_cmp (&v->v[n - 1], &v->v[i]))
+        {
+          v->v[n - 1].blocks += v->v[i].blocks;
+          v->v[n - 1].inodes += v->v[i].inodes;
+        }
+      else
+        v->v[n++] = v->v[i];
+    }
+  v->n = n;
+}
+
+static int
+scan_sums_count (struct scan_sums *v, int flags, const struct statx *stx,
+                 uint32_t projid)
+{
+  int err = 0;
+
+  if (!S_ISDIR (stx->stx_mode) && (stx->stx_nlink > 1))
+    return scan_links_add (v, stx, projid);
+
+  err |= scan_sums_add (v, PHP_QUOTA_TYPE_USER, stx->stx_uid,
+                        stx->stx_blocks);
+  err |= scan_sums_add (v, PHP_QUOTA_TYPE_GROUP, stx->stx_gid,
+                        stx->stx_blocks);
+  if (flags & PHP_QUOTA_SCAN_PROJECT)
+    err |= scan_sums_add (v, PHP_QUOTA_TYPE_PROJECT, projid,
+                          stx->stx_blocks);
+  return err;
+}
+
+static void
+scan_count (struct scan_worker *w, const struct statx *stx, uint32_t projid)
+{
+  int err = 0;
+
+  if (w->scan->fn != NULL)
+    {
+      /* links are left to fn, see scan_sums_count */
+      w->inodes++;
+      if (scan_sums_count (&w->sums, w->scan->flags, stx, projid) != 0)
+        w->errors++;
+      return;
+    }
+  if (!S_ISDIR (stx->stx_mode) && (stx->stx_nlink > 1)
+      && scan_link_seen (w->scan, stx))
+    return;
+  w->inodes++;
+  err |= scan_map_add (&w->maps[PHP_QUOTA_TYPE_USER], stx->stx_uid,
+                       stx->stx_blocks, 1);
+  err |= scan_map_add (&w->maps[PHP_QUOTA_TYPE_GROUP], stx->stx_gid,
+                       stx->stx_blocks, 1);
+  if (w->scan->flags & PHP_QUOTA_SCAN_PROJECT)
+    err |= scan_map_add (&w->maps[PHP_QUOTA_TYPE_PROJECT], projid,
+                         stx->stx_blocks, 1);
+  if (err)
+    w->errors++;
+}
+
+/*
+ * project id of name in dirfd; other than regular files and directories
+ * cannot be opened safely, those keep the one of their directory
+ */
+static uint32_t
+scan_projid (int dirfd, const char *name, const struct statx *stx,
+             uint32_t projid)
+{
+#ifdef FS_IOC_FSGETXATTR
+  struct fsxattr fsx;
+  int fd;
+
+  if (!S_ISREG (stx->stx_mode) && !S_ISDIR (stx->stx_mode))
+    return projid;
+  fd = openat (dirfd, name,
+               O_RDONLY | O_NONBLOCK | O_NOFOLLOW | O_NOCTTY | O_CLOEXEC);
+  if (fd == -1)
+    return projid;
+  if (ioctl (fd, FS_IOC_FSGETXATTR, &fsx) == 0)
+    projid = fsx.fsx_projid;
+  close (fd);
+#endif
+  return projid;
+}
+
+static void
+scan_wake (struct scan *s)
+{
+  pthread_mutex_lock (&s->lock);
+  pthread_cond_broadcast (&s->cond);
+  pthread_mutex_unlock (&s->lock);
+}
+
+static void
+scan_push (struct scan_worker *w, struct scan_dir *parent, const char *name,
+           const struct statx *stx, uint32_t projid)
+{
+  size_t namelen = strlen (name);
+  struct scan_dir *d = malloc (sizeof (*d) + namelen + 1);
+
+  if (d == NULL)
+    {
+      parent->failed = 1;
+      w->errors++;
+      return;
+    }
+  d->parent = parent;
+  d->refs = 1;
+  d->failed = 0;
+  d->fd = -1;
+  d->projid = projid;
+  d->dev_major = stx->stx_dev_major;
+  d->dev_minor = stx->stx_dev_minor;
+  d->ino = stx->stx_ino;
+  memcpy (d->name, name, namelen + 1);
+
+  pthread_mutex_lock (&w->lock);
+  if ((w->tail == w->size) && (w->head > 0))
+    {
+      memmove (w->queue, w->queue + w->head,
+               (w->tail - w->head) * sizeof (*w->queue));
+      w->tail -= w->head;
+      w->head = 0;
+    }
+  if (w->tail == w->size)
+    {
+      size_t size = (w->size == 0) ? 64 : w->size * 2;
+      struct scan_dir **queue = realloc (w->queue, size * sizeof (*queue));
+
+      if (queue == NULL)
+        {
+          pthread_mutex_unlock (&w->lock);
+          free (d);
+          parent->failed = 1;
+          w->errors++;
+          return;
+        }
+      w->queue = queue;
+      w->size = size;
+    }
+  __atomic_add_fetch (&parent->refs, 1, __ATOMIC_RELAXED);
+  w->queue[w->tail++] = d;
+  __atomic_add_fetch (&w->scan->pending, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_unlock (&w->lock);
+
+  if (__atomic_load_n (&w->scan->idle, __ATOMIC_RELAXED) != 0)
+    scan_wake (w->scan);
+}
+
+static struct scan_dir *
+scan_take (struct scan_worker *w)
+{
+  struct scan *s = w->scan;
+  struct scan_dir *d = NULL;
+  int i;
+
+  pthread_mutex_lock (&w->lock);
+  if (w->tail > w->head)
+    d = w->queue[--w->tail];
+  pthread_mutex_unlock (&w->lock);
+
+  for (i = 1; (d == NULL) && (i < s->nworkers); i++)
+    {
+      struct scan_worker *v = &s->workers[(w - s->workers + i) % s->nworkers];
+
+      pthread_mutex_lock (&v->lock);
+      if (v->tail > v->head)
+        d = v->queue[v->head++];
+      pthread_mutex_unlock (&v->lock);
+    }
+  return d;
+}
+
+typedef void (*scan_entry_fn) (void *arg, int fd, const char *name,
+                               const struct statx *stx, uint32_t projid);
+
+/*
+ * Look up the entries of the directory fd and pass them to fn; with
+ * PHP_QUOTA_SCAN_XDEV only those on the file system major:minor. projid is
+ * the one of the directory. Returns the number of entries that could not
+ * be read, or -1 if the directory could not.
+ */
+static long
+scan_read (int fd, char *dents, int flags, uint32_t major, uint32_t minor,
+           uint32_t projid, scan_entry_fn fn, void *arg)
+{
+  long errors = 0;
+  long n;
+
+  while ((n = syscall (SYS_getdents64, fd, dents, SCAN_DENTS)) > 0)
+    {
+      long off;
+
+      for (off = 0; off < n;)
+        {
+          struct scan_dirent *de = (struct scan_dirent *)(dents + off);
+          const char *name = de->d_name;
+          uint32_t entprojid = projid;
+          struct statx stx;
+
+          off += de->d_reclen;
+          if ((name[0] == '.')
+              && ((name[1] == '\0')
+                  || ((name[1] == '.') && (name[2] == '\0'))))
+            continue;
+          if ((statx (fd, name,
+                      AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT
+                          | AT_STATX_DONT_SYNC,
+                      SCAN_MASK, &stx)
+               != 0)
+              || ((stx.stx_mask & SCAN_MASK) != SCAN_MASK))
+            {
+              errors++;
+              continue;
+            }
+          if ((flags & PHP_QUOTA_SCAN_XDEV)
+              && ((stx.stx_dev_major != major)
+                  || (stx.stx_dev_minor != minor)))
+            continue;
+          if (flags & PHP_QUOTA_SCAN_PROJECT)
+            entprojid = scan_projid (fd, name, &stx, projid);
+          fn (arg, fd, name, &stx, entprojid);
+        }
+    }
+  return (n < 0) ? -1 : errors;
+}
+
+struct scan_dir_ctx
+{
+  struct scan_worker *w;
+  struct scan_dir *d;
+};
+
+static void
+scan_dir_entry (void *arg, int fd, const char *name, const struct statx *stx,
+                uint32_t projid)
+{
+  struct scan_dir_ctx *ctx = arg;
+  const struct scan_hooks *hooks = ctx->w->scan->hooks;
+
+  if (hooks != NULL)
+    {
+      int r = hooks->visit (hooks->arg, fd, name, stx->stx_mode);
+
+      ctx->w->inodes++;
+      if (r < 0)
+        ctx->d->failed = 1;
+      if (r != 0)
+        return;
+    }
+  else
+    scan_count (ctx->w, stx, projid);
+  if (S_ISDIR (stx->stx_mode))
+    scan_push (ctx->w, ctx->d, name, stx, projid);
+}
+
+/* whether fd is still the inode d was looked up as */
+static int
+scan_same (int fd, const struct scan_dir *d)
+{
+  struct statx stx;
+
+  return (statx (fd, "", AT_EMPTY_PATH, STATX_INO, &stx) == 0)
+         && (stx.stx_ino == d->ino) && (stx.stx_dev_major == d->dev_major)
+         && (stx.stx_dev_minor == d->dev_minor);
+}
+
+/*
+ * open d in its parent; -1 if that fails or finds another inode than the
+ * one looked up, as when the entry was replaced meanwhile
+ */
+static int
+scan_open (struct scan_dir *d)
+{
+  int fd;
+
+  fd = openat (d->parent->fd, d->name,
+               O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if ((fd != -1) && !scan_same (fd, d))
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+static void
+scan_dir (struct scan_worker *w, struct scan_dir *d)
+{
+  struct scan *s = w->scan;
+  struct scan_dir_ctx ctx;
+  long errors;
+  int fd;
+
+  /* the root was opened by scan_run */
+  if (d->parent != NULL)
+    d->fd = scan_open (d);
+  fd = d->fd;
+  if (fd == -1)
+    {
+      d->failed = 1;
+      w->errors++;
+      return;
+    }
+  w->dirs++;
+
+  ctx.w = w;
+  ctx.d = d;
+  w->sums.n = 0;
+  w->sums.nlinks = 0;
+  memset (w->sums.last, 0, sizeof (w->sums.last));
+  errors = scan_read (fd, w->dents, s->flags, s->dev_major, s->dev_minor,
+                      d->projid, scan_dir_entry, &ctx);
+  w->errors += (errors < 0) ? 1 : errors;
+  if (errors != 0)
+    d->failed = 1;
+  if (s->fn != NULL)
+    {
+      scan_sums_finish (&w->sums);
+      s->fn (s->fn_arg, fd, d->projid, w->sums.v, w->sums.n, w->sums.links,
+             w->sums.nlinks);
+    }
+}
+
+/*
+ * drop a reference to d; the last one, once d and all below it were read,
+ * passes d to the leave hook and goes on with its parent
+ */
+static void
+scan_release (struct scan *s, struct scan_dir *d)
+{
+  while ((d != NULL) && (__atomic_sub_fetch (&d->refs, 1, __ATOMIC_ACQ_REL)
+                         == 0))
+    {
+      struct scan_dir *parent = d->parent;
+
+      if ((s->hooks != NULL) && !d->failed
+          && (s->hooks->leave (s->hooks->arg, d->fd) != 0))
+        d->failed = 1;
+      if ((parent != NULL) && d->failed)
+        __atomic_store_n (&parent->failed, 1, __ATOMIC_RELAXED);
+      /* the subdirectories were opened in it, it can go now */
+      if (d->fd != -1)
+        close (d->fd);
+      free (d);
+      d = parent;
+    }
+}
+
+static void *
+scan_worker (void *arg)
+{
+  struct scan_worker *w = arg;
+  struct scan *s = w->scan;
+  struct scan_dir *d;
+  struct timespec ts;
+
+  for (;;)
+    {
+      /* the first worker is the calling thread */
+      if ((s->hooks != NULL) && (s->hooks->tick != NULL)
+          && (w == s->workers))
+        s->hooks->tick (s->hooks->arg);
+      if ((d = scan_take (w)) != NULL)
+        {
+          scan_dir (w, d);
+          scan_release (s, d);
+          if (__atomic_sub_fetch (&s->pending, 1, __ATOMIC_ACQ_REL) == 0)
+            scan_wake (s);
+          continue;
+        }
+
+      pthread_mutex_lock (&s->lock);
+      if (__atomic_load_n (&s->pending, __ATOMIC_ACQUIRE) == 0)
+        {
+          pthread_mutex_unlock (&s->lock);
+          return NULL;
+        }
+      /* a wakeup for new work may be missed, so do not sleep for long */
+      clock_gettime (CLOCK_REALTIME, &ts);
+      ts.tv_nsec += 10000000;
+      if (ts.tv_nsec >= 1000000000)
+        {
+          ts.tv_sec++;
+          ts.tv_nsec -= 1000000000;
+        }
+      __atomic_add_fetch (&s->idle, 1, __ATOMIC_RELAXED);
+      pthread_cond_timedwait (&s->cond, &s->lock, &ts);
+      __atomic_sub_fetch (&s->idle, 1, __ATOMIC_RELAXED);
+      pthread_mutex_unlock (&s->lock);
+    }
+}
+
+/*
+ * merge the counts of kind into a snapshot; usage is rounded up to 1 KiB
+ * blocks
+ */
+static quota_snapshot *
+scan_snapshot (struct scan *s, int kind)
+{
+  struct scan_map *m = &s->workers[0].maps[kind];
+  quota_snapshot *snap = NULL;
+  unsigned int *ids;
+  query_ret *rows;
+  uint32_t i;
+  long n = 0;
+  int k;
+
+  for (k = 1; k < s->nworkers; k++)
+    {
+      struct scan_map *o = &s->workers[k].maps[kind];
+
+      for (i = 0; (o->slots != NULL) && (i <= o->mask); i++)
+        {
+          if (o->slots[i].inuse
+              && (scan_map_add (m, o->slots[i].id, o->slots[i].blocks,
+                                o->slots[i].inodes)
+                  != 0))
+            return NULL;
+        }
+    }
+
+  ids = malloc ((m->used + 1) * sizeof (*ids));
+  rows = calloc (m->used + 1, sizeof (*rows));
+  if ((ids != NULL) && (rows != NULL))
+    {
+      for (i = 0; (m->slots != NULL) && (i <= m->mask); i++)
+        {
+          if (!m->slots[i].inuse)
+            continue;
+          ids[n] = m->slots[i].id;
+          rows[n].bc = (m->slots[i].blocks + 1) / 2;
+          rows[n].fc = m->slots[i].inodes;
+          n++;
+        }
+      snap = quota_snapshot_from_rows (ids, rows, n);
+    }
+  free (ids);
+  free (rows);
+  return snap;
+}
+
+struct scan_sums_ctx
+{
+  struct scan_sums v;
+  int flags;
+  int failed;
+  scan_subdir_fn fn;
+  void *arg;
+};
+
+static void
+scan_sums_entry (void *arg, int fd, const char *name, const struct statx *stx,
+                 uint32_t projid)
+{
+  struct scan_sums_ctx *ctx = arg;
+
+  if (scan_sums_count (&ctx->v, ctx->flags, stx, projid) != 0)
+    ctx->failed = 1;
+  if ((ctx->fn != NULL) && S_ISDIR (stx->stx_mode))
+    ctx->fn (ctx->arg, fd, name, projid);
+}
+
+long
+scan_dir_sums (int fd, int flags, uint32_t projid, scan_subdir_fn fn,
+               void *arg, struct scan_sum **sums, int *n,
+               struct scan_link **links, int *nlinks)
+{
+  struct scan_sums_ctx ctx;
+  struct statx stx;
+  char *dents;
+  long errors;
+
+  *sums = NULL;
+  *n = 0;
+  *links = NULL;
+  *nlinks = 0;
+  if (statx (fd, "", AT_EMPTY_PATH, STATX_TYPE, &stx) != 0)
+    return -1;
+  dents = malloc (SCAN_DENTS);
+  if (dents == NULL)
+    return -1;
+  memset (&ctx, 0, sizeof (ctx));
+  ctx.flags = flags;
+  ctx.fn = fn;
+  ctx.arg = arg;
+  errors = scan_read (fd, dents, flags, stx.stx_dev_major, stx.stx_dev_minor,
+                      projid, scan_sums_entry, &ctx);
+  free (dents);
+  if ((errors < 0) || ctx.failed)
+    {
+      free (ctx.v.v);
+      free (ctx.v.links);
+      if (errors >= 0)
+        errno = ENOMEM;
+      return -1;
+    }
+  scan_sums_finish (&ctx.v);
+  *sums = ctx.v.v;
+  *n = ctx.v.n;
+  *links = ctx.v.links;
+  *nlinks = ctx.v.nlinks;
+  return errors;
+}
+
+static int
+scan_run (const char *path, int threads, int flags, scan_dir_fn fn,
+          void *arg, const struct scan_hooks *hooks, scan_ret *ret)
+{
+  struct scan s;
+  struct scan_dir *root;
+  struct statx stx;
+  sigset_t all, old;
+  uint32_t projid = 0;
+  int i, k;
+  int err = 0;
+
+  memset (ret, 0, sizeof (*ret));
+  if (statx (AT_FDCWD, path, AT_NO_AUTOMOUNT, SCAN_MASK, &stx) != 0)
+    return -1;
+  if (threads <= 0)
+    threads = sysconf (_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+  if (threads > SCAN_THREADS)
+    threads = SCAN_THREADS;
+
+  memset (&s, 0, sizeof (s));
+  s.flags = flags;
+  s.fn = fn;
+  s.fn_arg = arg;
+  s.hooks = hooks;
+  s.dev_major = stx.stx_dev_major;
+  s.dev_minor = stx.stx_dev_minor;
+  s.workers = calloc (threads, sizeof (*s.workers));
+  root = malloc (sizeof (*root) + 1);
+  if ((s.workers == NULL) || (root == NULL))
+    {
+      free (s.workers);
+      free (root);
+      return -1;
+    }
+  pthread_mutex_init (&s.lock, NULL);
+  pthread_cond_init (&s.cond, NULL);
+  pthread_mutex_init (&s.links_lock, NULL);
+  for (i = 0; i < threads; i++)
+    {
+      s.workers[i].scan = &s;
+      pthread_mutex_init (&s.workers[i].lock, NULL);
+    }
+
+#ifdef FS_IOC_FSGETXATTR
+  if (flags & PHP_QUOTA_SCAN_PROJECT)
+    {
+      struct fsxattr fsx;
+      int fd = open (path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+
+      if ((fd != -1) && (ioctl (fd, FS_IOC_FSGETXATTR, &fsx) == 0))
+        projid = fsx.fsx_projid;
+      if (fd != -1)
+        close (fd);
+    }
+#endif
+  /* with fn or hooks, the root is left to the caller */
+  if ((fn == NULL) && (hooks == NULL))
+    scan_count (&s.workers[0], &stx, projid);
+
+  if (S_ISDIR (stx.stx_mode))
+    {
+      root->parent = NULL;
+      root->refs = 1;
+      root->failed = 0;
+      root->projid = projid;
+      root->name[0] = '\0';
+      root->dev_major = stx.stx_dev_major;
+      root->dev_minor = stx.stx_dev_minor;
+      root->ino = stx.stx_ino;
+      /* failing here is counted by scan_dir, as for any directory */
+      root->fd = open (path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+      if ((root->fd != -1) && !scan_same (root->fd, root))
+        {
+          close (root->fd);
+          root->fd = -1;
+        }
+      s.workers[0].queue = malloc (64 * sizeof (*s.workers[0].queue));
+      if (s.workers[0].queue == NULL)
+        {
+          err = ENOMEM;
+          if (root->fd != -1)
+            close (root->fd);
+          free (root);
+          goto done;
+        }
+      s.workers[0].size = 64;
+      s.workers[0].queue[s.workers[0].tail++] = root;
+      s.pending = 1;
+    }
+  else
+    free (root);
+
+  /* the workers inherit the signal mask, see qpool.c */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &old);
+  s.nworkers = 1;
+  for (i = 0; i < threads; i++)
+    {
+      s.workers[i].dents = malloc (SCAN_DENTS);
+      if (s.workers[i].dents == NULL)
+        break;
+      if ((i > 0)
+          && (pthread_create (&s.workers[i].thread, NULL, scan_worker,
+                              &s.workers[i])
+              != 0))
+        {
+          free (s.workers[i].dents);
+          s.workers[i].dents = NULL;
+          break;
+        }
+      s.nworkers = i + 1;
+    }
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  if (s.workers[0].dents == NULL)
+    err = ENOMEM;
+  else
+    scan_worker (&s.workers[0]);
+  for (i = 1; i < s.nworkers; i++)
+    pthread_join (s.workers[i].thread, NULL);
+  quota_trace_poll ();
+
+  for (k = 0; (err == 0) && (fn == NULL) && (hooks == NULL) && (k < 3);
+       k++)
+    {
+      if ((k == PHP_QUOTA_TYPE_PROJECT) && !(flags & PHP_QUOTA_SCAN_PROJECT))
+        continue;
+      ret->snaps[k] = scan_snapshot (&s, k);
+      if (ret->snaps[k] == NULL)
+        err = ENOMEM;
+    }
+  for (i = 0; i < s.nworkers; i++)
+    {
+      ret->inodes += s.workers[i].inodes;
+      ret->dirs += s.workers[i].dirs;
+      ret->errors += s.workers[i].errors;
+    }
+
+done:
+  for (i = 0; i < threads; i++)
+    {
+      /* left over only if the scan did not run */
+      while (s.workers[i].tail > s.workers[i].head)
+        {
+          struct scan_dir *d = s.workers[i].queue[--s.workers[i].tail];
+
+          if (d->fd != -1)
+            close (d->fd);
+          free (d);
+        }
+      free (s.workers[i].queue);
+      free (s.workers[i].dents);
+      free (s.workers[i].sums.v);
+      free (s.workers[i].sums.links);
+      for (k = 0; k < 3; k++)
+        free (s.workers[i].maps[k].slots);
+      pthread_mutex_destroy (&s.workers[i].lock);
+    }
+  free (s.workers);
+  free (s.links);
+  pthread_mutex_destroy (&s.links_lock);
+  pthread_cond_destroy (&s.cond);
+  pthread_mutex_destroy (&s.lock);
+  if (err != 0)
+    {
+      for (k = 0; k < 3; k++)
+        {
+          quota_snapshot_close (ret->snaps[k]);
+          ret->snaps[k] = NULL;
+        }
+      errno = err;
+      return -1;
+    }
+  errno = 0;
+  return 0;
+}
+
+int
+scan_tree (const char *path, int threads, int flags, scan_dir_fn fn,
+           void *arg, scan_ret *ret)
+{
+  return scan_run (path, threads, flags, fn, arg, NULL, ret);
+}
+
+int
+scan_walk (const char *path, int threads, int flags,
+           const struct scan_hooks *hooks, scan_ret *ret)
+{
+  return scan_run (path, threads, flags, NULL, NULL, hooks, ret);
+}
+
+#else /* !SYS_getdents64 || !STATX_BASIC_STATS */
+
+long
+scan_dir_sums (int fd, int flags, uint32_t projid, scan_subdir_fn fn,
+               void *arg, struct scan_sum **sums, int *n,
+               struct scan_link **links, int *nlinks)
+{
+  *sums = NULL;
+  *n = 0;
+  *links = NULL;
+  *nlinks = 0;
+  errno = ENOTSUP;
+  return -1;
+}
+
+int
+scan_tree (const char *path, int threads, int flags, scan_dir_fn fn,
+           void *arg, scan_ret *ret)
+{
+  memset (ret, 0, sizeof (*ret));
+  errno = ENOTSUP;
+  return -1;
+}
+
+int
+scan_walk (const char *path, int threads, int flags,
+           const struct scan_hooks *hooks, scan_ret *ret)
+{
+  memset (ret, 0, sizeof (*ret));
+  errno = ENOTSUP;
+  return -1;
+}
+
+#endif
+
+int
+quota_scan (char *path, int threads, int flags, scan_ret *ret)
+{
+  return scan_tree (path, threads, flags, NULL, NULL, ret);
+}
@@ -0,0 +1,131 @@
+/*
+**  Coalescing of concurrent identical queries
+**
+**  The first thread to query a given key (device or host:path), id and
+**  kind becomes the leader of the call and runs the query; threads asking
+**  for the same entry while it is in flight wait for it and share its
+**  result, including the error. Nothing is kept once the call is done, so
+**  a query that starts after the leader has finished always sees fresh
+**  values.
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Quota.h"
+#include "include/singleflight.h"
+
+#define SF_BUCKETS 64
+
+struct sf_call
+{
+  struct sf_call *next;
+  unsigned int bucket;
+  int id;
+  int kind;
+  int done;
+  int refs; /* leader plus waiting threads */
+  pthread_cond_t cond;
+  query_ret ret;
+  int err;
+  const char *rpcerr;
+  char key[];
+};
+
+static pthread_mutex_t sf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sf_call *sf_calls[SF_BUCKETS];
+
+static unsigned int
+sf_hash (const char *key, int id, int kind)
+{
+  unsigned int h = 2166136261u;
+
+  for (; *key != '\0'; key++)
+    h = (h ^ (unsigned char)*key) * 16777619u;
+  h = (h ^ (unsigned int)id) * 16777619u;
+  h = (h ^ (unsigned int)kind) * 16777619u;
+  return h % SF_BUCKETS;
+}
+
+static void
+sf_put (struct sf_call *call)
+{
+  if (--call->refs == 0)
+    {
+      pthread_cond_destroy (&call->cond);
+      free (call);
+    }
+}
+
+/*
+ * Returns 1 if the caller has to run the query and then pass the result to
+ * singleflight_leave (*call may be NULL if no memory was left, then the
+ * query simply is not shared), or 0 if ret, err and rpcerr hold the result
+ * of a concurrent call.
+ */
+int
+singleflight_enter (const char *key, int id, int kind, struct sf_call **call,
+                    query_ret *ret, int *err, const char **rpcerr)
+{
+  unsigned int bucket = sf_hash (key, id, kind);
+  struct sf_call *c;
+
+  pthread_mutex_lock (&sf_lock);
+  for (c = sf_calls[bucket]; c != NULL; c = c->next)
+    {
+      if ((c->id == id) && (c->kind == kind) && !strcmp (c->key, key))
+        break;
+    }
+  if (c != NULL)
+    {
+      c->refs++;
+      while (!c->done)
+        pthread_cond_wait (&c->cond, &sf_lock);
+      *ret = c->ret;
+      *err = c->err;
+      *rpcerr = c->rpcerr;
+      sf_put (c);
+      pthread_mutex_unlock (&sf_lock);
+      return 0;
+    }
+
+  c = malloc (sizeof (*c) + strlen (key) + 1);
+  if (c != NULL)
+    {
+      strcpy (c->key, key);
+      c->bucket = bucket;
+      c->id = id;
+      c->kind = kind;
+      c->done = 0;
+      c->refs = 1;
+      pthread_cond_init (&c->cond, NULL);
+      c->next = sf_calls[bucket];
+      sf_calls[bucket] = c;
+    }
+  pthread_mutex_unlock (&sf_lock);
+  *call = c;
+  return 1;
+}
+
+void
+singleflight_leave (struct sf_call *call, const query_ret *ret, int err,
+                    const char *rpcerr)
+{
+  struct sf_call **p;
+
+  if (call == NULL)
+    return;
+
+  pthread_mutex_lock (&sf_lock);
+  for (p = &sf_calls[call->bucket]; *p != call; p = &(*p)->next)
+    ;
+  *p = call->next;
+  call->ret = *ret;
+  call->err = err;
+  call->rpcerr = rpcerr;
+  call->done = 1;
+  pthread_cond_broadcast (&call->cond);
+  sf_put (call);
+  pthread_mutex_unlock (&sf_lock);
+}
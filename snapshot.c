@@ -0,0 +1,384 @@
+/*
+**  Columnar point-in-time snapshots of a quota table
+**
+**  File layout (version 1, host byte order, all offsets 8-byte aligned):
+**
+**    header   64 bytes, see struct snapshot_header
+**    ids      count x uint32, strictly ascending, zero padded to 8 bytes
+**    columns  8 x (count x uint64), in the order bc bs bh bt fc fs fh ft
+**
+**  Readers map the file and use the columns in place: opening a snapshot
+**  only validates the header, and lookups binary search the id column.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Quota.h"
+#include "include/snapshot.h"
+
+#define SNAPSHOT_MAGIC "PQSNAP\0\0"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BOM 0x01020304
+
+struct snapshot_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t bom; /* byte order mark, SNAPSHOT_BOM in the writer's order */
+  uint64_t count;
+  uint64_t created;
+  uint32_t kind;
+  uint32_t reserved0;
+  uint64_t reserved[3];
+};
+
+#define SNAPSHOT_IDS_SIZE(N) ((((N) * sizeof (uint32_t)) + 7) & ~(size_t)7)
+#define SNAPSHOT_SIZE(N)                                                      \
+  (sizeof (struct snapshot_header) + SNAPSHOT_IDS_SIZE (N)                    \
+   + SNAPSHOT_COLUMNS * (N) * sizeof (uint64_t))
+
+/*
+ * point ids and cols into the data following the header
+ */
+static void
+snapshot_layout (quota_snapshot *snap, char *base)
+{
+  char *p = base + sizeof (struct snapshot_header);
+  int i;
+
+  snap->ids = (const uint32_t *)p;
+  p += SNAPSHOT_IDS_SIZE (snap->count);
+  for (i = 0; i < SNAPSHOT_COLUMNS; i++)
+    {
+      snap->cols[i] = (const uint64_t *)p;
+      p += snap->count * sizeof (uint64_t);
+    }
+}
+
+long
+quota_snapshot_write (char *dev, quota_type kind, char *path)
+{
+  struct snapshot_header *hdr;
+  dump_record rec;
+  FILE *spill;
+  char *tmppath = NULL;
+  char *map = MAP_FAILED;
+  size_t maplen = 0;
+  unsigned int id = 0;
+  long count = 0;
+  long i;
+  int fd = -1;
+  int ret;
+
+  /*
+   * The number of entries is only known after the enumeration, so rows are
+   * spilled to a temporary file first and then scattered into the columns.
+   */
+  spill = tmpfile ();
+  if (spill == NULL)
+    return -1;
+
+  while ((ret = quota_query_next (dev, &id, kind, &rec.q)) == 0)
+    {
+      rec.id = id;
+      rec.kind = kind;
+      if (fwrite (&rec, sizeof (rec), 1, spill) != 1)
+        {
+          ret = -1;
+          break;
+        }
+      count++;
+      if (id == (unsigned int)-1)
+        break;
+      id++;
+    }
+  if ((ret < 0) || (fflush (spill) != 0) || (fseek (spill, 0, SEEK_SET) != 0))
+    goto failure;
+
+  tmppath = malloc (strlen (path) + 5);
+  if (tmppath == NULL)
+    goto failure;
+  sprintf (tmppath, "%s.new", path);
+
+  maplen = SNAPSHOT_SIZE (count);
+  fd = open (tmppath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if ((fd == -1) || (ftruncate (fd, maplen) != 0))
+    goto failure;
+  map = mmap (NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto failure;
+
+  {
+    quota_snapshot snap;
+    uint32_t *ids;
+    uint64_t *cols[SNAPSHOT_COLUMNS];
+
+    snap.count = count;
+    snapshot_layout (&snap, map);
+    ids = (uint32_t *)snap.ids;
+    for (i = 0; i < SNAPSHOT_COLUMNS; i++)
+      cols[i] = (uint64_t *)snap.cols[i];
+
+    for (i = 0; i < count; i++)
+      {
+        if (fread (&rec, sizeof (rec), 1, spill) != 1)
+          goto failure;
+        if ((i > 0) && (rec.id <= ids[i - 1]))
+          {
+            /* lookups rely on a strictly ascending id column */
+            errno = EINVAL;
+            goto failure;
+          }
+        ids[i] = rec.id;
+        cols[0][i] = rec.q.bc;
+        cols[1][i] = rec.q.bs;
+        cols[2][i] = rec.q.bh;
+        cols[3][i] = rec.q.bt;
+        cols[4][i] = rec.q.fc;
+        cols[5][i] = rec.q.fs;
+        cols[6][i] = rec.q.fh;
+        cols[7][i] = rec.q.ft;
+      }
+  }
+
+  /* header last, so that a torn write is never taken for a valid file */
+  hdr = (struct snapshot_header *)map;
+  memcpy (hdr->magic, SNAPSHOT_MAGIC, sizeof (hdr->magic));
+  hdr->version = SNAPSHOT_VERSION;
+  hdr->bom = SNAPSHOT_BOM;
+  hdr->count = count;
+  hdr->created = time (NULL);
+  hdr->kind = kind;
+
+  if ((munmap (map, maplen) != 0) || (fsync (fd) != 0))
+    {
+      map = MAP_FAILED;
+      goto failure;
+    }
+  map = MAP_FAILED;
+  if ((close (fd) != 0) || (rename (tmppath, path) != 0))
+    {
+      fd = -1;
+      goto failure;
+    }
+
+  free (tmppath);
+  fclose (spill);
+  errno = 0;
+  return count;
+
+failure:
+  ret = errno;
+  if (map != MAP_FAILED)
+    munmap (map, maplen);
+  if (fd != -1)
+    close (fd);
+  if (tmppath != NULL)
+    {
+      unlink (tmppath);
+      free (tmppath);
+    }
+  fclose (spill);
+  errno = (ret != 0) ? ret : EIO;
+  return -1;
+}
+
+quota_snapshot *
+quota_snapshot_open (char *path)
+{
+  const struct snapshot_header *hdr;
+  quota_snapshot *snap;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open (path, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+  if (fstat (fd, &st) != 0)
+    {
+      close (fd);
+      return NULL;
+    }
+  if (st.st_size < (off_t)sizeof (struct snapshot_header))
+    {
+      close (fd);
+      errno = EINVAL;
+      return NULL;
+    }
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  hdr = map;
+  if (memcmp (hdr->magic, SNAPSHOT_MAGIC, sizeof (hdr->magic))
+      || (hdr->version != SNAPSHOT_VERSION) || (hdr->bom != SNAPSHOT_BOM)
+      || (SNAPSHOT_SIZE (hdr->count) != (size_t)st.st_size))
+    {
+      munmap (map, st.st_size);
+      errno = EINVAL;
+      return NULL;
+    }
+
+  snap = malloc (sizeof (*snap));
+  if (snap == NULL)
+    {
+      munmap (map, st.st_size);
+      return NULL;
+    }
+  snap->map = map;
+  snap->maplen = st.st_size;
+  snap->count = hdr->count;
+  snap->kind = hdr->kind;
+  snapshot_layout (snap, map);
+  return snap;
+}
+
+static int
+snapshot_row_cmp (const void *a, const void *b)
+{
+  uint32_t ia = ((const dump_record *)a)->id;
+  uint32_t ib = ((const dump_record *)b)->id;
+
+  return (ia > ib) - (ia < ib);
+}
+
+quota_snapshot *
+quota_snapshot_from_rows (unsigned int *ids, query_ret *rows, long n)
+{
+  quota_snapshot *snap;
+  dump_record *sorted;
+  uint32_t *sids;
+  uint64_t *cols[SNAPSHOT_COLUMNS];
+  long i;
+  int c;
+
+  snap = malloc (sizeof (*snap));
+  if (snap == NULL)
+    return NULL;
+  snap->maplen = 0;
+  snap->count = n;
+  snap->kind = 0;
+  snap->map = malloc (SNAPSHOT_SIZE (n));
+  sorted = malloc ((n > 0 ? n : 1) * sizeof (*sorted));
+  if ((snap->map == NULL) || (sorted == NULL))
+    goto failure;
+
+  for (i = 0; i < n; i++)
+    {
+      sorted[i].id = ids[i];
+      sorted[i].q = rows[i];
+    }
+  qsort (sorted, n, sizeof (*sorted), snapshot_row_cmp);
+
+  snapshot_layout (snap, snap->map);
+  sids = (uint32_t *)snap->ids;
+  for (c = 0; c < SNAPSHOT_COLUMNS; c++)
+    cols[c] = (uint64_t *)snap->cols[c];
+  for (i = 0; i < n; i++)
+    {
+      if ((i > 0) && (sorted[i].id == sids[i - 1]))
+        {
+          errno = EINVAL;
+          goto failure;
+        }
+      sids[i] = sorted[i].id;
+      cols[0][i] = sorted[i].q.bc;
+      cols[1][i] = sorted[i].q.bs;
+      cols[2][i] = sorted[i].q.bh;
+      cols[3][i] = sorted[i].q.bt;
+      cols[4][i] = sorted[i].q.fc;
+      cols[5][i] = sorted[i].q.fs;
+      cols[6][i] = sorted[i].q.fh;
+      cols[7][i] = sorted[i].q.ft;
+    }
+
+  free (sorted);
+  return snap;
+
+failure:
+  free (snap->map);
+  free (snap);
+  free (sorted);
+  return NULL;
+}
+
+long
+quota_snapshot_count (quota_snapshot *snap)
+{
+  return snap->count;
+}
+
+/*
+ * index of id in the id column, or -1
+ */
+long
+snapshot_find (const quota_snapshot *snap, unsigned int id)
+{
+  long lo = 0;
+  long hi = snap->count;
+
+  while (lo < hi)
+    {
+      long mid = lo + (hi - lo) / 2;
+
+      if (snap->ids[mid] < id)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  return ((lo < snap->count) && (snap->ids[lo] == id)) ? lo : -1;
+}
+
+int
+quota_snapshot_entry (quota_snapshot *snap, long idx, unsigned int *id,
+                      query_ret *ret)
+{
+  if ((idx < 0) || (idx >= snap->count))
+    {
+      errno = EINVAL;
+      return -1;
+    }
+  *id = snap->ids[idx];
+  ret->bc = snap->cols[0][idx];
+  ret->bs = snap->cols[1][idx];
+  ret->bh = snap->cols[2][idx];
+  ret->bt = snap->cols[3][idx];
+  ret->fc = snap->cols[4][idx];
+  ret->fs = snap->cols[5][idx];
+  ret->fh = snap->cols[6][idx];
+  ret->ft = snap->cols[7][idx];
+  return 0;
+}
+
+int
+quota_snapshot_lookup (quota_snapshot *snap, unsigned int id, query_ret *ret)
+{
+  unsigned int found;
+  long idx = snapshot_find (snap, id);
+
+  if (idx < 0)
+    return 1;
+  return quota_snapshot_entry (snap, idx, &found, ret);
+}
+
+void
+quota_snapshot_close (quota_snapshot *snap)
+{
+  if (snap == NULL)
+    return;
+  if (snap->maplen != 0)
+    munmap (snap->map, snap->maplen);
+  else
+    free (snap->map);
+  free (snap);
+}
@@ -0,0 +1,189 @@
+/*
+**  Operation counters and latency histograms
+**
+**  Every thread counts into a slab of its own, so the hot path is a few
+**  plain stores with no locking and no shared cache lines. quota_stats
+**  sums all slabs. Slabs of exited threads are kept (with their counts)
+**  and handed to new threads.
+**
+**  quota_stats_reset cannot clear counters it does not own; it records the
+**  current totals as a baseline that quota_stats subtracts instead.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Quota.h"
+#include "include/quotastat.h"
+
+struct stat_slab
+{
+  struct stat_slab *next;
+  int inuse;
+  quota_op_stats ops[PHP_QUOTA_OP_COUNT];
+};
+
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stat_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stat_key;
+static struct stat_slab *stat_slabs;
+static quota_op_stats stat_base[PHP_QUOTA_OP_COUNT];
+
+static __thread struct stat_slab *stat_mine;
+
+static void
+stat_release (void *arg)
+{
+  struct stat_slab *slab = arg;
+
+  pthread_mutex_lock (&stat_lock);
+  slab->inuse = 0;
+  pthread_mutex_unlock (&stat_lock);
+}
+
+static void
+stat_init (void)
+{
+  pthread_key_create (&stat_key, stat_release);
+}
+
+static struct stat_slab *
+stat_slab (void)
+{
+  struct stat_slab *slab;
+
+  pthread_once (&stat_once, stat_init);
+  pthread_mutex_lock (&stat_lock);
+  for (slab = stat_slabs; slab != NULL; slab = slab->next)
+    {
+      if (!slab->inuse)
+        break;
+    }
+  if (slab == NULL)
+    {
+      slab = calloc (1, sizeof (*slab));
+      if (slab != NULL)
+        {
+          slab->next = stat_slabs;
+          __atomic_store_n (&stat_slabs, slab, __ATOMIC_RELEASE);
+        }
+    }
+  if (slab != NULL)
+    slab->inuse = 1;
+  pthread_mutex_unlock (&stat_lock);
+
+  if (slab != NULL)
+    pthread_setspecific (stat_key, slab);
+  return slab;
+}
+
+/* single writer per slab: a relaxed load and store, no read-modify-write */
+#define STAT_ADD(field, n)                                                    \
+  __atomic_store_n (&(field), __atomic_load_n (&(field), __ATOMIC_RELAXED)   \
+                                  + (n),                                      \
+                    __ATOMIC_RELAXED)
+
+uint64_t
+quotastat_start (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+quotastat_end (int op, uint64_t start, int err, int rpcstat)
+{
+  uint64_t us = (quotastat_start () - start) / 1000;
+  quota_op_stats *st;
+  int bucket = 0;
+  int saved = errno;
+
+  if (stat_mine == NULL)
+    {
+      stat_mine = stat_slab ();
+      errno = saved;
+      if (stat_mine == NULL)
+        return;
+    }
+  st = &stat_mine->ops[op];
+
+  /* bucket i counts calls of less than 2^i microseconds */
+  while ((bucket < PHP_QUOTA_STAT_BUCKETS - 1) && (us >> bucket) != 0)
+    bucket++;
+
+  STAT_ADD (st->calls, 1);
+  STAT_ADD (st->total_us, us);
+  STAT_ADD (st->latency[bucket], 1);
+  if (err >= 0)
+    {
+      STAT_ADD (st->errors, 1);
+      if (err >= PHP_QUOTA_STAT_ERRNOS)
+        err = PHP_QUOTA_STAT_ERRNOS - 1;
+      STAT_ADD (st->errnos[err], 1);
+    }
+  if (rpcstat > 0)
+    {
+      if (rpcstat >= PHP_QUOTA_STAT_RPCSTATS)
+        rpcstat = PHP_QUOTA_STAT_RPCSTATS - 1;
+      STAT_ADD (st->rpc_status[rpcstat], 1);
+    }
+}
+
+/*
+ * sum of all slabs; the fields of quota_op_stats are all uint64_t
+ */
+static void
+stat_sum (quota_op_stats *out)
+{
+  struct stat_slab *slab;
+  size_t words
+      = PHP_QUOTA_OP_COUNT * (sizeof (quota_op_stats) / sizeof (uint64_t));
+  size_t i;
+
+  memset (out, 0, PHP_QUOTA_OP_COUNT * sizeof (*out));
+  for (slab = __atomic_load_n (&stat_slabs, __ATOMIC_ACQUIRE); slab != NULL;
+       slab = slab->next)
+    {
+      uint64_t *src = (uint64_t *)slab->ops;
+      uint64_t *dst = (uint64_t *)out;
+
+      for (i = 0; i < words; i++)
+        dst[i] += __atomic_load_n (&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+int
+quota_stats (quota_op_stats *out, int n)
+{
+  quota_op_stats sum[PHP_QUOTA_OP_COUNT];
+  size_t words = sizeof (quota_op_stats) / sizeof (uint64_t);
+  size_t i;
+  int op;
+
+  pthread_mutex_lock (&stat_lock);
+  stat_sum (sum);
+  for (op = 0; (op < n) && (op < PHP_QUOTA_OP_COUNT); op++)
+    {
+      uint64_t *src = (uint64_t *)&sum[op];
+      uint64_t *base = (uint64_t *)&stat_base[op];
+      uint64_t *dst = (uint64_t *)&out[op];
+
+      for (i = 0; i < words; i++)
+        dst[i] = src[i] - base[i];
+    }
+  pthread_mutex_unlock (&stat_lock);
+  return PHP_QUOTA_OP_COUNT;
+}
+
+void
+quota_stats_reset (void)
+{
+  pthread_mutex_lock (&stat_lock);
+  stat_sum (stat_base);
+  pthread_mutex_unlock (&stat_lock);
+}
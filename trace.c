@@ -0,0 +1,255 @@
+/*
+**  Tracing hooks and slow-op log for backend calls
+**
+**  The QUOTA_TRACE macro (include/quotatrace.h) wraps every quotactl,
+**  clnt_call, host lookup and mount table read. While no callback and no
+**  slow-op log is set, it only tests quota_trace_flags; otherwise the
+**  functions below time the call and pass it on.
+**
+**  The callback only runs on the thread that set it, as the PHP binding
+**  cannot be entered from others. Events of other threads (the query pool,
+**  scan workers) are queued, up to TRACE_QUEUE, and delivered at the next
+**  event of that thread, when the calls that run workers return, or from
+**  quota_trace_poll.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Quota.h"
+#include "include/quotatrace.h"
+
+int quota_trace_flags;
+
+/*
+ * set from one thread, read by any; the hooks copy what they use, so that
+ * a concurrent quota_trace_set at worst skips one event
+ */
+static quota_trace_fn trace_fn;
+static void *trace_arg;
+static uint64_t slowlog_ns;
+static int slowlog_fd = -1;
+
+#define TRACE_QUEUE 1024
+
+/* an event of another thread, with its own copy of the target */
+struct trace_queued
+{
+  trace_event ev;
+  char target[256];
+};
+
+/* the thread that set trace_fn, and the events waiting for it */
+static pthread_t trace_thread;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_queued *trace_queue;
+static size_t trace_head, trace_count;
+
+static const char *const trace_names[] = {
+  "quotactl",
+  "clnt_call",
+  "hostlookup",
+  "mnttab",
+};
+
+static uint64_t
+trace_now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+trace_update_flags (void)
+{
+  int flags = 0;
+
+  if (trace_fn != NULL)
+    flags |= QUOTA_TRACE_CALLBACK;
+  if ((slowlog_ns != 0) && (slowlog_fd != -1))
+    flags |= QUOTA_TRACE_SLOWLOG;
+  __atomic_store_n (&quota_trace_flags, flags, __ATOMIC_RELEASE);
+}
+
+int
+quota_trace_set (quota_trace_fn fn, void *arg)
+{
+  struct trace_queued *queue = NULL;
+
+  if ((fn != NULL) && (trace_queue == NULL))
+    {
+      queue = malloc (TRACE_QUEUE * sizeof (*queue));
+      if (queue == NULL)
+        return -1;
+    }
+  pthread_mutex_lock (&trace_lock);
+  if (queue != NULL)
+    trace_queue = queue;
+  else if (fn == NULL)
+    {
+      /* events for the old callback are gone with it */
+      free (trace_queue);
+      trace_queue = NULL;
+    }
+  trace_head = trace_count = 0;
+  trace_thread = pthread_self ();
+  trace_arg = arg;
+  trace_fn = fn;
+  pthread_mutex_unlock (&trace_lock);
+  trace_update_flags ();
+  return 0;
+}
+
+void
+quota_trace_poll (void)
+{
+  struct trace_queued q;
+
+  if ((trace_fn == NULL) || !pthread_equal (pthread_self (), trace_thread))
+    return;
+  for (;;)
+    {
+      quota_trace_fn fn;
+      void *arg;
+
+      /* one at a time, as the callback may cause more */
+      pthread_mutex_lock (&trace_lock);
+      if ((trace_count == 0) || (trace_fn == NULL))
+        {
+          pthread_mutex_unlock (&trace_lock);
+          return;
+        }
+      q = trace_queue[trace_head];
+      trace_head = (trace_head + 1) % TRACE_QUEUE;
+      trace_count--;
+      fn = trace_fn;
+      arg = trace_arg;
+      pthread_mutex_unlock (&trace_lock);
+
+      q.ev.target = q.target;
+      fn (&q.ev, arg);
+    }
+}
+
+/*
+ * run the callback on the thread that set it, queue the event otherwise;
+ * events beyond TRACE_QUEUE are dropped
+ */
+static void
+trace_deliver (quota_trace_fn fn, trace_event *ev)
+{
+  struct trace_queued *q;
+
+  if (pthread_equal (pthread_self (), trace_thread))
+    {
+      quota_trace_poll ();
+      fn (ev, trace_arg);
+      return;
+    }
+  pthread_mutex_lock (&trace_lock);
+  if ((trace_queue != NULL) && (trace_count < TRACE_QUEUE))
+    {
+      q = &trace_queue[(trace_head + trace_count) % TRACE_QUEUE];
+      q->ev = *ev;
+      q->ev.target = NULL;
+      snprintf (q->target, sizeof (q->target), "%s", ev->target);
+      trace_count++;
+    }
+  pthread_mutex_unlock (&trace_lock);
+}
+
+int
+quota_slowlog_set (uint64_t threshold_us, int fd)
+{
+  slowlog_ns = threshold_us * 1000;
+  slowlog_fd = fd;
+  trace_update_flags ();
+  return 0;
+}
+
+void
+trace_enter (struct trace_ctx *ctx, int point, const char *target, long id,
+             long cmd)
+{
+  quota_trace_fn fn = trace_fn;
+
+  ctx->point = point;
+  ctx->target = (target != NULL) ? target : "";
+  ctx->id = id;
+  ctx->cmd = cmd;
+  if (fn != NULL)
+    {
+      trace_event ev;
+
+      memset (&ev, 0, sizeof (ev));
+      ev.point = point;
+      ev.phase = PHP_QUOTA_TRACE_ENTRY;
+      ev.target = ctx->target;
+      ev.id = id;
+      ev.cmd = cmd;
+      trace_deliver (fn, &ev);
+    }
+  /* so that err on exit is the call's own, not a stale value */
+  errno = 0;
+  ctx->start = trace_now ();
+}
+
+static void
+trace_slowlog (const struct trace_ctx *ctx, int fd, uint64_t ns, long ret,
+               int err)
+{
+  char line[512];
+  struct tm tm;
+  time_t now = time (NULL);
+  int len;
+
+  localtime_r (&now, &tm);
+  len = strftime (line, sizeof (line), "%Y-%m-%dT%H:%M:%S", &tm);
+  len += snprintf (line + len, sizeof (line) - len,
+                   " libquota slow %s target=%s id=%ld cmd=%#lx %.3f ms "
+                   "ret=%ld errno=%d\n",
+                   trace_names[ctx->point], ctx->target, ctx->id, ctx->cmd,
+                   ns / 1e6, ret, err);
+  if (len >= (int)sizeof (line))
+    {
+      len = sizeof (line);
+      line[len - 1] = '\n';
+    }
+  /* one write per line, so that lines of concurrent threads stay whole */
+  if (write (fd, line, len) < 0)
+    return;
+}
+
+void
+trace_exit (struct trace_ctx *ctx, long ret, int err)
+{
+  uint64_t ns = trace_now () - ctx->start;
+  quota_trace_fn fn = trace_fn;
+  int fd = slowlog_fd;
+
+  if (fn != NULL)
+    {
+      trace_event ev;
+
+      memset (&ev, 0, sizeof (ev));
+      ev.point = ctx->point;
+      ev.phase = PHP_QUOTA_TRACE_EXIT;
+      ev.target = ctx->target;
+      ev.id = ctx->id;
+      ev.cmd = ctx->cmd;
+      ev.ret = ret;
+      ev.err = err;
+      ev.duration_ns = ns;
+      trace_deliver (fn, &ev);
+    }
+  if ((fd != -1) && (slowlog_ns != 0) && (ns >= slowlog_ns))
+    trace_slowlog (ctx, fd, ns, ret, err);
+  errno = err;
+}
@@ -0,0 +1,1548 @@
+/*
+**  Incremental usage tracking with fanotify
+**
+**  A tracker takes the usage below a directory per uid, gid and project
+**  id once, with the walk of quota_scan, and then keeps it current from
+**  the fanotify events of its file system. It remembers the usage of the
+**  entries of every directory, keyed by the directory's file handle; an
+**  event in a directory makes it re-read that directory alone and apply
+**  the difference to the totals. New subtrees (mkdir, moves into the tree)
+**  are walked when their parent is re-read, subtrees moved out of the
+**  tree are dropped.
+**
+**  The totals are kept in a state file that quota_query reads for devices
+**  named "(TRACK)<state file>"; the directories are saved next to it, so
+**  that a restart only has to re-read directories that changed meanwhile
+**  (by their ctime). Writes to existing files while no tracker ran are
+**  only seen once their directory changes.
+**
+**  Hard links count once, as with quota_scan: files with more than one
+**  link are left out of the usage of the directories and listed by inode
+**  in their records instead. A table of those inodes counts the records
+**  listing each and charges it while there are any, with the owner and
+**  size it was last read with; it is rebuilt from the records on a
+**  restart. A tracker follows a single file system, so the inode number
+**  alone identifies them. The kernel reports a new link to a file without
+**  the directory of its other one, so a file that had a single link stays
+**  in the usage of that directory, and is counted twice, until it changes.
+**
+**  State file layout (version 1, host byte order):
+**
+**    header   64 bytes, see struct track_header
+**    totals   slots x struct track_total
+**
+**  Directory file (state file name + ".dirs", version 2):
+**
+**    header   64 bytes, see struct track_dirs_header
+**    records  struct track_rec, handle (padded to 8 bytes), nsums x
+**             struct scan_sum, nlinks x struct scan_link
+**
+**  Trackers need CAP_SYS_ADMIN (fanotify file system marks) and
+**  CAP_DAC_READ_SEARCH (open_by_handle_at); the state file can be read by
+**  anyone who may open it.
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Quota.h"
+#include "include/scan.h"
+#include "include/tracker.h"
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <poll.h>
+#include <sys/fanotify.h>
+#include <sys/ioctl.h>
+#endif
+
+#define TRACK_MAGIC "PQTRACK\0"
+#define TRACK_DIRS_MAGIC "PQTRDIRS"
+#define TRACK_VERSION 1
+#define TRACK_DIRS_VERSION 2 /* 1 charged hard links to every directory */
+#define TRACK_BOM 0x01020304
+
+struct track_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t bom;
+  uint32_t slots; /* power of two */
+  uint32_t used;
+  uint64_t updated; /* time of the last change */
+  uint64_t reserved[4];
+};
+
+/*
+ * Written by the tracker only. kind is the quota kind + 1, 0 for an
+ * unused slot; it is set last, so that readers see complete entries.
+ */
+struct track_total
+{
+  uint32_t id;
+  uint32_t kind;
+  uint64_t blocks; /* 512 byte units */
+  uint64_t inodes;
+};
+
+static uint32_t
+track_slot (uint32_t id, int kind, uint32_t mask)
+{
+  return (id * 2654435761u + kind * 0x9e3779b9u) & mask;
+}
+
+static struct track_total *
+track_find (struct track_header *hdr, uint32_t id, int kind)
+{
+  struct track_total *totals = (struct track_total *)(hdr + 1);
+  uint32_t mask = hdr->slots - 1;
+  uint32_t slot = track_slot (id, kind, mask);
+  uint32_t n;
+
+  for (n = 0; n <= mask; n++, slot = (slot + 1) & mask)
+    {
+      uint32_t k = __atomic_load_n (&totals[slot].kind, __ATOMIC_ACQUIRE);
+
+      if (k == 0)
+        break;
+      if ((k == (uint32_t)kind + 1) && (totals[slot].id == id))
+        return &totals[slot];
+    }
+  return NULL;
+}
+
+/*
+ * map a state file for reading; its size is checked against the header
+ */
+static struct track_header *
+track_map (const char *state, size_t *maplen)
+{
+  struct track_header hdr;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open (state, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+  if ((fstat (fd, &st) != 0) || (st.st_size < (off_t)sizeof (hdr))
+      || (pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr))
+      || memcmp (hdr.magic, TRACK_MAGIC, sizeof (hdr.magic))
+      || (hdr.version != TRACK_VERSION) || (hdr.bom != TRACK_BOM)
+      || (st.st_size
+          != (off_t)(sizeof (hdr)
+                     + (off_t)hdr.slots * sizeof (struct track_total))))
+    {
+      close (fd);
+      errno = EINVAL;
+      return NULL;
+    }
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return NULL;
+  *maplen = st.st_size;
+  return map;
+}
+
+static void
+track_fill (query_ret *ret, const struct track_total *t)
+{
+  memset (ret, 0, sizeof (*ret));
+  if (t == NULL)
+    return;
+  /* as quota_scan: in 1 KiB blocks */
+  ret->bc = (__atomic_load_n (&t->blocks, __ATOMIC_RELAXED) + 1) / 2;
+  ret->fc = __atomic_load_n (&t->inodes, __ATOMIC_RELAXED);
+}
+
+int
+tracker_query (const char *state, int id, int kind, query_ret *ret)
+{
+  struct track_header *hdr;
+  size_t maplen;
+
+  memset (ret, 0, sizeof (*ret));
+  hdr = track_map (state, &maplen);
+  if (hdr == NULL)
+    return -1;
+  track_fill (ret, track_find (hdr, id, kind));
+  munmap (hdr, maplen);
+  return 0;
+}
+
+/*
+ * An enumeration with tracker_query_next maps the state file once and
+ * sorts the ids of its kind, so that each call is a binary search. Slots
+ * are only ever added, so the order is built again only when the number
+ * of used slots changed, or for a new enumeration (from id 0), another
+ * file or kind. The totals themselves are read from the mapping.
+ */
+struct track_order
+{
+  uint32_t id;
+  uint32_t slot;
+};
+
+struct track_iter
+{
+  char *state;
+  struct track_header *hdr;
+  size_t maplen;
+  int kind;
+  uint32_t used;
+  struct track_order *order;
+  uint32_t n;
+};
+
+static __thread struct track_iter track_iter;
+
+static void
+track_iter_end (struct track_iter *it)
+{
+  if (it->hdr != NULL)
+    munmap (it->hdr, it->maplen);
+  free (it->order);
+  free (it->state);
+  memset (it, 0, sizeof (*it));
+}
+
+static int
+track_order_cmp (const void *a, const void *b)
+{
+  const struct track_order *x = a, *y = b;
+
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+static int
+track_iter_start (struct track_iter *it, const char *state, int kind)
+{
+  struct track_total *totals;
+  uint32_t i;
+
+  track_iter_end (it);
+  it->state = strdup (state);
+  if (it->state == NULL)
+    return -1;
+  it->hdr = track_map (state, &it->maplen);
+  if (it->hdr == NULL)
+    {
+      track_iter_end (it);
+      return -1;
+    }
+  it->kind = kind;
+  it->used = __atomic_load_n (&it->hdr->used, __ATOMIC_ACQUIRE);
+  it->order = malloc ((it->used + 1) * sizeof (*it->order));
+  if (it->order == NULL)
+    {
+      track_iter_end (it);
+      return -1;
+    }
+  totals = (struct track_total *)(it->hdr + 1);
+  /* slots added since used was read are picked up by the next rebuild */
+  for (i = 0; (i < it->hdr->slots) && (it->n < it->used); i++)
+    {
+      if (__atomic_load_n (&totals[i].kind, __ATOMIC_ACQUIRE)
+          == (uint32_t)kind + 1)
+        {
+          it->order[it->n].id = totals[i].id;
+          it->order[it->n].slot = i;
+          it->n++;
+        }
+    }
+  qsort (it->order, it->n, sizeof (*it->order), track_order_cmp);
+  return 0;
+}
+
+int
+tracker_query_next (const char *state, unsigned int *id, int kind,
+                    query_ret *ret)
+{
+  struct track_iter *it = &track_iter;
+  uint32_t lo, hi;
+
+  if ((*id == 0) || (it->hdr == NULL) || (it->kind != kind)
+      || strcmp (it->state, state)
+      || (__atomic_load_n (&it->hdr->used, __ATOMIC_ACQUIRE) != it->used))
+    {
+      if (track_iter_start (it, state, kind) != 0)
+        return -1;
+    }
+
+  /* first id >= *id */
+  lo = 0;
+  hi = it->n;
+  while (lo < hi)
+    {
+      uint32_t mid = lo + (hi - lo) / 2;
+
+      if (it->order[mid].id < *id)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  if (lo == it->n)
+    {
+      track_iter_end (it);
+      return 1;
+    }
+  *id = it->order[lo].id;
+  track_fill (ret, (struct track_total *)(it->hdr + 1) + it->order[lo].slot);
+  return 0;
+}
+
+#if defined(FAN_REPORT_DFID_NAME) && defined(STATX_BASIC_STATS)
+
+#define TRACK_EVENTS                                                          \
+  (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_MODIFY       \
+   | FAN_ATTRIB | FAN_DELETE_SELF | FAN_ONDIR)
+#define TRACK_BUFSIZE 65536
+#define TRACK_READS 64 /* buffers read per run, so a busy tree still flushes */
+#define TRACK_DEPTH 4096 /* parent links followed at most */
+
+struct track_dirs_header
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t bom;
+  uint64_t count;
+  uint64_t root;  /* key of the tracked directory */
+  uint32_t flags; /* PHP_QUOTA_SCAN_PROJECT */
+  uint32_t reserved0;
+  uint64_t reserved[3];
+};
+
+struct track_rec
+{
+  uint64_t key;
+  uint64_t parent;
+  uint64_t ctime; /* ns */
+  uint32_t projid;
+  uint32_t nsums;
+  int32_t htype;
+  uint32_t hlen;
+  uint32_t nlinks;
+  uint32_t reserved0;
+};
+
+struct track_dir
+{
+  struct track_dir *next;
+  int dirty;
+  int drop;
+  struct track_rec rec;
+  struct scan_sum *sums;
+  struct scan_link *links;
+  unsigned char handle[];
+};
+
+/* a file with more than one link, charged once for all records listing it */
+struct track_link
+{
+  struct track_link *next;
+  uint64_t refs;
+  struct scan_link l;
+};
+
+union track_handle
+{
+  struct file_handle fh;
+  char buf[sizeof (struct file_handle) + MAX_HANDLE_SZ];
+};
+
+struct quota_tracker
+{
+  pthread_mutex_t lock; /* records, while scan_tree runs */
+  char *dirs_path;
+  struct track_header *hdr;
+  size_t maplen;
+  int fan;
+  int rootfd;
+  uint64_t root;
+  int flags;
+  int threads;
+  struct track_dir **buckets;
+  size_t nbuckets;
+  size_t ndirs;
+  struct track_link **link_buckets;
+  size_t nlink_buckets;
+  size_t nlinks;
+  uint64_t *dirty; /* keys of the directories to re-read */
+  size_t ndirty, dirty_size;
+  uint64_t errors;
+  char *events;
+};
+
+static uint64_t
+track_key (int type, const unsigned char *handle, unsigned int len)
+{
+  uint64_t h = 14695981039346656037ull;
+  unsigned int i;
+
+  h = (h ^ (uint32_t)type) * 1099511628211ull;
+  for (i = 0; i < len; i++)
+    h = (h ^ handle[i]) * 1099511628211ull;
+  return (h != 0) ? h : 1;
+}
+
+/*
+ * key of name in fd (of fd itself for ""), or 0
+ */
+static uint64_t
+track_name_key (int fd, const char *name, union track_handle *h)
+{
+  int mnt;
+
+  h->fh.handle_bytes = MAX_HANDLE_SZ;
+  if (name_to_handle_at (fd, name, &h->fh, &mnt,
+                         (*name == '\0') ? AT_EMPTY_PATH : 0)
+      != 0)
+    return 0;
+  return track_key (h->fh.handle_type, h->fh.f_handle, h->fh.handle_bytes);
+}
+
+static struct track_dir *
+track_dir_find (quota_tracker *t, uint64_t key)
+{
+  struct track_dir *d;
+
+  for (d = t->buckets[key % t->nbuckets]; d != NULL; d = d->next)
+    {
+      if (d->rec.key == key)
+        return d;
+    }
+  return NULL;
+}
+
+/*
+ * add a delta to a total; the tracker is its only writer
+ */
+static void
+track_add (quota_tracker *t, int kind, uint32_t id, int64_t blocks,
+           int64_t inodes)
+{
+  struct track_total *totals = (struct track_total *)(t->hdr + 1);
+  struct track_total *e = track_find (t->hdr, id, kind);
+
+  if ((blocks == 0) && (inodes == 0))
+    return;
+  if (e == NULL)
+    {
+      uint32_t mask = t->hdr->slots - 1;
+      uint32_t slot = track_slot (id, kind, mask);
+
+      if (t->hdr->used >= t->hdr->slots)
+        {
+          t->errors++;
+          return;
+        }
+      while (totals[slot].kind != 0)
+        slot = (slot + 1) & mask;
+      e = &totals[slot];
+      e->id = id;
+      e->blocks = 0;
+      e->inodes = 0;
+      __atomic_store_n (&e->kind, kind + 1, __ATOMIC_RELEASE);
+      t->hdr->used++;
+    }
+  __atomic_store_n (&e->blocks, e->blocks + blocks, __ATOMIC_RELAXED);
+  __atomic_store_n (&e->inodes, e->inodes + inodes, __ATOMIC_RELAXED);
+}
+
+/*
+ * apply the change of a directory's usage from a to b (both sorted) to
+ * the totals, one net delta per id
+ */
+static void
+track_apply (quota_tracker *t, const struct scan_sum *a, int na,
+             const struct scan_sum *b, int nb)
+{
+  int i = 0, j = 0;
+
+  while ((i < na) || (j < nb))
+    {
+      int c;
+
+      if (i == na)
+        c = 1;
+      else if (j == nb)
+        c = -1;
+      else if (a[i].kind != b[j].kind)
+        c = (a[i].kind < b[j].kind) ? -1 : 1;
+      else
+        c = (a[i].id < b[j].id) ? -1 : (a[i].id > b[j].id);
+
+      if (c < 0)
+        {
+          track_add (t, a[i].kind, a[i].id, -(int64_t)a[i].blocks,
+                     -(int64_t)a[i].inodes);
+          i++;
+        }
+      else if (c > 0)
+        {
+          track_add (t, b[j].kind, b[j].id, b[j].blocks, b[j].inodes);
+          j++;
+        }
+      else
+        {
+          track_add (t, a[i].kind, a[i].id, b[j].blocks - a[i].blocks,
+                     b[j].inodes - a[i].inodes);
+          i++;
+          j++;
+        }
+    }
+  t->hdr->updated = time (NULL);
+}
+
+/*
+ * add (sign 1) or take back (-1) the usage of a file with more than one
+ * link
+ */
+static void
+track_charge (quota_tracker *t, const struct scan_link *l, int sign)
+{
+  int64_t blocks = sign * (int64_t)l->blocks;
+
+  track_add (t, PHP_QUOTA_TYPE_USER, l->uid, blocks, sign);
+  track_add (t, PHP_QUOTA_TYPE_GROUP, l->gid, blocks, sign);
+  if (t->flags & PHP_QUOTA_SCAN_PROJECT)
+    track_add (t, PHP_QUOTA_TYPE_PROJECT, l->projid, blocks, sign);
+}
+
+/* where ino is in the table, or would be added */
+static struct track_link **
+track_link_find (quota_tracker *t, uint64_t ino)
+{
+  struct track_link **p;
+
+  for (p = &t->link_buckets[ino % t->nlink_buckets]; *p != NULL;
+       p = &(*p)->next)
+    {
+      if ((*p)->l.ino == ino)
+        break;
+    }
+  return p;
+}
+
+static int
+track_link_grow (quota_tracker *t)
+{
+  size_t nbuckets = (t->nlink_buckets == 0) ? 1024 : t->nlink_buckets * 2;
+  struct track_link **buckets = calloc (nbuckets, sizeof (*buckets));
+  size_t i;
+
+  if (buckets == NULL)
+    return -1;
+  for (i = 0; i < t->nlink_buckets; i++)
+    {
+      struct track_link *l, *next;
+
+      for (l = t->link_buckets[i]; l != NULL; l = next)
+        {
+          next = l->next;
+          l->next = buckets[l->l.ino % nbuckets];
+          buckets[l->l.ino % nbuckets] = l;
+        }
+    }
+  free (t->link_buckets);
+  t->link_buckets = buckets;
+  t->nlink_buckets = nbuckets;
+  return 0;
+}
+
+/*
+ * a record lists l now; a file that was read again may have changed
+ * owner or size, which moves its charge
+ */
+static void
+track_link_ref (quota_tracker *t, const struct scan_link *l, int add)
+{
+  struct track_link **p, *e;
+
+  if ((t->nlinks >= t->nlink_buckets) && add && (track_link_grow (t) != 0))
+    {
+      t->errors++;
+      return;
+    }
+  if (t->nlink_buckets == 0)
+    return;
+  p = track_link_find (t, l->ino);
+  e = *p;
+  if (e == NULL)
+    {
+      if (!add)
+        return;
+      e = malloc (sizeof (*e));
+      if (e == NULL)
+        {
+          t->errors++;
+          return;
+        }
+      e->next = NULL;
+      e->refs = 0;
+      e->l = *l;
+      track_charge (t, l, 1);
+      *p = e;
+      t->nlinks++;
+    }
+  else if (memcmp (&e->l, l, sizeof (*l)))
+    {
+      track_charge (t, &e->l, -1);
+      e->l = *l;
+      track_charge (t, &e->l, 1);
+    }
+  if (add)
+    e->refs++;
+}
+
+/* a record no longer lists ino; the last one takes back its charge */
+static void
+track_link_unref (quota_tracker *t, uint64_t ino)
+{
+  struct track_link **p, *e;
+
+  if (t->nlink_buckets == 0)
+    return;
+  p = track_link_find (t, ino);
+  e = *p;
+  if ((e == NULL) || (--e->refs > 0))
+    return;
+  track_charge (t, &e->l, -1);
+  *p = e->next;
+  free (e);
+  t->nlinks--;
+}
+
+/*
+ * apply the change of a directory's links from a to b (both sorted by
+ * inode) to the table
+ */
+static void
+track_apply_links (quota_tracker *t, const struct scan_link *a, int na,
+                   const struct scan_link *b, int nb)
+{
+  int i = 0, j = 0;
+
+  while ((i < na) || (j < nb))
+    {
+      if ((j == nb) || ((i < na) && (a[i].ino < b[j].ino)))
+        track_link_unref (t, a[i++].ino);
+      else if ((i == na) || (b[j].ino < a[i].ino))
+        track_link_ref (t, &b[j++], 1);
+      else
+        {
+          track_link_ref (t, &b[j++], 0);
+          i++;
+        }
+    }
+}
+
+static void
+track_links_clear (quota_tracker *t)
+{
+  size_t i;
+
+  for (i = 0; i < t->nlink_buckets; i++)
+    {
+      struct track_link *l, *next;
+
+      for (l = t->link_buckets[i]; l != NULL; l = next)
+        {
+          next = l->next;
+          free (l);
+        }
+      t->link_buckets[i] = NULL;
+    }
+  t->nlinks = 0;
+}
+
+static void
+track_dir_free (struct track_dir *d)
+{
+  free (d->sums);
+  free (d->links);
+  free (d);
+}
+
+static int
+track_grow (quota_tracker *t)
+{
+  size_t nbuckets = t->nbuckets * 2;
+  struct track_dir **buckets = calloc (nbuckets, sizeof (*buckets));
+  size_t i;
+
+  if (buckets == NULL)
+    return -1;
+  for (i = 0; i < t->nbuckets; i++)
+    {
+      struct track_dir *d, *next;
+
+      for (d = t->buckets[i]; d != NULL; d = next)
+        {
+          next = d->next;
+          d->next = buckets[d->rec.key % nbuckets];
+          buckets[d->rec.key % nbuckets] = d;
+        }
+    }
+  free (t->buckets);
+  t->buckets = buckets;
+  t->nbuckets = nbuckets;
+  return 0;
+}
+
+/*
+ * store a directory record, taking sums and links; without handle, the
+ * one of the existing record is kept
+ */
+static int
+track_dir_set (quota_tracker *t, const struct track_rec *rec,
+               const unsigned char *handle, struct scan_sum *sums,
+               struct scan_link *links)
+{
+  struct track_dir *d = track_dir_find (t, rec->key);
+
+  if ((d == NULL) && (handle == NULL))
+    {
+      free (sums);
+      free (links);
+      errno = ENOENT;
+      return -1;
+    }
+  if (d == NULL)
+    {
+      if ((t->ndirs >= t->nbuckets) && (track_grow (t) != 0))
+        {
+          free (sums);
+          free (links);
+          return -1;
+        }
+      d = malloc (sizeof (*d) + rec->hlen);
+      if (d == NULL)
+        {
+          free (sums);
+          free (links);
+          return -1;
+        }
+      d->dirty = 0;
+      d->drop = 0;
+      d->rec = *rec;
+      d->rec.nsums = 0;
+      d->rec.nlinks = 0;
+      d->sums = NULL;
+      d->links = NULL;
+      memcpy (d->handle, handle, rec->hlen);
+      d->next = t->buckets[rec->key % t->nbuckets];
+      t->buckets[rec->key % t->nbuckets] = d;
+      t->ndirs++;
+    }
+
+  track_apply (t, d->sums, d->rec.nsums, sums, rec->nsums);
+  track_apply_links (t, d->links, d->rec.nlinks, links, rec->nlinks);
+  free (d->sums);
+  free (d->links);
+  d->sums = sums;
+  d->links = links;
+  d->rec.parent = rec->parent;
+  d->rec.ctime = rec->ctime;
+  d->rec.projid = rec->projid;
+  d->rec.nsums = rec->nsums;
+  d->rec.nlinks = rec->nlinks;
+  return 0;
+}
+
+static void
+track_dir_drop (quota_tracker *t, struct track_dir *d)
+{
+  struct track_dir **p;
+
+  for (p = &t->buckets[d->rec.key % t->nbuckets]; *p != d; p = &(*p)->next)
+    ;
+  *p = d->next;
+  t->ndirs--;
+  track_apply (t, d->sums, d->rec.nsums, NULL, 0);
+  track_apply_links (t, d->links, d->rec.nlinks, NULL, 0);
+  track_dir_free (d);
+}
+
+/*
+ * drop the directory key and every directory below it; the records only
+ * know their parents, so all of them are checked before any is dropped
+ */
+static void
+track_drop_tree (quota_tracker *t, uint64_t key)
+{
+  struct track_dir *d, *next;
+  size_t i;
+
+  for (i = 0; i < t->nbuckets; i++)
+    {
+      for (d = t->buckets[i]; d != NULL; d = d->next)
+        {
+          struct track_dir *a = d;
+          int n;
+
+          for (n = 0; (a != NULL) && (n < TRACK_DEPTH); n++)
+            {
+              if (a->rec.key == key)
+                {
+                  d->drop = 1;
+                  break;
+                }
+              a = (a->rec.key == t->root) ? NULL
+                                           : track_dir_find (t, a->rec.parent);
+            }
+        }
+    }
+  for (i = 0; i < t->nbuckets; i++)
+    {
+      for (d = t->buckets[i]; d != NULL; d = next)
+        {
+          next = d->next;
+          if (d->drop)
+            track_dir_drop (t, d);
+        }
+    }
+}
+
+/*
+ * forget all directories and totals
+ */
+static void
+track_clear (quota_tracker *t)
+{
+  struct track_total *totals = (struct track_total *)(t->hdr + 1);
+  struct track_dir *d, *next;
+  size_t i;
+
+  for (i = 0; i < t->nbuckets; i++)
+    {
+      for (d = t->buckets[i]; d != NULL; d = next)
+        {
+          next = d->next;
+          track_dir_free (d);
+        }
+      t->buckets[i] = NULL;
+    }
+  t->ndirs = 0;
+  track_links_clear (t);
+  for (i = 0; i < t->hdr->slots; i++)
+    {
+      __atomic_store_n (&totals[i].blocks, 0, __ATOMIC_RELAXED);
+      __atomic_store_n (&totals[i].inodes, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static uint64_t
+track_ctime (const struct statx *stx)
+{
+  return stx->stx_ctime.tv_sec * 1000000000ull + stx->stx_ctime.tv_nsec;
+}
+
+/*
+ * scan_dir_fn of the walks: store the usage of the entries of fd
+ */
+static void
+track_scan_dir (void *arg, int fd, uint32_t projid,
+                const struct scan_sum *sums, int n,
+                const struct scan_link *links, int nlinks)
+{
+  quota_tracker *t = arg;
+  union track_handle h, ph;
+  struct scan_sum *copy = NULL;
+  struct scan_link *lcopy = NULL;
+  struct track_rec rec;
+  struct statx stx;
+
+  memset (&rec, 0, sizeof (rec));
+  rec.key = track_name_key (fd, "", &h);
+  rec.parent = track_name_key (fd, "..", &ph);
+  if ((rec.key == 0) || (statx (fd, "", AT_EMPTY_PATH, STATX_CTIME, &stx) != 0)
+      || ((n > 0) && ((copy = malloc (n * sizeof (*copy))) == NULL))
+      || ((nlinks > 0)
+          && ((lcopy = malloc (nlinks * sizeof (*lcopy))) == NULL)))
+    {
+      free (copy);
+      pthread_mutex_lock (&t->lock);
+      t->errors++;
+      pthread_mutex_unlock (&t->lock);
+      return;
+    }
+  if (n > 0)
+    memcpy (copy, sums, n * sizeof (*copy));
+  if (nlinks > 0)
+    memcpy (lcopy, links, nlinks * sizeof (*lcopy));
+  rec.ctime = track_ctime (&stx);
+  rec.projid = projid;
+  rec.nsums = n;
+  rec.nlinks = nlinks;
+  rec.htype = h.fh.handle_type;
+  rec.hlen = h.fh.handle_bytes;
+
+  pthread_mutex_lock (&t->lock);
+  if (track_dir_set (t, &rec, h.fh.f_handle, copy, lcopy) != 0)
+    t->errors++;
+  pthread_mutex_unlock (&t->lock);
+}
+
+/*
+ * walk the tree below name in fd into the records
+ */
+static void
+track_walk (quota_tracker *t, int fd, const char *name)
+{
+  char path[64 + NAME_MAX];
+  scan_ret ret;
+
+  /* the walk opens paths; this one stays valid wherever fd was moved */
+  snprintf (path, sizeof (path), "/proc/self/fd/%d/%s", fd, name);
+  if (scan_tree (path, t->threads, t->flags | PHP_QUOTA_SCAN_XDEV,
+                 track_scan_dir, t, &ret)
+      != 0)
+    t->errors++;
+  else
+    t->errors += ret.errors;
+}
+
+struct track_subdirs
+{
+  quota_tracker *t;
+  uint64_t key;
+  char **names; /* subdirectories without a record */
+  int n, size;
+};
+
+static void
+track_subdir (void *arg, int fd, const char *name, uint32_t projid)
+{
+  struct track_subdirs *sd = arg;
+  union track_handle h;
+  struct track_dir *d;
+  uint64_t key = track_name_key (fd, name, &h);
+
+  if (key == 0)
+    return;
+  d = track_dir_find (sd->t, key);
+  if (d != NULL)
+    {
+      /* moved here */
+      d->rec.parent = sd->key;
+      return;
+    }
+  if (sd->n == sd->size)
+    {
+      int size = (sd->size == 0) ? 8 : sd->size * 2;
+      char **names = realloc (sd->names, size * sizeof (*names));
+
+      if (names == NULL)
+        {
+          sd->t->errors++;
+          return;
+        }
+      sd->names = names;
+      sd->size = size;
+    }
+  if ((sd->names[sd->n] = strdup (name)) != NULL)
+    sd->n++;
+}
+
+static uint32_t
+track_projid (int fd, uint32_t projid)
+{
+#ifdef FS_IOC_FSGETXATTR
+  struct fsxattr fsx;
+
+  if (ioctl (fd, FS_IOC_FSGETXATTR, &fsx) == 0)
+    projid = fsx.fsx_projid;
+#endif
+  return projid;
+}
+
+/*
+ * Read a directory again and apply the change; drop it (and what is
+ * below) if it is gone or was moved out of the tree, and walk new
+ * subdirectories. Returns 1 if the directory was read, 0 if not.
+ */
+static int
+track_reread (quota_tracker *t, struct track_dir *d, int force)
+{
+  struct track_subdirs sd;
+  struct scan_sum *sums;
+  struct scan_link *links;
+  struct track_rec rec;
+  union track_handle h;
+  struct statx stx;
+  uint64_t parent;
+  int fd, i, n, nlinks;
+
+  h.fh.handle_bytes = d->rec.hlen;
+  h.fh.handle_type = d->rec.htype;
+  memcpy (h.fh.f_handle, d->handle, d->rec.hlen);
+  fd = open_by_handle_at (t->rootfd, &h.fh,
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    {
+      if ((errno == ESTALE) || (errno == ENOENT))
+        track_drop_tree (t, d->rec.key);
+      else
+        t->errors++;
+      return 0;
+    }
+
+  parent = track_name_key (fd, "..", &h);
+  if ((d->rec.key != t->root) && (track_dir_find (t, parent) == NULL))
+    {
+      close (fd);
+      track_drop_tree (t, d->rec.key);
+      return 0;
+    }
+  if (statx (fd, "", AT_EMPTY_PATH, STATX_CTIME, &stx) != 0)
+    {
+      close (fd);
+      t->errors++;
+      return 0;
+    }
+  if (!force && (track_ctime (&stx) == d->rec.ctime))
+    {
+      close (fd);
+      return 0;
+    }
+
+  rec = d->rec;
+  rec.parent = parent;
+  rec.ctime = track_ctime (&stx);
+  if (t->flags & PHP_QUOTA_SCAN_PROJECT)
+    rec.projid = track_projid (fd, rec.projid);
+  memset (&sd, 0, sizeof (sd));
+  sd.t = t;
+  sd.key = d->rec.key;
+  if (scan_dir_sums (fd, t->flags | PHP_QUOTA_SCAN_XDEV, rec.projid,
+                     track_subdir, &sd, &sums, &n, &links, &nlinks)
+      < 0)
+    t->errors++;
+  else
+    {
+      rec.nsums = n;
+      rec.nlinks = nlinks;
+      track_dir_set (t, &rec, NULL, sums, links);
+    }
+
+  for (i = 0; i < sd.n; i++)
+    {
+      track_walk (t, fd, sd.names[i]);
+      free (sd.names[i]);
+    }
+  free (sd.names);
+  close (fd);
+  return 1;
+}
+
+static void
+track_mark (quota_tracker *t, uint64_t key)
+{
+  struct track_dir *d = track_dir_find (t, key);
+
+  if ((d == NULL) || d->dirty)
+    return;
+  if (t->ndirty == t->dirty_size)
+    {
+      size_t size = (t->dirty_size == 0) ? 256 : t->dirty_size * 2;
+      uint64_t *dirty = realloc (t->dirty, size * sizeof (*dirty));
+
+      if (dirty == NULL)
+        {
+          t->errors++;
+          return;
+        }
+      t->dirty = dirty;
+      t->dirty_size = size;
+    }
+  d->dirty = 1;
+  t->dirty[t->ndirty++] = key;
+}
+
+static void
+track_mark_all (quota_tracker *t)
+{
+  size_t i;
+  struct track_dir *d;
+
+  for (i = 0; i < t->nbuckets; i++)
+    {
+      for (d = t->buckets[i]; d != NULL; d = d->next)
+        track_mark (t, d->rec.key);
+    }
+}
+
+/* Move events name the directory only by its old parent, so each subdirectory
+   of that parent checks on re-read whether it is still in the tree. */
+static void
+track_mark_children (quota_tracker *t, uint64_t parent)
+{
+  size_t i;
+  struct track_dir *d;
+
+  for (i = 0; i < t->nbuckets; i++)
+    {
+      for (d = t->buckets[i]; d != NULL; d = d->next)
+        if (d->rec.parent == parent)
+          track_mark (t, d->rec.key);
+    }
+}
+
+/*
+ * re-read the marked directories; returns how many were read
+ */
+static int
+track_flush (quota_tracker *t, int force)
+{
+  int count = 0;
+  size_t i;
+
+  /* re-reads may mark more, or drop marked ones */
+  for (i = 0; i < t->ndirty; i++)
+    {
+      struct track_dir *d = track_dir_find (t, t->dirty[i]);
+
+      if (d == NULL)
+        continue;
+      d->dirty = 0;
+      count += track_reread (t, d, force);
+    }
+  t->ndirty = 0;
+  return count;
+}
+
+static void
+track_event (quota_tracker *t, struct fanotify_event_metadata *ev)
+{
+  uint64_t dir = 0, obj = 0;
+  char *p = (char *)(ev + 1);
+  char *end = (char *)ev + ev->event_len;
+
+  if (ev->mask & FAN_Q_OVERFLOW)
+    {
+      track_mark_all (t);
+      return;
+    }
+  while (p + sizeof (struct fanotify_event_info_header) <= end)
+    {
+      struct fanotify_event_info_fid *fid
+          = (struct fanotify_event_info_fid *)p;
+      struct file_handle *fh = (struct file_handle *)fid->handle;
+
+      if (fid->hdr.len == 0)
+        break;
+      if ((fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME)
+          || (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID))
+        dir = track_key (fh->handle_type, fh->f_handle, fh->handle_bytes);
+      else if (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_FID)
+        obj = track_key (fh->handle_type, fh->f_handle, fh->handle_bytes);
+      p += fid->hdr.len;
+    }
+
+  /* an entry of dir changed */
+  if (dir != 0)
+    track_mark (t, dir);
+  if ((dir != 0) && (ev->mask & FAN_ONDIR) && (ev->mask & FAN_MOVED_FROM))
+    track_mark_children (t, dir);
+  if ((ev->mask & FAN_ONDIR) && (obj != 0))
+    {
+      struct track_dir *d = track_dir_find (t, obj);
+
+      if (d == NULL)
+        return;
+      if (ev->mask & FAN_DELETE_SELF)
+        track_drop_tree (t, obj);
+      else
+        {
+          /* its parent holds its own usage; a move is checked on re-read */
+          track_mark (t, d->rec.parent);
+          track_mark (t, obj);
+        }
+    }
+}
+
+int
+quota_tracker_run (quota_tracker *t, int timeout)
+{
+  struct fanotify_event_metadata *ev;
+  struct pollfd pfd;
+  ssize_t len = 0;
+  int reads;
+
+  pfd.fd = t->fan;
+  pfd.events = POLLIN;
+  if ((poll (&pfd, 1, timeout) < 0) && (errno != EINTR))
+    return -1;
+
+  for (reads = 0; reads < TRACK_READS; reads++)
+    {
+      if ((len = read (t->fan, t->events, TRACK_BUFSIZE)) <= 0)
+        break;
+      ev = (struct fanotify_event_metadata *)t->events;
+      for (; FAN_EVENT_OK (ev, len); ev = FAN_EVENT_NEXT (ev, len))
+        {
+          if (ev->vers != FANOTIFY_METADATA_VERSION)
+            continue;
+          track_event (t, ev);
+          if (ev->fd >= 0)
+            close (ev->fd);
+        }
+    }
+  if ((reads < TRACK_READS) && (len < 0) && (errno != EAGAIN)
+      && (errno != EINTR))
+    return -1;
+
+  errno = 0;
+  return track_flush (t, 1);
+}
+
+int
+quota_tracker_fd (quota_tracker *t)
+{
+  return t->fan;
+}
+
+int
+quota_tracker_save (quota_tracker *t)
+{
+  static const char pad[8];
+  struct track_dirs_header hdr;
+  char *tmp;
+  FILE *f;
+  size_t i;
+
+  tmp = malloc (strlen (t->dirs_path) + 5);
+  if (tmp == NULL)
+    return -1;
+  sprintf (tmp, "%s.tmp", t->dirs_path);
+  f = fopen (tmp, "we");
+  if (f == NULL)
+    {
+      free (tmp);
+      return -1;
+    }
+
+  memset (&hdr, 0, sizeof (hdr));
+  memcpy (hdr.magic, TRACK_DIRS_MAGIC, sizeof (hdr.magic));
+  hdr.version = TRACK_DIRS_VERSION;
+  hdr.bom = TRACK_BOM;
+  hdr.count = t->ndirs;
+  hdr.root = t->root;
+  hdr.flags = t->flags & PHP_QUOTA_SCAN_PROJECT;
+  fwrite (&hdr, sizeof (hdr), 1, f);
+  for (i = 0; i < t->nbuckets; i++)
+    {
+      struct track_dir *d;
+
+      for (d = t->buckets[i]; d != NULL; d = d->next)
+        {
+          fwrite (&d->rec, sizeof (d->rec), 1, f);
+          fwrite (d->handle, 1, d->rec.hlen, f);
+          fwrite (pad, 1, -d->rec.hlen & 7, f);
+          fwrite (d->sums, sizeof (*d->sums), d->rec.nsums, f);
+          fwrite (d->links, sizeof (*d->links), d->rec.nlinks, f);
+        }
+    }
+  if ((fflush (f) != 0) || ferror (f) || (fsync (fileno (f)) != 0))
+    {
+      fclose (f);
+      unlink (tmp);
+      free (tmp);
+      return -1;
+    }
+  fclose (f);
+  if (rename (tmp, t->dirs_path) != 0)
+    {
+      unlink (tmp);
+      free (tmp);
+      return -1;
+    }
+  free (tmp);
+  errno = 0;
+  return 0;
+}
+
+/*
+ * Load the directories of a previous tracker of the same tree. The totals
+ * are then rebuilt from them, and the directories that changed meanwhile
+ * re-read. Returns 0 if there were none to load.
+ */
+static int
+track_load (quota_tracker *t)
+{
+  struct track_dirs_header hdr;
+  struct track_rec rec;
+  unsigned char handle[MAX_HANDLE_SZ + 8];
+  uint64_t i;
+  FILE *f;
+
+  f = fopen (t->dirs_path, "re");
+  if (f == NULL)
+    return 0;
+  if ((fread (&hdr, sizeof (hdr), 1, f) != 1)
+      || memcmp (hdr.magic, TRACK_DIRS_MAGIC, sizeof (hdr.magic))
+      || (hdr.version != TRACK_DIRS_VERSION) || (hdr.bom != TRACK_BOM)
+      || (hdr.root != t->root)
+      || (hdr.flags != (uint32_t)(t->flags & PHP_QUOTA_SCAN_PROJECT)))
+    {
+      fclose (f);
+      return 0;
+    }
+
+  /* the totals are rebuilt from the directories */
+  track_clear (t);
+  for (i = 0; i < hdr.count; i++)
+    {
+      struct scan_sum *sums = NULL;
+      struct scan_link *links = NULL;
+
+      if ((fread (&rec, sizeof (rec), 1, f) != 1) || (rec.hlen > MAX_HANDLE_SZ)
+          || (fread (handle, 1, (rec.hlen + 7) & ~7u, f)
+              != ((rec.hlen + 7) & ~7u))
+          || ((rec.nsums > 0)
+              && (((sums = malloc (rec.nsums * sizeof (*sums))) == NULL)
+                  || (fread (sums, sizeof (*sums), rec.nsums, f)
+                      != rec.nsums)))
+          || ((rec.nlinks > 0)
+              && (((links = malloc (rec.nlinks * sizeof (*links))) == NULL)
+                  || (fread (links, sizeof (*links), rec.nlinks, f)
+                      != rec.nlinks))))
+        {
+          free (sums);
+          free (links);
+          break;
+        }
+      if (track_dir_set (t, &rec, handle, sums, links) != 0)
+        break;
+    }
+  fclose (f);
+  if (i < hdr.count)
+    {
+      /* unusable: start over */
+      track_clear (t);
+      return 0;
+    }
+
+  track_mark_all (t);
+  track_flush (t, 0);
+  return 1;
+}
+
+static void
+track_free (quota_tracker *t)
+{
+  size_t i;
+
+  for (i = 0; (t->buckets != NULL) && (i < t->nbuckets); i++)
+    {
+      struct track_dir *d, *next;
+
+      for (d = t->buckets[i]; d != NULL; d = next)
+        {
+          next = d->next;
+          track_dir_free (d);
+        }
+    }
+  if (t->fan != -1)
+    close (t->fan);
+  if (t->rootfd != -1)
+    close (t->rootfd);
+  if (t->hdr != NULL)
+    munmap (t->hdr, t->maplen);
+  track_links_clear (t);
+  pthread_mutex_destroy (&t->lock);
+  free (t->buckets);
+  free (t->link_buckets);
+  free (t->dirty);
+  free (t->events);
+  free (t->dirs_path);
+  free (t);
+}
+
+void
+quota_tracker_close (quota_tracker *t)
+{
+  if (t == NULL)
+    return;
+  quota_tracker_save (t);
+  track_free (t);
+}
+
+/*
+ * create the state file, or map an existing one as it is
+ */
+static int
+track_open_state (quota_tracker *t, const char *state, unsigned int slots)
+{
+  struct track_header hdr;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open (state, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return -1;
+  if (fstat (fd, &st) != 0)
+    goto failure;
+  if (st.st_size == 0)
+    {
+      uint32_t n = 1;
+
+      if ((slots == 0) || (slots > (1u << 26)))
+        {
+          errno = EINVAL;
+          goto failure;
+        }
+      while (n < slots)
+        n <<= 1;
+      memset (&hdr, 0, sizeof (hdr));
+      memcpy (hdr.magic, TRACK_MAGIC, sizeof (hdr.magic));
+      hdr.version = TRACK_VERSION;
+      hdr.bom = TRACK_BOM;
+      hdr.slots = n;
+      st.st_size = sizeof (hdr) + (off_t)n * sizeof (struct track_total);
+      if ((ftruncate (fd, st.st_size) != 0)
+          || (pwrite (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr)))
+        goto failure;
+    }
+  else if ((st.st_size < (off_t)sizeof (hdr))
+           || (pread (fd, &hdr, sizeof (hdr), 0) != sizeof (hdr))
+           || memcmp (hdr.magic, TRACK_MAGIC, sizeof (hdr.magic))
+           || (hdr.version != TRACK_VERSION) || (hdr.bom != TRACK_BOM)
+           || (st.st_size
+               != (off_t)(sizeof (hdr)
+                          + (off_t)hdr.slots * sizeof (struct track_total))))
+    {
+      errno = EINVAL;
+      goto failure;
+    }
+
+  map = mmap (NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    goto failure;
+  close (fd);
+  t->hdr = map;
+  t->maplen = st.st_size;
+  return 0;
+
+failure:
+  close (fd);
+  return -1;
+}
+
+quota_tracker *
+quota_tracker_open (char *path, char *state, unsigned int slots, int threads,
+                    int flags)
+{
+  union track_handle h;
+  quota_tracker *t;
+  scan_ret ret;
+
+  t = calloc (1, sizeof (*t));
+  if (t == NULL)
+    return NULL;
+  pthread_mutex_init (&t->lock, NULL);
+  t->fan = t->rootfd = -1;
+  t->flags = flags & PHP_QUOTA_SCAN_PROJECT;
+  t->threads = threads;
+  t->nbuckets = 1024;
+  t->buckets = calloc (t->nbuckets, sizeof (*t->buckets));
+  t->events = malloc (TRACK_BUFSIZE);
+  t->dirs_path = malloc (strlen (state) + 6);
+  if ((t->buckets == NULL) || (t->events == NULL) || (t->dirs_path == NULL))
+    goto failure;
+  sprintf (t->dirs_path, "%s.dirs", state);
+
+  t->rootfd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if ((t->rootfd == -1)
+      || ((t->root = track_name_key (t->rootfd, "", &h)) == 0))
+    goto failure;
+  /* events from here on, so that nothing is missed while walking */
+  t->fan = fanotify_init (FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK
+                              | FAN_UNLIMITED_QUEUE | FAN_REPORT_FID
+                              | FAN_REPORT_DFID_NAME,
+                          O_RDONLY | O_CLOEXEC);
+  if ((t->fan == -1)
+      || (fanotify_mark (t->fan, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                         TRACK_EVENTS, t->rootfd, NULL)
+          != 0))
+    goto failure;
+  if (track_open_state (t, state, slots) != 0)
+    goto failure;
+
+  if (!track_load (t))
+    {
+      track_clear (t);
+      if (scan_tree (path, threads, t->flags | PHP_QUOTA_SCAN_XDEV,
+                     track_scan_dir, t, &ret)
+          != 0)
+        goto failure;
+      t->errors += ret.errors;
+      if (quota_tracker_save (t) != 0)
+        goto failure;
+    }
+  errno = 0;
+  return t;
+
+failure:
+  {
+    int err = errno;
+
+    track_free (t);
+    errno = err;
+    return NULL;
+  }
+}
+
+#else /* !FAN_REPORT_DFID_NAME || !STATX_BASIC_STATS */
+
+quota_tracker *
+quota_tracker_open (char *path, char *state, unsigned int slots, int threads,
+                    int flags)
+{
+  errno = ENOTSUP;
+  return NULL;
+}
+
+int
+quota_tracker_fd (quota_tracker *t)
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+int
+quota_tracker_run (quota_tracker *t, int timeout)
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+int
+quota_tracker_save (quota_tracker *t)
+{
+  errno = ENOTSUP;
+  return -1;
+}
+
+void
+quota_tracker_close (quota_tracker *t)
+{
+}
+
+#endif